@@ -31,6 +31,14 @@
 #include <memory>
 #include <tuple>
 #include <array>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <type_traits>
+#include <atomic>
 
 #define PASTRY_GLSL(src) "#version 150\n" #src
 
@@ -45,11 +53,15 @@ namespace pastry
 		vertex_shader,
 		geometry_shader,
 		fragment_shader,
+		compute_shader,
 		program,
 		vertex_array,
 		texture_base,
+		sampler,
 		renderbuffer,
-		framebuffer
+		framebuffer,
+		transform_feedback,
+		query
 	};
 
 	namespace detail
@@ -62,11 +74,15 @@ namespace pastry
 			PASTRY_RESOURCE_NAME(vertex_shader)
 			PASTRY_RESOURCE_NAME(geometry_shader)
 			PASTRY_RESOURCE_NAME(fragment_shader)
+			PASTRY_RESOURCE_NAME(compute_shader)
 			PASTRY_RESOURCE_NAME(program)
 			PASTRY_RESOURCE_NAME(vertex_array)
 			PASTRY_RESOURCE_NAME(texture_base)
+			PASTRY_RESOURCE_NAME(sampler)
 			PASTRY_RESOURCE_NAME(renderbuffer)
 			PASTRY_RESOURCE_NAME(framebuffer)
+			PASTRY_RESOURCE_NAME(transform_feedback)
+			PASTRY_RESOURCE_NAME(query)
 			}
 			#undef PASTRY_RESOURCE_NAME
 		}
@@ -77,11 +93,212 @@ namespace pastry
 
 	namespace detail
 	{
+		/** -1: not yet decided, 0: bind-to-edit, 1: direct state access
+		 * Atomic because objects may be created on loader threads.
+		 */
+		inline std::atomic<int>& dsa_mode()
+		{
+			static std::atomic<int> mode(-1);
+			return mode;
+		}
+
+		inline bool dsa_supported()
+		{ return GLEW_VERSION_4_5 || GLEW_ARB_direct_state_access; }
+
+		/** True if objects are created and edited with direct state access */
+		inline bool dsa()
+		{
+		#ifdef PASTRY_NO_DSA
+			return false;
+		#else
+			int mode = dsa_mode().load();
+			if(mode == -1) {
+				// the first decision wins if several threads decide at once
+				int decided = dsa_supported() ? 1 : 0;
+				dsa_mode().compare_exchange_strong(mode, decided);
+				mode = dsa_mode().load();
+			}
+			return mode == 1;
+		#endif
+		}
+	}
+
+	/** Selects how pastry creates and edits objects
+	 * With direct state access (OpenGL 4.5 or ARB_direct_state_access) buffers, textures,
+	 * vertex arrays and framebuffers are edited by name and the current bindings are not
+	 * changed. Otherwise objects are bound before they are edited. DSA is used by default
+	 * if the context supports it; define PASTRY_NO_DSA to always bind.
+	 * Must be called before the first object is created, as objects which were generated
+	 * but never bound can not be edited with DSA.
+	 */
+	inline void use_direct_state_access(bool enable)
+	{ detail::dsa_mode() = (enable && detail::dsa_supported()) ? 1 : 0; }
+
+	inline bool uses_direct_state_access()
+	{ return detail::dsa(); }
+
+	namespace detail
+	{
+		/** Shadow of the textures and samplers bound to texture units by pastry
+		 * Used to skip redundant binds. There is one shadow per thread, i.e. per
+		 * current context. Call invalidate() after binding textures with raw GL calls.
+		 */
+		struct texture_unit_shadow
+		{
+			struct unit
+			{
+				GLenum target = 0;
+				glid_t texture = 0;
+				glid_t sampler = 0;
+			};
+
+			unsigned active = 0;
+			std::vector<unit> units;
+
+			unit& get(unsigned i)
+			{
+				if(i >= units.size()) {
+					units.resize(i + 1);
+				}
+				return units[i];
+			}
+
+			void invalidate()
+			{
+				// zero never matches a texture or sampler which is about to be bound
+				for(unit& u : units) {
+					u = unit();
+					u.texture = ~glid_t(0);
+					u.sampler = ~glid_t(0);
+				}
+			}
+
+			void forget_texture(glid_t id)
+			{
+				for(unit& u : units) {
+					if(u.texture == id) u.texture = 0;
+				}
+			}
+
+			void forget_sampler(glid_t id)
+			{
+				for(unit& u : units) {
+					if(u.sampler == id) u.sampler = 0;
+				}
+			}
+		};
+
+		inline texture_unit_shadow& texture_units()
+		{
+			static thread_local texture_unit_shadow shadow;
+			return shadow;
+		}
+
+		/** Shadow of the capabilities enabled with glEnable
+		 * Starts with the defaults of a new context. Capabilities are only queried with
+		 * glIsEnabled if they are unknown, i.e. after invalidate().
+		 */
+		struct capability_shadow
+		{
+			std::vector<std::pair<GLenum, bool>> known;
+			bool assume_defaults = true;
+			GLuint restart_index = 0;
+			bool restart_index_known = true;
+
+			bool get(GLenum cap)
+			{
+				for(const std::pair<GLenum, bool>& k : known) {
+					if(k.first == cap) return k.second;
+				}
+				bool enabled = assume_defaults
+					? (cap == GL_DITHER || cap == GL_MULTISAMPLE)
+					: (glIsEnabled(cap) == GL_TRUE);
+				known.push_back({cap, enabled});
+				return enabled;
+			}
+
+			/** Calls glEnable or glDisable if the capability is not already in that state */
+			void set(GLenum cap, bool enabled)
+			{
+				for(std::pair<GLenum, bool>& k : known) {
+					if(k.first == cap) {
+						if(k.second != enabled) {
+							issue(cap, enabled);
+							k.second = enabled;
+						}
+						return;
+					}
+				}
+				if(!assume_defaults || get(cap) != enabled) {
+					issue(cap, enabled);
+				}
+				set_known(cap, enabled);
+			}
+
+			/** Calls glPrimitiveRestartIndex if the index differs from the last one */
+			void set_restart_index(GLuint index)
+			{
+				if(!restart_index_known || restart_index != index) {
+					glPrimitiveRestartIndex(index);
+					restart_index = index;
+					restart_index_known = true;
+				}
+			}
+
+			void invalidate()
+			{
+				known.clear();
+				assume_defaults = false;
+				restart_index_known = false;
+			}
+
+		private:
+			static void issue(GLenum cap, bool enabled)
+			{
+				if(enabled) {
+					glEnable(cap);
+				}
+				else {
+					glDisable(cap);
+				}
+			}
+
+			void set_known(GLenum cap, bool enabled)
+			{
+				for(std::pair<GLenum, bool>& k : known) {
+					if(k.first == cap) {
+						k.second = enabled;
+						return;
+					}
+				}
+				known.push_back({cap, enabled});
+			}
+		};
+
+		inline capability_shadow& capabilities()
+		{
+			static thread_local capability_shadow shadow;
+			return shadow;
+		}
+
+		/** Enables restarting strips at the largest index of 'index_type' or disables restarts */
+		inline void set_primitive_restart(GLenum index_type, bool enabled)
+		{
+			if(GLEW_VERSION_4_3) {
+				capabilities().set(GL_PRIMITIVE_RESTART_FIXED_INDEX, enabled);
+				return;
+			}
+			capabilities().set(GL_PRIMITIVE_RESTART, enabled);
+			if(enabled) {
+				capabilities().set_restart_index(index_type == GL_UNSIGNED_BYTE ? 0xff : (index_type == GL_UNSIGNED_SHORT ? 0xffff : 0xffffffff));
+			}
+		}
+
 		template<rid id> struct handler;
 
 		template<> struct handler<rid::buffer>
 		{
-			static glid_t gl_create() { glid_t id; glGenBuffers(1, &id); return id; }
+			static glid_t gl_create() { glid_t id; if(dsa()) glCreateBuffers(1, &id); else glGenBuffers(1, &id); return id; }
 			static void gl_delete(glid_t id) { glDeleteBuffers(1, &id); }
 		};
 
@@ -103,6 +320,12 @@ namespace pastry
 			static void gl_delete(glid_t id) { glDeleteShader(id); }
 		};
 
+		template<> struct handler<rid::compute_shader>
+		{
+			static glid_t gl_create() { return glCreateShader(GL_COMPUTE_SHADER); }
+			static void gl_delete(glid_t id) { glDeleteShader(id); }
+		};
+
 		template<> struct handler<rid::program>
 		{
 			static glid_t gl_create() { return glCreateProgram(); }
@@ -111,28 +334,64 @@ namespace pastry
 
 		template<> struct handler<rid::vertex_array>
 		{
-			static glid_t gl_create() { glid_t id; glGenVertexArrays(1, &id); return id; }
+			static glid_t gl_create() { glid_t id; if(dsa()) glCreateVertexArrays(1, &id); else glGenVertexArrays(1, &id); return id; }
 			static void gl_delete(glid_t id) { glDeleteVertexArrays(1, &id); }
 		};
 
 		template<> struct handler<rid::texture_base>
 		{
 			static glid_t gl_create() { glid_t id; glGenTextures(1, &id); return id; }
-			static void gl_delete(glid_t id) { glDeleteTextures(1, &id); }
+			static void gl_delete(glid_t id) { texture_units().forget_texture(id); glDeleteTextures(1, &id); }
+		};
+
+		/** DSA textures must be created with their target as it can not be set by binding */
+		inline glid_t create_texture(GLenum target)
+		{
+			glid_t id;
+			if(dsa()) glCreateTextures(target, 1, &id);
+			else glGenTextures(1, &id);
+			return id;
+		}
+
+		template<> struct handler<rid::sampler>
+		{
+			static glid_t gl_create() { glid_t id; glGenSamplers(1, &id); return id; }
+			static void gl_delete(glid_t id) { texture_units().forget_sampler(id); glDeleteSamplers(1, &id); }
 		};
 
 		template<> struct handler<rid::renderbuffer>
 		{
-			static glid_t gl_create() { glid_t id; glGenRenderbuffers(1, &id); return id; }
+			static glid_t gl_create() { glid_t id; if(dsa()) glCreateRenderbuffers(1, &id); else glGenRenderbuffers(1, &id); return id; }
 			static void gl_delete(glid_t id) { glDeleteRenderbuffers(1, &id); }
 		};
 
 		template<> struct handler<rid::framebuffer>
 		{
-			static glid_t gl_create() { glid_t id; glGenFramebuffers(1, &id); return id; }
+			static glid_t gl_create() { glid_t id; if(dsa()) glCreateFramebuffers(1, &id); else glGenFramebuffers(1, &id); return id; }
 			static void gl_delete(glid_t id) { glDeleteFramebuffers(1, &id); }
 		};
 
+		template<> struct handler<rid::transform_feedback>
+		{
+			static glid_t gl_create() { glid_t id; if(dsa()) glCreateTransformFeedbacks(1, &id); else glGenTransformFeedbacks(1, &id); return id; }
+			static void gl_delete(glid_t id) { glDeleteTransformFeedbacks(1, &id); }
+		};
+
+		template<> struct handler<rid::query>
+		{
+			static glid_t gl_create() { glid_t id; glGenQueries(1, &id); return id; }
+			static void gl_delete(glid_t id) { glDeleteQueries(1, &id); }
+		};
+
+		/** DSA queries must be created with their target */
+		inline glid_t create_query(GLenum target)
+		{
+			glid_t id;
+			if(dsa()) glCreateQueries(target, 1, &id);
+			else glGenQueries(1, &id);
+			return id;
+		}
+
 		constexpr glid_t INVALID_ID = 0;
 
 		template<rid R>
@@ -349,6 +608,18 @@ namespace pastry
 		{ detail::compile_shader(id(), source); }
 	};
 
+	struct compute_shader
+	: public detail::resource<rid::compute_shader>
+	{
+		compute_shader() {}
+		
+		compute_shader(const std::string& source)
+		{ compile(source); }
+		
+		void compile(const std::string& source)
+		{ detail::compile_shader(id(), source); }
+	};
+
 	template<typename T>
 	T load_shader(const std::string& filename)
 	{ return T{detail::load_text_file(filename)}; }
@@ -357,12 +628,67 @@ namespace pastry
 
 	template<typename T, unsigned int NUM> struct uniform;
 
+	template<int TARGET> struct buffer;
+
+	namespace detail
+	{
+		inline bool is_sampler_type(GLenum type)
+		{
+			switch(type) {
+			case GL_SAMPLER_1D: case GL_SAMPLER_2D: case GL_SAMPLER_3D: case GL_SAMPLER_CUBE:
+			case GL_SAMPLER_1D_SHADOW: case GL_SAMPLER_2D_SHADOW: case GL_SAMPLER_CUBE_SHADOW:
+			case GL_SAMPLER_1D_ARRAY: case GL_SAMPLER_2D_ARRAY:
+			case GL_SAMPLER_1D_ARRAY_SHADOW: case GL_SAMPLER_2D_ARRAY_SHADOW:
+			case GL_SAMPLER_2D_MULTISAMPLE: case GL_SAMPLER_2D_MULTISAMPLE_ARRAY:
+			case GL_SAMPLER_BUFFER: case GL_SAMPLER_2D_RECT: case GL_SAMPLER_2D_RECT_SHADOW:
+			case GL_SAMPLER_CUBE_MAP_ARRAY: case GL_SAMPLER_CUBE_MAP_ARRAY_SHADOW:
+			case GL_INT_SAMPLER_1D: case GL_INT_SAMPLER_2D: case GL_INT_SAMPLER_3D: case GL_INT_SAMPLER_CUBE:
+			case GL_INT_SAMPLER_1D_ARRAY: case GL_INT_SAMPLER_2D_ARRAY:
+			case GL_INT_SAMPLER_2D_MULTISAMPLE: case GL_INT_SAMPLER_2D_MULTISAMPLE_ARRAY:
+			case GL_INT_SAMPLER_BUFFER: case GL_INT_SAMPLER_2D_RECT: case GL_INT_SAMPLER_CUBE_MAP_ARRAY:
+			case GL_UNSIGNED_INT_SAMPLER_1D: case GL_UNSIGNED_INT_SAMPLER_2D: case GL_UNSIGNED_INT_SAMPLER_3D:
+			case GL_UNSIGNED_INT_SAMPLER_CUBE: case GL_UNSIGNED_INT_SAMPLER_1D_ARRAY: case GL_UNSIGNED_INT_SAMPLER_2D_ARRAY:
+			case GL_UNSIGNED_INT_SAMPLER_2D_MULTISAMPLE: case GL_UNSIGNED_INT_SAMPLER_2D_MULTISAMPLE_ARRAY:
+			case GL_UNSIGNED_INT_SAMPLER_BUFFER: case GL_UNSIGNED_INT_SAMPLER_2D_RECT:
+			case GL_UNSIGNED_INT_SAMPLER_CUBE_MAP_ARRAY:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		/** A sampler uniform and the first texture unit assigned to it */
+		struct sampler_slot
+		{
+			std::string name; // without "[0]" for arrays
+			GLint loc;
+			GLenum type;
+			unsigned size; // number of array elements
+			unsigned unit;
+		};
+
+		/** Information about a program which is gathered when it is linked */
+		struct program_info
+		{
+			std::vector<sampler_slot> samplers;
+			unsigned num_units = 0;
+			bool compute = false;
+			std::array<GLint,3> work_group_size = {{0, 0, 0}};
+		};
+	}
+
 	struct program
 	: public detail::resource<rid::program>
 	{
-		program() {}
+	private:
+		std::shared_ptr<detail::program_info> info_;
+
+	public:
+		program()
+		: info_(std::make_shared<detail::program_info>()) {}
 		
 		program(const vertex_shader& vs, const fragment_shader& fs)
+		: info_(std::make_shared<detail::program_info>())
 		{
 			attach(vs);
 			attach(fs);
@@ -370,12 +696,20 @@ namespace pastry
 		}
 		
 		program(const vertex_shader& vs, const geometry_shader& gs, const fragment_shader& fs)
+		: info_(std::make_shared<detail::program_info>())
 		{
 			attach(vs);
 			attach(gs);
 			attach(fs);
 			link();
 		}
+
+		program(const compute_shader& cs)
+		: info_(std::make_shared<detail::program_info>())
+		{
+			attach(cs);
+			link();
+		}
 		
 		void attach(const vertex_shader& s)
 		{ glAttachShader(id(), s.id()); }
@@ -385,6 +719,25 @@ namespace pastry
 		
 		void attach(const fragment_shader& s)	
 		{ glAttachShader(id(), s.id()); }
+
+		void attach(const compute_shader& s)
+		{
+			glAttachShader(id(), s.id());
+			info_->compute = true;
+		}
+
+		/** Selects the shader outputs which are captured by transform feedback; call before link()
+		 * mode: GL_INTERLEAVED_ATTRIBS (all outputs into one buffer, in this order) or
+		 * GL_SEPARATE_ATTRIBS (one buffer per output)
+		 */
+		void set_feedback_varyings(const std::vector<std::string>& names, GLenum mode=GL_INTERLEAVED_ATTRIBS)
+		{
+			std::vector<const GLchar*> p;
+			for(const std::string& n : names) {
+				p.push_back(n.data());
+			}
+			glTransformFeedbackVaryings(id(), p.size(), p.data(), mode);
+		}
 		
 		void link()
 		{
@@ -398,7 +751,70 @@ namespace pastry
 				glGetProgramInfoLog(id(), 1024, NULL, buffer);
 				throw invalid_shader_program();
 			}
+			assign_sampler_units();
+			if(info_->compute) {
+				glGetProgramiv(id(), GL_COMPUTE_WORK_GROUP_SIZE, info_->work_group_size.data());
+			}
+		}
+
+		/** Local size of a compute program as declared by layout(local_size_x=...) */
+		const std::array<GLint,3>& work_group_size() const
+		{ return info_->work_group_size; }
+
+		/** Runs a compute program with x*y*z work groups */
+		void dispatch(unsigned x, unsigned y=1, unsigned z=1) const
+		{
+			use();
+			glDispatchCompute(x, y, z);
+		}
+
+		/** Runs a compute program with enough work groups to cover nx*ny*nz invocations
+		 * The shader must discard invocations outside of the domain.
+		 */
+		void dispatch_invocations(unsigned nx, unsigned ny=1, unsigned nz=1) const
+		{
+			const std::array<GLint,3>& g = info_->work_group_size;
+			if(g[0] <= 0 || g[1] <= 0 || g[2] <= 0) {
+				throw exception("pastry: dispatch_invocations needs a compute program");
+			}
+			unsigned gx = static_cast<unsigned>(g[0]);
+			unsigned gy = static_cast<unsigned>(g[1]);
+			unsigned gz = static_cast<unsigned>(g[2]);
+			dispatch((nx + gx - 1) / gx, (ny + gy - 1) / gy, (nz + gz - 1) / gz);
+		}
+
+		/** Runs a compute program with the group counts stored in a buffer at 'offset' */
+		inline void dispatch_indirect(const buffer<GL_DISPATCH_INDIRECT_BUFFER>& cmd, std::size_t offset=0) const;
+
+		/** Assigns a shader storage block to a GL_SHADER_STORAGE_BUFFER binding point */
+		void set_storage_block_binding(const std::string& name, unsigned binding) const
+		{
+			GLuint index = glGetProgramResourceIndex(id(), GL_SHADER_STORAGE_BLOCK, name.data());
+			if(index == GL_INVALID_INDEX) {
+				std::cerr << "ERROR: Inactive or invalid shader storage block '" << name << "'" << std::endl;
+				return;
+			}
+			glShaderStorageBlockBinding(id(), index, binding);
 		}
+
+		/** Sampler uniforms with the texture units assigned to them at link time */
+		const std::vector<detail::sampler_slot>& samplers() const
+		{ return info_->samplers; }
+
+		/** Texture unit of a sampler uniform (or of element 'index' of a sampler array) or -1 */
+		int sampler_unit(const std::string& name, unsigned index=0) const
+		{
+			for(const detail::sampler_slot& q : info_->samplers) {
+				if(q.name == name && index < q.size) {
+					return q.unit + index;
+				}
+			}
+			return -1;
+		}
+
+		/** Number of texture units used by the program */
+		unsigned num_sampler_units() const
+		{ return info_->num_units; }
 		
 		void use() const
 		{ glUseProgram(id()); }
@@ -410,6 +826,51 @@ namespace pastry
 
 		template<typename T, unsigned int NUM=1>
 		uniform<T,NUM> get_uniform(const std::string& name) const;
+
+	private:
+		/** Reflects all sampler uniforms and assigns consecutive texture units once */
+		void assign_sampler_units()
+		{
+			info_->samplers.clear();
+			info_->num_units = 0;
+			GLint num_uniforms = 0;
+			glGetProgramiv(id(), GL_ACTIVE_UNIFORMS, &num_uniforms);
+			for(GLint i=0; i<num_uniforms; i++) {
+				char buffer[256];
+				GLsizei length;
+				GLint size;
+				GLenum type;
+				glGetActiveUniform(id(), i, sizeof(buffer), &length, &size, &type, buffer);
+				if(!detail::is_sampler_type(type)) {
+					continue;
+				}
+				detail::sampler_slot q;
+				q.name = std::string(buffer, length);
+				if(q.name.size() > 3 && q.name.compare(q.name.size() - 3, 3, "[0]") == 0) {
+					q.name.resize(q.name.size() - 3);
+				}
+				q.loc = glGetUniformLocation(id(), buffer);
+				q.type = type;
+				q.size = size;
+				q.unit = info_->num_units;
+				info_->num_units += size;
+				info_->samplers.push_back(q);
+			}
+			if(info_->samplers.empty()) {
+				return;
+			}
+			GLint previous;
+			glGetIntegerv(GL_CURRENT_PROGRAM, &previous);
+			glUseProgram(id());
+			for(const detail::sampler_slot& q : info_->samplers) {
+				std::vector<GLint> units(q.size);
+				for(unsigned k=0; k<q.size; k++) {
+					units[k] = q.unit + k;
+				}
+				glUniform1iv(q.loc, q.size, units.data());
+			}
+			glUseProgram(previous);
+		}
 	};
 
 	inline program create_program(const std::string& src_vertex, const std::string& src_frag) 
@@ -422,6 +883,36 @@ namespace pastry
 		return program{ {src_vertex}, {src_geom}, {src_frag} };
 	}
 
+	/** Creates a program without fragment shader whose outputs are captured by transform feedback */
+	inline program create_feedback_program(const std::string& src_vertex, const std::vector<std::string>& varyings, GLenum mode=GL_INTERLEAVED_ATTRIBS)
+	{
+		program p;
+		p.attach(vertex_shader{src_vertex});
+		p.set_feedback_varyings(varyings, mode);
+		p.link();
+		return p;
+	}
+
+	inline program create_feedback_program(const std::string& src_vertex, const std::string& src_geom, const std::vector<std::string>& varyings, GLenum mode=GL_INTERLEAVED_ATTRIBS)
+	{
+		program p;
+		p.attach(vertex_shader{src_vertex});
+		p.attach(geometry_shader{src_geom});
+		p.set_feedback_varyings(varyings, mode);
+		p.link();
+		return p;
+	}
+
+	inline program create_compute_program(const std::string& src_compute)
+	{
+		return program{ compute_shader{src_compute} };
+	}
+
+	inline program load_compute_program(const std::string& fn_compute)
+	{
+		return program{ load_shader<compute_shader>(fn_compute) };
+	}
+
 	inline program load_program(const std::string& fn_vertex, const std::string& fn_frag)
 	{
 		return program{
@@ -468,6 +959,23 @@ namespace pastry
 
 		void enable()
 		{ glEnableVertexAttribArray(loc); }
+
+		/** Sources the attribute of vertex array 'vao' from buffer 'vbo' (direct state access)
+		 * Uses one buffer binding point per attribute so that the offset is not limited by
+		 * GL_MAX_VERTEX_ATTRIB_RELATIVE_OFFSET.
+		 */
+		void configure(glid_t vao, glid_t vbo, GLint size, GLenum type, GLboolean normalized, GLsizei stride, std::size_t offset)
+		{
+			glVertexArrayVertexBuffer(vao, loc, vbo, offset, stride);
+			glVertexArrayAttribFormat(vao, loc, size, type, normalized, 0);
+			glVertexArrayAttribBinding(vao, loc, loc);
+		}
+
+		void set_divisor(glid_t vao, unsigned divisor)
+		{ glVertexArrayBindingDivisor(vao, loc, divisor); }
+
+		void enable(glid_t vao)
+		{ glEnableVertexArrayAttrib(vao, loc); }
 	};
 
 	vertex_attribute program::get_attribute(const std::string& name) const
@@ -690,12 +1198,12 @@ namespace pastry
 		void set(std::initializer_list<mat_t> values_list)
 		{
 			if(values_list.size() != NUM) {
-				throw invalid_uniform_initializer_list{NUM, values_list.list()};
+				throw invalid_uniform_initializer_list{NUM, unsigned(values_list.size())};
 			}
 			// copy to continuous memory
 			K buff[R*C*NUM];
 			for(unsigned int i=0; i<NUM; i++) {
-				const K* p = values_list[i].data();
+				const K* p = values_list.begin()[i].data();
 				std::copy(p, p+R*C, &buff[i*R*C]);
 			}
 			// write to opengl
@@ -711,7 +1219,7 @@ namespace pastry
 			std::array<mat_t,NUM> a;
 			// read from opengl
 			if(!valid()) {
-				return;
+				return a;
 			}
 			prepare();
 			K buff[R*C*NUM];
@@ -822,14 +1330,15 @@ namespace pastry
 		buffer(std::initializer_list<detail::layout_item> list)
 		: num_bytes_(0), usage_(GL_DYNAMIC_DRAW)
 		{
-			bind();
+			if(!detail::dsa()) {
+				bind();
+			}
 			set_layout(list);
 		}
 
 		buffer(std::initializer_list<detail::layout_item> list, GLuint usage)
 		: num_bytes_(0), usage_(GL_DYNAMIC_DRAW)
 		{
-			bind();
 			set_layout(list);
 			init_data(usage);
 		}
@@ -837,7 +1346,6 @@ namespace pastry
 		buffer(std::initializer_list<detail::layout_item> list, std::size_t num_bytes, GLuint usage)
 		: num_bytes_(0), usage_(GL_DYNAMIC_DRAW)
 		{
-			bind();
 			set_layout(list);
 			init_data(num_bytes, usage);
 		}
@@ -847,6 +1355,16 @@ namespace pastry
 		
 		void bind() const
 		{ glBindBuffer(TARGET, id()); }
+
+		/** Binds the buffer to an indexed binding point, e.g. of a shader storage block */
+		void bind_base(unsigned index) const
+		{ glBindBufferBase(TARGET, index, id()); }
+
+		void bind_range(unsigned index, std::size_t offset, std::size_t num_bytes) const
+		{ glBindBufferRange(TARGET, index, id(), offset, num_bytes); }
+
+		std::size_t num_bytes() const
+		{ return num_bytes_; }
 		
 		template<typename T>
 		void init_data(const std::vector<T>& v, GLuint usage)
@@ -857,7 +1375,7 @@ namespace pastry
 		{ init_data(reinterpret_cast<const void*>(buf), sizeof(T)*num_elements, usage); }
 		
 		void init_data(std::size_t num_bytes, GLuint usage)
-		{ init_data(nullptr, num_bytes_, usage); }
+		{ init_data(nullptr, num_bytes, usage); }
 
 		void init_data(GLuint usage)
 		{ init_data(nullptr, 0, usage); }
@@ -869,14 +1387,102 @@ namespace pastry
 		template<typename T>
 		void update_data(const T* buf, std::size_t num_elements)
 		{ update_data(reinterpret_cast<const void*>(buf), sizeof(T)*num_elements); }
+
+		/** Reads the buffer back, e.g. the result of a compute shader (synchronous) */
+		template<typename T>
+		std::vector<T> get_data() const
+		{
+			std::vector<T> v(num_bytes_ / sizeof(T));
+			get_data(v.data(), 0, v.size()*sizeof(T));
+			return v;
+		}
+
+		void get_data(void* buf, std::size_t offset, std::size_t num_bytes) const
+		{
+			if(detail::dsa()) {
+				glGetNamedBufferSubData(id(), offset, num_bytes, buf);
+			}
+			else {
+				bind();
+				glGetBufferSubData(TARGET, offset, num_bytes, buf);
+			}
+		}
+
+		/** Overwrites 'num_bytes' bytes at 'offset' without reallocating the buffer */
+		void set_sub_data(std::size_t offset, const void* buf, std::size_t num_bytes)
+		{
+			if(detail::dsa()) {
+				glNamedBufferSubData(id(), offset, num_bytes, buf);
+			}
+			else {
+				bind();
+				glBufferSubData(TARGET, offset, num_bytes, buf);
+			}
+		}
+
+		/** Copies bytes between buffers on the GPU; ranges in the same buffer must not overlap */
+		template<int SRC_TARGET>
+		void copy_sub_data(const buffer<SRC_TARGET>& src, std::size_t src_offset, std::size_t dst_offset, std::size_t num_bytes)
+		{
+			if(detail::dsa()) {
+				glCopyNamedBufferSubData(src.id(), id(), src_offset, dst_offset, num_bytes);
+			}
+			else {
+				glBindBuffer(GL_COPY_READ_BUFFER, src.id());
+				glBindBuffer(GL_COPY_WRITE_BUFFER, id());
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, src_offset, dst_offset, num_bytes);
+			}
+		}
+
+		/** Maps a range into client memory, e.g. with GL_MAP_READ_BIT; call unmap() when done */
+		void* map(std::size_t offset, std::size_t num_bytes, GLbitfield access) const
+		{
+			if(detail::dsa()) {
+				return glMapNamedBufferRange(id(), offset, num_bytes, access);
+			}
+			else {
+				bind();
+				return glMapBufferRange(TARGET, offset, num_bytes, access);
+			}
+		}
+
+		/** Returns false if the buffer contents were corrupted while mapped, e.g. by a mode switch */
+		bool unmap() const
+		{
+			if(detail::dsa()) {
+				return glUnmapNamedBuffer(id()) == GL_TRUE;
+			}
+			else {
+				bind();
+				return glUnmapBuffer(TARGET) == GL_TRUE;
+			}
+		}
+
+		/** Allocates immutable storage, e.g. with GL_MAP_PERSISTENT_BIT for buffers which stay mapped (GL 4.4) */
+		void storage(std::size_t num_bytes, GLbitfield flags, const void* data=nullptr)
+		{
+			num_bytes_ = num_bytes;
+			if(detail::dsa()) {
+				glNamedBufferStorage(id(), num_bytes, data, flags);
+			}
+			else {
+				bind();
+				glBufferStorage(TARGET, num_bytes, data, flags);
+			}
+		}
 		
 	private:
 		void init_data(const void* buf, std::size_t num_bytes, GLuint usage)
 		{
 			usage_ = usage;
 			num_bytes_ = num_bytes;
-			bind();
-			glBufferData(TARGET, num_bytes_, buf, usage);
+			if(detail::dsa()) {
+				glNamedBufferData(id(), num_bytes_, buf, usage);
+			}
+			else {
+				bind();
+				glBufferData(TARGET, num_bytes_, buf, usage);
+			}
 		}
 
 		void update_data(const void* buf, std::size_t num_bytes)
@@ -884,6 +1490,9 @@ namespace pastry
 			if(num_bytes != num_bytes_) {
 				init_data(buf, num_bytes, usage_);
 			}
+			else if(detail::dsa()) {
+				glNamedBufferSubData(id(), 0, num_bytes, buf);
+			}
 			else {
 				bind();
 				glBufferSubData(TARGET, 0, num_bytes, buf);
@@ -898,9 +1507,52 @@ namespace pastry
 
 	typedef buffer<GL_ELEMENT_ARRAY_BUFFER> element_array_buffer;
 
-	namespace detail
+	typedef buffer<GL_SHADER_STORAGE_BUFFER> shader_storage_buffer;
+
+	/** Target of glReadPixels while bound, e.g. for asynchronous readbacks */
+	typedef buffer<GL_PIXEL_PACK_BUFFER> pixel_pack_buffer;
+
+	/** Holds {num_groups_x, num_groups_y, num_groups_z} as GLuint for program::dispatch_indirect */
+	typedef buffer<GL_DISPATCH_INDIRECT_BUFFER> dispatch_indirect_buffer;
+
+	void program::dispatch_indirect(const dispatch_indirect_buffer& cmd, std::size_t offset) const
 	{
-		struct mapping
+		use();
+		cmd.bind();
+		glDispatchComputeIndirect(offset);
+	}
+
+	typedef buffer<GL_DRAW_INDIRECT_BUFFER> draw_indirect_buffer;
+
+	/** One command in a draw_indirect_buffer for glDrawArraysIndirect */
+	struct draw_arrays_indirect_command
+	{
+		GLuint count;
+		GLuint instance_count;
+		GLuint first;
+		GLuint base_instance;
+	};
+
+	/** One command in a draw_indirect_buffer for glDrawElementsIndirect */
+	struct draw_elements_indirect_command
+	{
+		GLuint count;
+		GLuint instance_count;
+		GLuint first_index;
+		GLint base_vertex;
+		GLuint base_instance;
+	};
+
+	/** Orders shader writes against later reads, e.g. GL_SHADER_STORAGE_BARRIER_BIT
+	 * after a compute pass which writes a buffer that is then read by another pass.
+	 * barriers is a combination of GL_*_BARRIER_BIT describing how the data is read next.
+	 */
+	inline void memory_barrier(GLbitfield barriers=GL_ALL_BARRIER_BITS)
+	{ glMemoryBarrier(barriers); }
+
+	namespace detail
+	{
+		struct mapping
 		{
 			std::string shader_name;
 			array_buffer vb;
@@ -935,10 +1587,14 @@ namespace pastry
 		vertex_array(const program& p, std::initializer_list<detail::mapping> list)
 		{ set_layout(p, list.begin(), list.end()); }
 
+		/** Connects shader attributes to buffers; binds the vertex array unless DSA is used */
 		template<typename It>
 		void set_layout(const program& p, It kt1, It kt2)
 		{
-			bind();
+			const bool dsa = detail::dsa();
+			if(!dsa) {
+				bind();
+			}
 			for(auto kt=kt1; kt!=kt2; ++kt) {
 				const detail::mapping& m = *kt;
 				const std::string& shader_name = m.shader_name;
@@ -951,10 +1607,17 @@ namespace pastry
 					std::cerr << "ERROR: Could not find variable '" << vn_name << "' in buffer layout!" << std::endl;
 					continue;
 				}
-				// need to bind array buffer to establish connection between shader and buffer
-				vb.bind();
 				// create vertex attribute
 				vertex_attribute va = p.get_attribute(shader_name);
+				if(dsa) {
+					va.configure(id(), vb.id(), it->size, it->type, GL_FALSE, vb.layout_.back().offset_end, it->offset_begin);
+					va.enable(id());
+					va.set_divisor(id(), m.divisor);
+					attributes_.push_back(va);
+					continue;
+				}
+				// need to bind array buffer to establish connection between shader and buffer
+				vb.bind();
 				// std::cout << "shader_name = " << shader_name << std::endl;
 				// std::cout << "vb = " << vb << std::endl;
 				// std::cout << "vn_name = " << vn_name << std::endl;
@@ -1040,12 +1703,14 @@ namespace pastry
 		void draw_elements() const
 		{
 			std::size_t count = m_traits::num_per_element*indices.size();
+			detail::set_primitive_restart(INDEX_TYPE, false);
 			glDrawElements(MODE, count, INDEX_TYPE, 0);
 		}
 
 		void draw_elements_instanced(std::size_t primcount) const
 		{
 			std::size_t count = m_traits::num_per_element*indices.size();
+			detail::set_primitive_restart(INDEX_TYPE, false);
 			glDrawElementsInstanced(MODE, count, INDEX_TYPE, 0, primcount);
 		}
 	};
@@ -1068,6 +1733,467 @@ namespace pastry
 	// template<typename V>
 	// using triangle_mesh = mesh<V, GL_TRIANGLES>;
 
+	/** Query object, e.g. for occlusion queries with GL_SAMPLES_PASSED,
+	 * GL_ANY_SAMPLES_PASSED or GL_ANY_SAMPLES_PASSED_CONSERVATIVE
+	 */
+	struct query
+	: public detail::resource<rid::query>
+	{
+	private:
+		GLenum target_;
+
+	public:
+		query(GLenum target=GL_ANY_SAMPLES_PASSED_CONSERVATIVE)
+		: detail::resource<rid::query>(detail::create_query(target)), target_(target)
+		{}
+
+		GLenum target() const
+		{ return target_; }
+
+		void begin() const
+		{ glBeginQuery(target_, id()); }
+
+		void end() const
+		{ glEndQuery(target_); }
+
+		/** True if the result can be read without waiting for the GPU */
+		bool available() const
+		{
+			GLuint available = 0;
+			glGetQueryObjectuiv(id(), GL_QUERY_RESULT_AVAILABLE, &available);
+			return available != 0;
+		}
+
+		/** Reads the result if it is available; never blocks */
+		bool try_result(GLuint64& result) const
+		{
+			if(!available()) {
+				return false;
+			}
+			glGetQueryObjectui64v(id(), GL_QUERY_RESULT, &result);
+			return true;
+		}
+
+		/** Waits for the result */
+		GLuint64 result() const
+		{
+			GLuint64 result;
+			glGetQueryObjectui64v(id(), GL_QUERY_RESULT, &result);
+			return result;
+		}
+	};
+
+	/** Discards draw calls in its scope if no samples passed for an occlusion query
+	 * The GPU evaluates the query; the CPU never waits. With a *_NO_WAIT mode the draw
+	 * calls are executed if the result is not yet available.
+	 * Usage example:
+	 *   occlusion.begin(); proxy.render(); occlusion.end();
+	 *   { pastry::conditional_render cr(occlusion); mesh.render(); }
+	 */
+	struct conditional_render
+	{
+		conditional_render(const query& q, GLenum mode=GL_QUERY_NO_WAIT)
+		{ glBeginConditionalRender(q.id(), mode); }
+
+		conditional_render(const conditional_render&) = delete;
+		conditional_render& operator=(const conditional_render&) = delete;
+
+		~conditional_render()
+		{ glEndConditionalRender(); }
+	};
+
+	/** Recycles queries and collects their results without blocking
+	 * Usage example:
+	 *   pastry::query_pool pool(GL_SAMPLES_PASSED);
+	 *   pastry::query q = pool.acquire();
+	 *   q.begin(); proxy.render(); q.end();
+	 *   pool.submit(q, [&](GLuint64 samples) { object.visible = samples > 0; });
+	 *   // every frame
+	 *   pool.poll();
+	 */
+	struct query_pool
+	{
+	private:
+		struct pending
+		{
+			query q;
+			std::function<void(GLuint64)> on_result;
+		};
+
+		GLenum target_;
+		std::vector<query> free_;
+		std::vector<pending> pending_;
+
+	public:
+		query_pool(GLenum target=GL_ANY_SAMPLES_PASSED_CONSERVATIVE)
+		: target_(target)
+		{}
+
+		/** A query which is not in flight */
+		query acquire()
+		{
+			if(free_.empty()) {
+				return query(target_);
+			}
+			query q = free_.back();
+			free_.pop_back();
+			return q;
+		}
+
+		/** Hands over a query which has been ended; on_result is called in poll() */
+		void submit(const query& q, std::function<void(GLuint64)> on_result)
+		{ pending_.push_back(pending{q, on_result}); }
+
+		/** Calls on_result for all available results and recycles their queries; never blocks */
+		void poll()
+		{
+			auto it = pending_.begin();
+			while(it != pending_.end()) {
+				GLuint64 result;
+				if(!it->q.try_result(result)) {
+					++it;
+					continue;
+				}
+				if(it->on_result) it->on_result(result);
+				free_.push_back(it->q);
+				it = pending_.erase(it);
+			}
+		}
+
+		std::size_t num_pending() const
+		{ return pending_.size(); }
+	};
+
+	/** Sync object which is signaled when the GPU has completed all commands issued before it
+	 * Constructing a fence inserts it into the command stream; copies share the sync object.
+	 */
+	struct fence
+	{
+	private:
+		std::shared_ptr<std::remove_pointer<GLsync>::type> sync_;
+
+	public:
+		fence()
+		: sync_(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), [](GLsync s) { glDeleteSync(s); })
+		{}
+
+		/** An empty fence which counts as signaled */
+		fence(std::nullptr_t)
+		{}
+
+		bool valid() const
+		{ return static_cast<bool>(sync_); }
+
+		GLsync get() const
+		{ return sync_.get(); }
+
+		/** True if the GPU has passed the fence; never blocks */
+		bool signaled() const
+		{ return !sync_ || glClientWaitSync(sync_.get(), 0, 0) != GL_TIMEOUT_EXPIRED; }
+
+		/** Blocks the CPU until the fence is signaled or the timeout expires; returns false on timeout */
+		bool wait(GLuint64 timeout_ns=GL_TIMEOUT_IGNORED) const
+		{
+			if(!sync_) {
+				return true;
+			}
+			GLenum result = glClientWaitSync(sync_.get(), GL_SYNC_FLUSH_COMMANDS_BIT, timeout_ns);
+			if(result == GL_WAIT_FAILED) {
+				throw exception("pastry: waiting for a fence failed");
+			}
+			return result != GL_TIMEOUT_EXPIRED;
+		}
+
+		/** Makes the GPU command stream of the current context wait for the fence, e.g. of another context */
+		void wait_gpu() const
+		{
+			if(sync_) {
+				glWaitSync(sync_.get(), 0, GL_TIMEOUT_IGNORED);
+			}
+		}
+	};
+
+	/** Bounds the number of frames the CPU runs ahead of the GPU
+	 * begin_frame() waits until at most 'frames_in_flight - 1' earlier frames are still
+	 * executing on the GPU and returns the slot of the new frame, i.e. the index into
+	 * per-frame copies of streaming buffers. Work which must wait for the GPU, like
+	 * deleting or reusing a buffer region, can be deferred until the current frame completes.
+	 * Latency is measured from end_frame() until the frame is seen as complete, i.e. it
+	 * includes the time until the next check.
+	 * Usage example:
+	 *   pastry::frame_pacer pacer(3);
+	 *   // every frame
+	 *   unsigned slot = pacer.begin_frame();
+	 *   upload_buffers[slot].update_data(...);
+	 *   pacer.defer([old]() { ... });  // runs once this frame has completed
+	 *   render();
+	 *   pacer.end_frame();
+	 */
+	struct frame_pacer
+	{
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		/** Seconds between submitting and completing frames, over the last 'window' frames */
+		struct latency_stats
+		{
+			double last = 0.0;
+			double average = 0.0;
+			double max = 0.0;
+			std::size_t num_frames = 0;
+		};
+
+	private:
+		struct frame
+		{
+			uint64_t number;
+			fence sync;
+			clock::time_point submitted;
+			std::vector<std::function<void()>> deferred;
+		};
+
+		unsigned frames_in_flight_;
+		std::size_t window_;
+		uint64_t frame_;
+		uint64_t completed_;
+		std::deque<frame> in_flight_;
+		std::vector<std::function<void()>> deferred_;
+		std::deque<double> latencies_;
+		double last_wait_;
+
+	public:
+		frame_pacer(unsigned frames_in_flight=2, std::size_t window=60)
+		: frames_in_flight_(std::max(1u, frames_in_flight)), window_(window),
+		  frame_(0), completed_(0), last_wait_(0.0)
+		{}
+
+		frame_pacer(const frame_pacer&) = delete;
+		frame_pacer& operator=(const frame_pacer&) = delete;
+
+		unsigned frames_in_flight() const
+		{ return frames_in_flight_; }
+
+		/** Waits until a frame slot is free and returns it (0 to frames_in_flight - 1) */
+		unsigned begin_frame()
+		{
+			poll();
+			auto start = clock::now();
+			while(in_flight_.size() >= frames_in_flight_) {
+				in_flight_.front().sync.wait();
+				retire();
+			}
+			last_wait_ = std::chrono::duration<double>(clock::now() - start).count();
+			return slot();
+		}
+
+		/** Inserts the fence of the current frame */
+		void end_frame()
+		{
+			in_flight_.push_back(frame{frame_, fence(), clock::now(), std::move(deferred_)});
+			deferred_.clear();
+			frame_++;
+		}
+
+		/** Slot of the current frame */
+		unsigned slot() const
+		{ return frame_ % frames_in_flight_; }
+
+		/** Number of the current frame; frames are numbered from 0 */
+		uint64_t frame_number() const
+		{ return frame_; }
+
+		/** Number of frames which the GPU has completed, i.e. frames 0 to num_completed() - 1 */
+		uint64_t num_completed() const
+		{ return completed_; }
+
+		bool is_complete(uint64_t number) const
+		{ return number < completed_; }
+
+		/** Calls f once the GPU has completed the current frame */
+		void defer(std::function<void()> f)
+		{ deferred_.push_back(f); }
+
+		/** Retires all completed frames; never blocks */
+		void poll()
+		{
+			while(!in_flight_.empty() && in_flight_.front().sync.signaled()) {
+				retire();
+			}
+		}
+
+		/** Waits for all frames and runs all deferred functions */
+		void finish()
+		{
+			while(!in_flight_.empty()) {
+				in_flight_.front().sync.wait();
+				retire();
+			}
+			for(std::function<void()>& f : deferred_) {
+				f();
+			}
+			deferred_.clear();
+		}
+
+		/** Seconds the last begin_frame() was blocked waiting for the GPU */
+		double last_wait() const
+		{ return last_wait_; }
+
+		latency_stats latency() const
+		{
+			latency_stats s;
+			if(latencies_.empty()) {
+				return s;
+			}
+			s.last = latencies_.back();
+			for(double t : latencies_) {
+				s.average += t;
+				s.max = std::max(s.max, t);
+			}
+			s.num_frames = latencies_.size();
+			s.average /= double(s.num_frames);
+			return s;
+		}
+
+	private:
+		void retire()
+		{
+			frame& f = in_flight_.front();
+			latencies_.push_back(std::chrono::duration<double>(clock::now() - f.submitted).count());
+			while(latencies_.size() > window_) {
+				latencies_.pop_front();
+			}
+			completed_ = f.number + 1;
+			std::vector<std::function<void()>> deferred = std::move(f.deferred);
+			in_flight_.pop_front();
+			for(std::function<void()>& d : deferred) {
+				d();
+			}
+		}
+	};
+
+	/** Converts a GL_TRIANGLES index list into triangle strips separated by 'restart'
+	 * Strips are grown greedily along shared edges and keep the winding of every
+	 * triangle. Triangles with repeated vertices are dropped.
+	 */
+	template<typename I>
+	std::vector<I> stripify(const std::vector<I>& triangles, I restart=I(~I(0)))
+	{
+		std::size_t n = triangles.size()/3;
+		auto edge_key = [](uint64_t a, uint64_t b) {
+			return a < b ? (a << 32 | b) : (b << 32 | a);
+		};
+		// sorted (undirected edge, triangle) pairs
+		std::vector<std::pair<uint64_t, uint32_t>> edges;
+		edges.reserve(3*n);
+		std::vector<bool> used(n, false);
+		for(std::size_t t=0; t<n; t++) {
+			const I* v = &triangles[3*t];
+			if(v[0] == v[1] || v[1] == v[2] || v[0] == v[2]) {
+				used[t] = true;
+				continue;
+			}
+			for(int k=0; k<3; k++) {
+				edges.push_back({edge_key(v[k], v[(k + 1)%3]), t});
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+		// finds an unused triangle which continues the strip with the ordered edge (a,b)
+		auto next = [&](I a, I b, I& r) -> long {
+			auto it = std::lower_bound(edges.begin(), edges.end(), std::make_pair(edge_key(a, b), uint32_t(0)));
+			for(; it != edges.end() && it->first == edge_key(a, b); ++it) {
+				if(used[it->second]) {
+					continue;
+				}
+				const I* v = &triangles[3*it->second];
+				for(int k=0; k<3; k++) {
+					if(v[k] == a && v[(k + 1)%3] == b) {
+						r = v[(k + 2)%3];
+						return it->second;
+					}
+				}
+			}
+			return -1;
+		};
+		auto extend = [&](std::vector<I>& strip, std::vector<uint32_t>& taken) {
+			while(true) {
+				std::size_t m = strip.size();
+				I p = strip[m - 2], q = strip[m - 1], r;
+				// triangle k of a strip is (k, k+1, k+2) for even k and (k+1, k, k+2) for odd k
+				long t = ((m - 2) % 2 == 0) ? next(p, q, r) : next(q, p, r);
+				if(t < 0) {
+					return;
+				}
+				used[t] = true;
+				taken.push_back(t);
+				strip.push_back(r);
+			}
+		};
+		std::vector<I> result;
+		for(std::size_t t=0; t<n; t++) {
+			if(used[t]) {
+				continue;
+			}
+			const I* v = &triangles[3*t];
+			used[t] = true;
+			std::vector<I> best;
+			for(int k=0; k<3; k++) {
+				std::vector<I> strip = { v[k], v[(k + 1)%3], v[(k + 2)%3] };
+				std::vector<uint32_t> taken;
+				extend(strip, taken);
+				for(uint32_t i : taken) {
+					used[i] = false;
+				}
+				if(strip.size() > best.size()) {
+					best = strip;
+				}
+			}
+			// replay the best start to mark its triangles
+			std::vector<I> strip(best.begin(), best.begin() + 3);
+			std::vector<uint32_t> taken;
+			extend(strip, taken);
+			if(!result.empty()) {
+				result.push_back(restart);
+			}
+			result.insert(result.end(), strip.begin(), strip.end());
+		}
+		return result;
+	}
+
+	namespace detail
+	{
+		/** Index encoding of single_mesh and multi_mesh: triangle lists are uploaded as strips if that is smaller */
+		struct mesh_indices
+		{
+			bool allow_strips = true;
+			bool strips = false;
+
+			template<typename I, int TARGET>
+			std::size_t upload(GLenum mode, const std::vector<I>& indices, buffer<TARGET>& bo)
+			{
+				I restart = I(~I(0));
+				strips = false;
+				bool max_index_used = std::find(indices.begin(), indices.end(), restart) != indices.end();
+				if(allow_strips && mode == GL_TRIANGLES && !max_index_used && !indices.empty()) {
+					std::vector<I> s = stripify(indices, restart);
+					if(s.size() < indices.size()) {
+						strips = true;
+						bo.update_data(s);
+						return s.size();
+					}
+				}
+				bo.update_data(indices);
+				return indices.size();
+			}
+
+			GLenum draw_mode(GLenum mode) const
+			{ return strips ? GL_TRIANGLE_STRIP : mode; }
+
+			/** Enables restarts at the index of 'index_type' for strips and disables them otherwise */
+			void prepare(GLenum index_type) const
+			{ set_primitive_restart(index_type, strips); }
+		};
+	}
+
 	struct single_mesh
 	{
 	private:
@@ -1079,6 +2205,7 @@ namespace pastry
 
 		std::size_t num_vertices_ = 0;
 		std::size_t num_indices_ = 0;
+		detail::mesh_indices encoding_;
 
 	public:
 		const array_buffer& get_vertex_bo() const
@@ -1124,28 +2251,50 @@ namespace pastry
 			vertex_bo_.update_data(vertices);
 		}
 
+		/** Triangle lists are stored as strips with primitive restarts if that needs fewer
+		 * indices; applies to the following set_indices calls. Enabled by default.
+		 */
+		void set_strip_encoding(bool allow) {
+			encoding_.allow_strips = allow;
+		}
+
+		/** True if the indices are stored as restart separated triangle strips */
+		bool uses_strips() const {
+			return encoding_.strips;
+		}
+
 		void set_indices(const std::vector<uint8_t>& indices) {
 			index_type_ = GL_UNSIGNED_BYTE;
-			num_indices_ = indices.size();
-			index_bo_.update_data(indices);
+			num_indices_ = encoding_.upload(mode_, indices, index_bo_);
 		}
 
 		void set_indices(const std::vector<uint16_t>& indices) {
 			index_type_ = GL_UNSIGNED_SHORT;
-			num_indices_ = indices.size();
-			index_bo_.update_data(indices);
+			num_indices_ = encoding_.upload(mode_, indices, index_bo_);
 		}
 
 		void set_indices(const std::vector<uint32_t>& indices) {
 			index_type_ = GL_UNSIGNED_INT;
-			num_indices_ = indices.size();
-			index_bo_.update_data(indices);
+			num_indices_ = encoding_.upload(mode_, indices, index_bo_);
 		}
 
 		void clear_indices() {
 			set_indices(std::vector<uint8_t>{});
 		}
 
+		/** Sets the counts after the buffers have been filled directly, e.g. from a mapped file */
+		void set_counts(std::size_t num_vertices, std::size_t num_indices, GLenum index_type=GL_UNSIGNED_INT) {
+			num_vertices_ = num_vertices;
+			num_indices_ = num_indices;
+			index_type_ = index_type;
+			encoding_.strips = false;
+		}
+
+		GLenum mode() const { return mode_; }
+		GLenum index_type() const { return index_type_; }
+		std::size_t num_vertices() const { return num_vertices_; }
+		std::size_t num_indices() const { return num_indices_; }
+
 		void render() {
 			if(num_vertices_ == 0) {
 				return;
@@ -1157,9 +2306,16 @@ namespace pastry
 			else {
 				vertex_bo_.bind();
 				index_bo_.bind(); // bind the index buffer object!
-				glDrawElements(mode_, num_indices_, index_type_, 0);
+				encoding_.prepare(index_type_);
+				glDrawElements(encoding_.draw_mode(mode_), num_indices_, index_type_, 0);
 			}
 		}
+
+		/** Renders only if samples passed for the occlusion query 'q' */
+		void render_conditional(const query& q, GLenum mode=GL_QUERY_NO_WAIT) {
+			conditional_render cr(q, mode);
+			render();
+		}
 	};
 
 	struct multi_mesh
@@ -1175,6 +2331,7 @@ namespace pastry
 		std::size_t num_vertices_;
 		std::size_t num_indices_;
 		std::size_t num_instances_;
+		detail::mesh_indices encoding_;
 
 	public:
 		const array_buffer& get_vertex_bo() const { return vertex_bo_; }
@@ -1213,22 +2370,31 @@ namespace pastry
 			vertex_bo_.update_data(vertices);
 		}
 
+		/** Triangle lists are stored as strips with primitive restarts if that needs fewer
+		 * indices; applies to the following set_indices calls. Enabled by default.
+		 */
+		void set_strip_encoding(bool allow) {
+			encoding_.allow_strips = allow;
+		}
+
+		/** True if the indices are stored as restart separated triangle strips */
+		bool uses_strips() const {
+			return encoding_.strips;
+		}
+
 		void set_indices(const std::vector<uint8_t>& indices) {
 			index_type_ = GL_UNSIGNED_BYTE;
-			num_indices_ = indices.size();
-			index_bo_.update_data(indices);
+			num_indices_ = encoding_.upload(mode_, indices, index_bo_);
 		}
 
 		void set_indices(const std::vector<uint16_t>& indices) {
 			index_type_ = GL_UNSIGNED_SHORT;
-			num_indices_ = indices.size();
-			index_bo_.update_data(indices);
+			num_indices_ = encoding_.upload(mode_, indices, index_bo_);
 		}
 
 		void set_indices(const std::vector<uint32_t>& indices) {
 			index_type_ = GL_UNSIGNED_INT;
-			num_indices_ = indices.size();
-			index_bo_.update_data(indices);
+			num_indices_ = encoding_.upload(mode_, indices, index_bo_);
 		}
 
 		template<typename A>
@@ -1242,6 +2408,30 @@ namespace pastry
 			instance_bo_.update_data(instances_data);
 		}
 
+		std::size_t num_vertices() const { return num_vertices_; }
+		std::size_t num_indices() const { return num_indices_; }
+
+		/** Draws with a draw_arrays_indirect_command (no indices) or a
+		 * draw_elements_indirect_command stored in 'cmd' at 'offset', e.g. one
+		 * written by a GPU culling pass. The instance count is not read back.
+		 * The index count of the command must be num_indices(), which counts strip
+		 * indices if uses_strips().
+		 */
+		void render_indirect(const draw_indirect_buffer& cmd, std::size_t offset=0) {
+			if(num_vertices_ == 0) {
+				return;
+			}
+			cmd.bind();
+			if(num_indices_ == 0) {
+				glDrawArraysIndirect(mode_, reinterpret_cast<const GLvoid*>(offset));
+			}
+			else {
+				index_bo_.bind(); // bind the index buffer object!
+				encoding_.prepare(index_type_);
+				glDrawElementsIndirect(encoding_.draw_mode(mode_), index_type_, reinterpret_cast<const GLvoid*>(offset));
+			}
+		}
+
 		void render() {
 			if(num_vertices_ == 0) {
 				return;
@@ -1258,60 +2448,431 @@ namespace pastry
 			else {
 				// use glDrawElements
 				index_bo_.bind(); // bind the index buffer object!
+				encoding_.prepare(index_type_);
 				if(num_instances_ == 0) {
-					glDrawElements(mode_, num_indices_, index_type_, 0);
+					glDrawElements(encoding_.draw_mode(mode_), num_indices_, index_type_, 0);
 				}
 				else {
-					glDrawElementsInstanced(mode_, num_indices_, index_type_, 0, num_instances_);
+					glDrawElementsInstanced(encoding_.draw_mode(mode_), num_indices_, index_type_, 0, num_instances_);
 				}
 			}
 		}
-	};
-
-	namespace detail
-	{
-		template<unsigned C> struct texture_format;
-		#define TEXTURE_FORMAT(N,V) \
-			template<> struct texture_format<N> { \
-				static constexpr GLint result = V; \
-			};
-		TEXTURE_FORMAT(1, GL_RED)
-		TEXTURE_FORMAT(2, GL_RG)
-		TEXTURE_FORMAT(3, GL_RGB)
-		TEXTURE_FORMAT(4, GL_RGBA)
-		#undef TEXTURE_FORMAT
 
-		template<typename T> struct texture_type;
-		#define TEXTURE_TYPE(T,V) \
-			template<> struct texture_type<T> { \
-				static constexpr GLint result = V; \
-			};
-		TEXTURE_TYPE(unsigned char, GL_UNSIGNED_BYTE)
-		TEXTURE_TYPE(char, GL_BYTE)
-		TEXTURE_TYPE(unsigned short, GL_UNSIGNED_SHORT)
-		TEXTURE_TYPE(short, GL_SHORT)
-		TEXTURE_TYPE(unsigned int, GL_UNSIGNED_INT)
-		TEXTURE_TYPE(int, GL_INT)
-		TEXTURE_TYPE(float, GL_FLOAT)
-		#undef TEXTURE_TYPE
-	}
+		/** Renders only if samples passed for the occlusion query 'q' */
+		void render_conditional(const query& q, GLenum mode=GL_QUERY_NO_WAIT) {
+			conditional_render cr(q, mode);
+			render();
+		}
+	};
 
-	template<GLenum TARGET>
-	struct texture_base
-	: public detail::resource<rid::texture_base>
+	/** Captures the outputs of a vertex or geometry shader into buffers
+	 * Usage example:
+	 *   pastry::transform_feedback tf;
+	 *   tf.set_buffer(0, out);
+	 *   prog.use();
+	 *   tf.begin(GL_POINTS);
+	 *   glDrawArrays(GL_POINTS, 0, n);
+	 *   tf.end();
+	 *   tf.draw(GL_POINTS); // draws the captured vertices without reading back their number
+	 */
+	struct transform_feedback
+	: public detail::resource<rid::transform_feedback>
 	{
-		static constexpr GLenum target = TARGET;
+		void bind() const
+		{ glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, id()); }
 
-		texture_base()
-		{}
+		static void unbind()
+		{ glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, detail::INVALID_ID); }
 
-		texture_base(glid_t tex_id)
-		: detail::resource<rid::texture_base>(tex_id)
-		{}
-		
-		void create(GLenum filter, GLenum wrap)
+		/** Captures into 'buf' at binding 'index' (0 for GL_INTERLEAVED_ATTRIBS)
+		 * Leaves the default transform feedback object bound, like end().
+		 */
+		template<int TARGET>
+		void set_buffer(unsigned index, const buffer<TARGET>& buf)
+		{
+			if(detail::dsa()) {
+				glTransformFeedbackBufferBase(id(), index, buf.id());
+			}
+			else {
+				bind();
+				glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, index, buf.id());
+				unbind();
+			}
+		}
+
+		/** Starts capturing primitives of type GL_POINTS, GL_LINES or GL_TRIANGLES */
+		void begin(GLenum primitive) const
 		{
 			bind();
+			glBeginTransformFeedback(primitive);
+		}
+
+		static void end()
+		{
+			glEndTransformFeedback();
+			unbind();
+		}
+
+		static void pause()
+		{ glPauseTransformFeedback(); }
+
+		static void resume()
+		{ glResumeTransformFeedback(); }
+
+		/** Draws as many vertices as were captured in the last begin/end */
+		void draw(GLenum mode) const
+		{ glDrawTransformFeedback(mode, id()); }
+
+		void draw_instanced(GLenum mode, std::size_t num_instances) const
+		{ glDrawTransformFeedbackInstanced(mode, id(), num_instances); }
+	};
+
+	/** Two buffers which are alternately read and written by a transform feedback program
+	 * step() runs 'update' on all vertices of current() and captures its outputs into the
+	 * other buffer which then becomes current. The varyings of 'update' must be interleaved
+	 * and match the layout. After the first step the number of vertices is the one of the
+	 * last capture, so a geometry shader can emit or kill particles without a readback.
+	 * Usage example:
+	 *   pastry::program update = pastry::create_feedback_program(src, {"out_pos", "out_vel"});
+	 *   pastry::feedback_ping_pong particles(update, {{"pos",GL_FLOAT,3},{"vel",GL_FLOAT,3}}, n, data.data());
+	 *   auto vas = particles.create_vertex_arrays(render);
+	 *   // every frame
+	 *   particles.step();
+	 *   render.use();
+	 *   vas[particles.current_index()].bind();
+	 *   particles.draw(GL_POINTS);
+	 */
+	struct feedback_ping_pong
+	{
+	private:
+		program update_;
+		GLenum primitive_;
+		std::size_t num_vertices_;
+		std::array<array_buffer,2> buffers_;
+		std::array<transform_feedback,2> feedback_;
+		std::array<vertex_array,2> vertex_arrays_;
+		std::array<bool,2> captured_;
+		unsigned current_;
+
+	public:
+		/** data: num_vertices initial vertices with the given layout or nullptr */
+		feedback_ping_pong(const program& update, std::initializer_list<detail::layout_item> layout,
+			std::size_t num_vertices, const void* data=nullptr, GLenum primitive=GL_POINTS)
+		: update_(update), primitive_(primitive), num_vertices_(num_vertices), current_(0)
+		{
+			std::size_t num_bytes = num_vertices * detail::va_bytes_total(layout);
+			for(unsigned i=0; i<2; i++) {
+				buffers_[i].set_layout(layout);
+				buffers_[i].init_data(static_cast<const unsigned char*>(i == 0 ? data : nullptr), num_bytes, GL_DYNAMIC_COPY);
+				feedback_[i].set_buffer(0, buffers_[i]);
+				captured_[i] = false;
+			}
+			vertex_arrays_ = create_vertex_arrays(update_);
+		}
+
+		unsigned current_index() const
+		{ return current_; }
+
+		/** The buffer which holds the result of the last step */
+		const array_buffer& current() const
+		{ return buffers_[current_]; }
+
+		/** Vertex arrays which feed the attributes of 'p' from buffer 0 and 1 */
+		std::array<vertex_array,2> create_vertex_arrays(const program& p) const
+		{
+			std::array<vertex_array,2> result;
+			for(unsigned i=0; i<2; i++) {
+				std::vector<detail::mapping> list;
+				for(const detail::va_data& a : buffers_[i].layout_) {
+					if(!a.name.empty() && glGetAttribLocation(p.id(), a.name.data()) >= 0) {
+						list.push_back(detail::mapping(a.name, buffers_[i]));
+					}
+				}
+				result[i].set_layout(p, list.begin(), list.end());
+			}
+			return result;
+		}
+
+		/** Runs the update program once with rasterization disabled and swaps the buffers */
+		void step()
+		{
+			unsigned next = 1 - current_;
+			update_.use();
+			vertex_arrays_[current_].bind();
+			detail::capabilities().set(GL_RASTERIZER_DISCARD, true);
+			feedback_[next].begin(primitive_);
+			draw(primitive_);
+			transform_feedback::end();
+			detail::capabilities().set(GL_RASTERIZER_DISCARD, false);
+			captured_[next] = true;
+			current_ = next;
+		}
+
+		/** Draws the vertices of current() with the bound program and vertex array */
+		void draw(GLenum mode) const
+		{
+			if(captured_[current_]) {
+				feedback_[current_].draw(mode);
+			}
+			else {
+				glDrawArrays(mode, 0, num_vertices_);
+			}
+		}
+	};
+
+	namespace detail
+	{
+		template<unsigned C> struct texture_format;
+		#define TEXTURE_FORMAT(N,V) \
+			template<> struct texture_format<N> { \
+				static constexpr GLint result = V; \
+			};
+		TEXTURE_FORMAT(1, GL_RED)
+		TEXTURE_FORMAT(2, GL_RG)
+		TEXTURE_FORMAT(3, GL_RGB)
+		TEXTURE_FORMAT(4, GL_RGBA)
+		#undef TEXTURE_FORMAT
+
+		template<typename T> struct texture_type;
+		#define TEXTURE_TYPE(T,V) \
+			template<> struct texture_type<T> { \
+				static constexpr GLint result = V; \
+			};
+		TEXTURE_TYPE(unsigned char, GL_UNSIGNED_BYTE)
+		TEXTURE_TYPE(char, GL_BYTE)
+		TEXTURE_TYPE(unsigned short, GL_UNSIGNED_SHORT)
+		TEXTURE_TYPE(short, GL_SHORT)
+		TEXTURE_TYPE(unsigned int, GL_UNSIGNED_INT)
+		TEXTURE_TYPE(int, GL_INT)
+		TEXTURE_TYPE(float, GL_FLOAT)
+		#undef TEXTURE_TYPE
+
+		/** Bytes per 4x4 block of a compressed internal format or 0 if uncompressed */
+		inline std::size_t compressed_block_bytes(GLenum internalformat)
+		{
+			switch(internalformat) {
+			case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+			case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+			case GL_COMPRESSED_SRGB_S3TC_DXT1_EXT:
+			case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+			case GL_COMPRESSED_RED_RGTC1:
+			case GL_COMPRESSED_SIGNED_RED_RGTC1:
+			case GL_COMPRESSED_RGB8_ETC2:
+			case GL_COMPRESSED_SRGB8_ETC2:
+			case GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+			case GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+			case GL_COMPRESSED_R11_EAC:
+			case GL_COMPRESSED_SIGNED_R11_EAC:
+				return 8;
+			case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+			case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+			case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT:
+			case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+			case GL_COMPRESSED_RG_RGTC2:
+			case GL_COMPRESSED_SIGNED_RG_RGTC2:
+			case GL_COMPRESSED_RGBA_BPTC_UNORM:
+			case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+			case GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT:
+			case GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT:
+			case GL_COMPRESSED_RGBA8_ETC2_EAC:
+			case GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC:
+			case GL_COMPRESSED_RG11_EAC:
+			case GL_COMPRESSED_SIGNED_RG11_EAC:
+				return 16;
+			default:
+				return 0;
+			}
+		}
+
+		/** Number of bytes of a w x h image in a compressed internal format */
+		inline std::size_t compressed_image_size(GLenum internalformat, unsigned w, unsigned h)
+		{ return ((w + 3)/4) * ((h + 3)/4) * compressed_block_bytes(internalformat); }
+
+		/** Size of mipmap level 'level' for a base level of size 'size' */
+		inline unsigned mipmap_size(unsigned size, unsigned level)
+		{ return std::max(1u, size >> level); }
+
+		/** Sets GL_UNPACK_ROW_LENGTH and GL_UNPACK_ALIGNMENT for source rows which are
+		 * 'row_pitch' bytes apart (0: tightly packed) and restores the defaults afterwards.
+		 */
+		struct unpack_rows
+		{
+			unpack_rows(std::size_t row_pitch, std::size_t bytes_per_pixel, unsigned w, unsigned image_height=0)
+			{
+				if(image_height != 0) {
+					glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, image_height);
+				}
+				if(row_pitch == 0) {
+					row_pitch = w * bytes_per_pixel;
+				}
+				GLint row_length = row_pitch / bytes_per_pixel;
+				GLint alignment = 1;
+				for(GLint a=8; a>1; a/=2) {
+					if(row_pitch % a == 0 && (row_length*bytes_per_pixel + a - 1) / a * a == row_pitch) {
+						alignment = a;
+						break;
+					}
+				}
+				if(row_length*bytes_per_pixel != row_pitch && alignment == 1) {
+					throw exception("pastry: row pitch is not compatible with GL_UNPACK_ALIGNMENT");
+				}
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length == GLint(w) ? 0 : row_length);
+				glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+			}
+
+			/** Tightly packed rows whose starts are aligned to 'alignment' bytes */
+			explicit unpack_rows(GLint alignment)
+			{ glPixelStorei(GL_UNPACK_ALIGNMENT, alignment); }
+
+			~unpack_rows()
+			{
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+				glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			}
+		};
+	}
+
+	namespace detail
+	{
+		struct texture_format_info
+		{
+			GLenum format; // natural format for pixel transfers
+			GLenum type; // natural type for pixel transfers
+			unsigned channels;
+			std::size_t bytes_per_texel; // 0 for compressed formats
+		};
+
+		inline texture_format_info get_texture_format_info(GLint internalformat)
+		{
+			#define PASTRY_DETAIL_TEX_INFO(IF,F,T,C,B) case IF: return {F,T,C,B};
+			#define PASTRY_DETAIL_TEX_INFO_N(C,F,FI,S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##8, F, GL_UNSIGNED_BYTE, S, S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##8_SNORM, F, GL_BYTE, S, S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##16, F, GL_UNSIGNED_SHORT, S, 2*S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##16_SNORM, F, GL_SHORT, S, 2*S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##16F, F, GL_HALF_FLOAT, S, 2*S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##32F, F, GL_FLOAT, S, 4*S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##8I, FI, GL_BYTE, S, S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##8UI, FI, GL_UNSIGNED_BYTE, S, S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##16I, FI, GL_SHORT, S, 2*S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##16UI, FI, GL_UNSIGNED_SHORT, S, 2*S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##32I, FI, GL_INT, S, 4*S) \
+				PASTRY_DETAIL_TEX_INFO(GL_##C##32UI, FI, GL_UNSIGNED_INT, S, 4*S)
+			switch(internalformat) {
+			PASTRY_DETAIL_TEX_INFO_N(R, GL_RED, GL_RED_INTEGER, 1)
+			PASTRY_DETAIL_TEX_INFO_N(RG, GL_RG, GL_RG_INTEGER, 2)
+			PASTRY_DETAIL_TEX_INFO_N(RGB, GL_RGB, GL_RGB_INTEGER, 3)
+			PASTRY_DETAIL_TEX_INFO_N(RGBA, GL_RGBA, GL_RGBA_INTEGER, 4)
+			PASTRY_DETAIL_TEX_INFO(GL_RED, GL_RED, GL_UNSIGNED_BYTE, 1, 1)
+			PASTRY_DETAIL_TEX_INFO(GL_RG, GL_RG, GL_UNSIGNED_BYTE, 2, 2)
+			PASTRY_DETAIL_TEX_INFO(GL_RGB, GL_RGB, GL_UNSIGNED_BYTE, 3, 3)
+			PASTRY_DETAIL_TEX_INFO(GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, 4, 4)
+			PASTRY_DETAIL_TEX_INFO(GL_SRGB8, GL_RGB, GL_UNSIGNED_BYTE, 3, 3)
+			PASTRY_DETAIL_TEX_INFO(GL_SRGB8_ALPHA8, GL_RGBA, GL_UNSIGNED_BYTE, 4, 4)
+			PASTRY_DETAIL_TEX_INFO(GL_R11F_G11F_B10F, GL_RGB, GL_UNSIGNED_INT_10F_11F_11F_REV, 3, 4)
+			PASTRY_DETAIL_TEX_INFO(GL_RGB10_A2, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, 4, 4)
+			PASTRY_DETAIL_TEX_INFO(GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 1, 4)
+			PASTRY_DETAIL_TEX_INFO(GL_DEPTH_COMPONENT16, GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT, 1, 2)
+			PASTRY_DETAIL_TEX_INFO(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 1, 4)
+			PASTRY_DETAIL_TEX_INFO(GL_DEPTH_COMPONENT32, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 1, 4)
+			PASTRY_DETAIL_TEX_INFO(GL_DEPTH_COMPONENT32F, GL_DEPTH_COMPONENT, GL_FLOAT, 1, 4)
+			PASTRY_DETAIL_TEX_INFO(GL_DEPTH_STENCIL, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 1, 4)
+			PASTRY_DETAIL_TEX_INFO(GL_DEPTH24_STENCIL8, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 1, 4)
+			PASTRY_DETAIL_TEX_INFO(GL_DEPTH32F_STENCIL8, GL_DEPTH_STENCIL, GL_FLOAT_32_UNSIGNED_INT_24_8_REV, 1, 8)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_RED_RGTC1, GL_RED, 0, 1, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_SIGNED_RED_RGTC1, GL_RED, 0, 1, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_R11_EAC, GL_RED, 0, 1, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_SIGNED_R11_EAC, GL_RED, 0, 1, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_RG_RGTC2, GL_RG, 0, 2, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_SIGNED_RG_RGTC2, GL_RG, 0, 2, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_RG11_EAC, GL_RG, 0, 2, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_SIGNED_RG11_EAC, GL_RG, 0, 2, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_RGB, 0, 3, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_SRGB_S3TC_DXT1_EXT, GL_RGB, 0, 3, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT, GL_RGB, 0, 3, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT, GL_RGB, 0, 3, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_RGB8_ETC2, GL_RGB, 0, 3, 0)
+			PASTRY_DETAIL_TEX_INFO(GL_COMPRESSED_SRGB8_ETC2, GL_RGB, 0, 3, 0)
+			default:
+				if(compressed_block_bytes(internalformat) != 0) {
+					return {GL_RGBA, 0, 4, 0};
+				}
+				// ERROR unknown
+				return {0, 0, 0, 0};
+			}
+			#undef PASTRY_DETAIL_TEX_INFO_N
+			#undef PASTRY_DETAIL_TEX_INFO
+		}
+
+		/** Dimensions and format of a texture recorded when its storage is specified */
+		struct texture_desc
+		{
+			bool known = false;
+			unsigned width = 0;
+			unsigned height = 0;
+			unsigned depth = 1; // depth of 3D textures or number of layers of array textures
+			unsigned levels = 0;
+			GLint internalformat = 0;
+			GLenum format = 0;
+			GLenum type = 0;
+			std::size_t num_bytes = 0;
+			bool immutable = false;
+		};
+
+		/** Total number of bytes of all levels of a texture with 'faces' faces */
+		inline std::size_t texture_storage_bytes(const texture_desc& d, unsigned faces, bool mip_depth)
+		{
+			texture_format_info info = get_texture_format_info(d.internalformat);
+			std::size_t n = 0;
+			for(unsigned level=0; level<d.levels; level++) {
+				unsigned w = mipmap_size(d.width, level);
+				unsigned h = mipmap_size(d.height, level);
+				unsigned z = mip_depth ? mipmap_size(d.depth, level) : d.depth;
+				std::size_t image = (info.bytes_per_texel == 0)
+					? compressed_image_size(d.internalformat, w, h)
+					: w * h * info.bytes_per_texel;
+				n += image * z * faces;
+			}
+			return n;
+		}
+
+		/** Target for per-level queries of textures of type 'target' */
+		inline GLenum texture_level_target(GLenum target)
+		{ return target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X : target; }
+	}
+
+	/** Base class for textures
+	 * Dimensions and format are recorded when the storage is specified and all
+	 * queries like width() are answered from this descriptor without a driver
+	 * round-trip. Only textures created from an existing id query the driver once.
+	 * Define PASTRY_VALIDATE_TEXTURE_DESC to check every query against the driver.
+	 */
+	template<GLenum TARGET>
+	struct texture_base
+	: public detail::resource<rid::texture_base>
+	{
+		static constexpr GLenum target = TARGET;
+
+	protected:
+		std::shared_ptr<detail::texture_desc> desc_;
+
+	public:
+		texture_base()
+		: detail::resource<rid::texture_base>(detail::create_texture(TARGET)),
+		  desc_(std::make_shared<detail::texture_desc>())
+		{}
+
+		texture_base(glid_t tex_id)
+		: detail::resource<rid::texture_base>(tex_id),
+		  desc_(std::make_shared<detail::texture_desc>())
+		{}
+		
+		void create(GLenum filter, GLenum wrap)
+		{
+			if(!detail::dsa()) {
+				bind();
+			}
 			set_filter(filter);
 			set_wrap(wrap);
 		}
@@ -1320,16 +2881,33 @@ namespace pastry
 		{ create(GL_LINEAR, GL_REPEAT); }
 		
 		void bind() const
-		{ glBindTexture(target, id()); }
+		{
+			glBindTexture(target, id());
+			detail::texture_unit_shadow& shadow = detail::texture_units();
+			detail::texture_unit_shadow::unit& u = shadow.get(shadow.active);
+			u.target = target;
+			u.texture = id();
+		}
 		
+		/** Sets a parameter of this texture; without DSA the texture must be bound */
+		void set_param_i(GLenum pname, GLint value)
+		{
+			if(detail::dsa()) {
+				glTextureParameteri(id(), pname, value);
+			}
+			else {
+				glTexParameteri(target, pname, value);
+			}
+		}
+
 		void set_wrap_s(GLint value)
-		{ glTexParameteri(target, GL_TEXTURE_WRAP_S, value); }
+		{ set_param_i(GL_TEXTURE_WRAP_S, value); }
 		
 		void set_wrap_t(GLint value)
-		{ glTexParameteri(target, GL_TEXTURE_WRAP_T, value); }
+		{ set_param_i(GL_TEXTURE_WRAP_T, value); }
 		
 		void set_wrap_r(GLint value)
-		{ glTexParameteri(target, GL_TEXTURE_WRAP_R, value); }
+		{ set_param_i(GL_TEXTURE_WRAP_R, value); }
 		
 		void set_wrap(GLint value)
 		{
@@ -1338,17 +2916,22 @@ namespace pastry
 			set_wrap_r(value);
 		}
 		
-		void set_border_color(float cr, float cg, float cb)
+		void set_border_color(float cr, float cg, float cb, float ca=1.0f)
 		{
-			float color[] = {cr, cg, cb};
-			glTexParameterfv(target, GL_TEXTURE_BORDER_COLOR, color);
+			float color[] = {cr, cg, cb, ca};
+			if(detail::dsa()) {
+				glTextureParameterfv(id(), GL_TEXTURE_BORDER_COLOR, color);
+			}
+			else {
+				glTexParameterfv(target, GL_TEXTURE_BORDER_COLOR, color);
+			}
 		}
 		
 		void set_min_filter(GLint value)
-		{ glTexParameteri(target, GL_TEXTURE_MIN_FILTER, value); }
+		{ set_param_i(GL_TEXTURE_MIN_FILTER, value); }
 	
 		void set_mag_filter(GLint value)
-		{ glTexParameteri(target, GL_TEXTURE_MAG_FILTER, value); }
+		{ set_param_i(GL_TEXTURE_MAG_FILTER, value); }
 		
 		void set_filter(GLint value)
 		{
@@ -1356,98 +2939,208 @@ namespace pastry
 			set_mag_filter(value);
 		}
 		
-		// void generate_mipmap() {
-		// 	glGenerateMipmap(target);
-		// }
+		/** Number of levels of a full mipmap chain */
+		static unsigned mipmap_levels(unsigned w, unsigned h=1, unsigned d=1)
+		{
+			unsigned n = std::max(w, std::max(h, d));
+			unsigned levels = 1;
+			while(n > 1) {
+				n >>= 1;
+				levels++;
+			}
+			return levels;
+		}
+
+		void generate_mipmap()
+		{
+			if(detail::dsa()) {
+				glGenerateTextureMipmap(id());
+			}
+			else {
+				bind();
+				glGenerateMipmap(target);
+			}
+			if(desc_->known && !desc_->immutable) {
+				set_desc_levels(mipmap_levels(desc_->width, desc_->height, target == GL_TEXTURE_3D ? desc_->depth : 1));
+			}
+		}
+
+		void set_base_level(GLint level)
+		{ set_param_i(GL_TEXTURE_BASE_LEVEL, level); }
+
+		void set_max_level(GLint level)
+		{ set_param_i(GL_TEXTURE_MAX_LEVEL, level); }
 		
+		/** Queries a parameter of level 0 from the driver (synchronous) */
 		int get_param_i(GLenum pname) const
 		{
-			bind();
 			GLint val;
-			glGetTexLevelParameteriv(target, 0, pname, &val);
+			if(detail::dsa()) {
+				glGetTextureLevelParameteriv(id(), 0, pname, &val);
+			}
+			else {
+				bind();
+				glGetTexLevelParameteriv(detail::texture_level_target(target), 0, pname, &val);
+			}
 			return val;
 		}
-		
+
+		/** Descriptor of the texture storage */
+		const detail::texture_desc& desc() const
+		{
+			if(!desc_->known) {
+				query_desc();
+			}
+			return *desc_;
+		}
+
 		GLint internalformat() const
-		{ return get_param_i(GL_TEXTURE_INTERNAL_FORMAT); }
+		{ return validate(GL_TEXTURE_INTERNAL_FORMAT, desc().internalformat); }
 
 		int width() const
-		{ return get_param_i(GL_TEXTURE_WIDTH); }
+		{ return validate(GL_TEXTURE_WIDTH, desc().width); }
 		
 		int height() const
-		{ return get_param_i(GL_TEXTURE_HEIGHT); }
+		{ return validate(GL_TEXTURE_HEIGHT, desc().height); }
+
+		int depth() const
+		{ return desc().depth; }
+
+		int levels() const
+		{ return desc().levels; }
+
+		/** Total number of bytes used by all levels */
+		std::size_t num_bytes() const
+		{ return desc().num_bytes; }
 		
 		int channels() const
+		{ return detail::get_texture_format_info(internalformat()).channels; }
+
+		GLenum format() const
+		{ return desc().format; }
+
+		GLenum type() const
+		{ return desc().type; }
+
+		static void unbind()
+		{
+			glBindTexture(target, detail::INVALID_ID);
+			detail::texture_unit_shadow& shadow = detail::texture_units();
+			shadow.get(shadow.active).texture = detail::INVALID_ID;
+		}
+
+		static void activate_unit(unsigned int num)
+		{
+			glActiveTexture(GL_TEXTURE0 + num);
+			detail::texture_units().active = num;
+		}
+
+		/** Binds the texture to texture unit 'num' */
+		void bind_unit(unsigned int num) const
+		{
+			activate_unit(num);
+			bind();
+		}
+
+		/** Binds a level to image unit 'unit' for imageLoad/imageStore
+		 * All layers of array, cube map and 3D textures are bound. format defaults to the
+		 * internal format of the texture.
+		 */
+		void bind_image(unsigned unit, GLenum access=GL_READ_WRITE, unsigned level=0, GLenum format=0) const
+		{
+			bool layered = (target == GL_TEXTURE_2D_ARRAY || target == GL_TEXTURE_CUBE_MAP || target == GL_TEXTURE_3D);
+			glBindImageTexture(unit, id(), level, layered, 0, access, format != 0 ? format : internalformat());
+		}
+
+		/** Binds a single layer (or cube map face or 3D slice) to image unit 'unit' */
+		void bind_image_layer(unsigned unit, unsigned layer, GLenum access=GL_READ_WRITE, unsigned level=0, GLenum format=0) const
+		{ glBindImageTexture(unit, id(), level, GL_FALSE, layer, access, format != 0 ? format : internalformat()); }
+
+	protected:
+		/** Records the storage of the texture after level 'level' was specified */
+		void set_desc(GLint internalformat, unsigned w, unsigned h, unsigned d, unsigned level, GLenum format, GLenum type)
 		{
-			switch(internalformat()) {
-				case GL_DEPTH_COMPONENT:
-				case GL_DEPTH_COMPONENT16:
-				case GL_DEPTH_COMPONENT24:
-				case GL_DEPTH_COMPONENT32F:
-				case GL_DEPTH_STENCIL:
-				case GL_DEPTH32F_STENCIL8:
-				case GL_DEPTH24_STENCIL8:
-				case GL_RED:
-				case GL_R8:
-				case GL_R32F:
-					return 1;
-				case GL_RG:
-				case GL_RG8:
-				case GL_RG32F:
-					return 2;
-				case GL_RGB:
-				case GL_RGB8:
-				case GL_RGB32F:
-					return 3;
-				case GL_RGBA:
-				case GL_RGBA8:
-				case GL_RGBA32F:
-					return 4;
-				default:
-					// ERROR unknown
-					return 0;
+			detail::texture_desc& q = *desc_;
+			if(level == 0) {
+				detail::texture_format_info info = detail::get_texture_format_info(internalformat);
+				q.known = true;
+				q.width = w;
+				q.height = h;
+				q.depth = d;
+				q.levels = std::max(q.levels, 1u);
+				q.internalformat = internalformat;
+				q.format = info.format != 0 ? info.format : format;
+				q.type = info.type != 0 ? info.type : type;
+				q.immutable = false;
 			}
+			set_desc_levels(std::max(q.levels, level + 1));
 		}
 
-		GLenum format() const
+		/** Records immutable storage with 'levels' levels */
+		void set_desc_storage(GLint internalformat, unsigned w, unsigned h, unsigned d, unsigned levels)
+		{
+			set_desc(internalformat, w, h, d, 0, 0, 0);
+			desc_->immutable = true;
+			set_desc_levels(levels);
+		}
+
+		void set_desc_levels(unsigned levels)
 		{
-			switch(internalformat()) {
-				case GL_DEPTH_COMPONENT:
-				case GL_DEPTH_COMPONENT16:
-				case GL_DEPTH_COMPONENT24:
-				case GL_DEPTH_COMPONENT32F:
-					return GL_DEPTH_COMPONENT;
-				case GL_DEPTH_STENCIL:
-				case GL_DEPTH32F_STENCIL8:
-				case GL_DEPTH24_STENCIL8:
-					return GL_DEPTH_STENCIL;
-				case GL_RED:
-				case GL_R8:
-				case GL_R32F:
-					return GL_RED;
-				case GL_RG:
-				case GL_RG8:
-				case GL_RG32F:
-					return GL_RG;
-				case GL_RGB:
-				case GL_RGB8:
-				case GL_RGB32F:
-					return GL_RGB;
-				case GL_RGBA:
-				case GL_RGBA8:
-				case GL_RGBA32F:
-					return GL_RGBA;
-				default:
-					// ERROR unknown
-					return 0;
+			desc_->levels = levels;
+			desc_->num_bytes = detail::texture_storage_bytes(*desc_,
+				target == GL_TEXTURE_CUBE_MAP ? 6 : 1,
+				target == GL_TEXTURE_3D);
+		}
+
+	private:
+		void query_desc() const
+		{
+			detail::texture_desc& q = *desc_;
+			GLint internalformat = get_param_i(GL_TEXTURE_INTERNAL_FORMAT);
+			detail::texture_format_info info = detail::get_texture_format_info(internalformat);
+			q.known = true;
+			q.width = get_param_i(GL_TEXTURE_WIDTH);
+			q.height = get_param_i(GL_TEXTURE_HEIGHT);
+			q.depth = get_param_i(GL_TEXTURE_DEPTH);
+			q.internalformat = internalformat;
+			q.format = info.format;
+			q.type = info.type;
+			GLint immutable = 0;
+			get_tex_param_i(GL_TEXTURE_IMMUTABLE_FORMAT, &immutable);
+			q.immutable = (immutable != 0);
+			GLint levels = 1;
+			if(q.immutable) {
+				get_tex_param_i(GL_TEXTURE_IMMUTABLE_LEVELS, &levels);
 			}
+			q.levels = levels;
+			q.num_bytes = detail::texture_storage_bytes(q,
+				target == GL_TEXTURE_CUBE_MAP ? 6 : 1,
+				target == GL_TEXTURE_3D);
 		}
 
-		static void unbind()
-		{ glBindTexture(target, detail::INVALID_ID); }
+		void get_tex_param_i(GLenum pname, GLint* val) const
+		{
+			if(detail::dsa()) {
+				glGetTextureParameteriv(id(), pname, val);
+			}
+			else {
+				glGetTexParameteriv(target, pname, val);
+			}
+		}
 
-		static void activate_unit(unsigned int num)
-		{ glActiveTexture(GL_TEXTURE0 + num); }
+	#ifdef PASTRY_VALIDATE_TEXTURE_DESC
+		int validate(GLenum pname, int cached) const
+		{
+			int actual = get_param_i(pname);
+			if(actual != cached) {
+				throw exception("pastry: texture descriptor out of sync with driver");
+			}
+			return cached;
+		}
+	#else
+		int validate(GLenum, int cached) const
+		{ return cached; }
+	#endif
 	};
 
 	struct texture_2d
@@ -1461,16 +3154,20 @@ namespace pastry
 		{}
 		
 		void set_image_impl(GLint internalformat, unsigned w, unsigned h, GLenum format, GLenum type, const void* data)
+		{ set_image_impl(0, internalformat, w, h, format, type, data); }
+
+		void set_image_impl(unsigned level, GLint internalformat, unsigned w, unsigned h, GLenum format, GLenum type, const void* data)
 		{
 			bind();
 			glTexImage2D(target,
-				0, // level: use base image level
+				level,
 				internalformat,
 				w, h,
 				0, // must be 0
 				format, // format of source data
 				type, // type of source data
 				data);
+			set_desc(internalformat, w, h, 1, level, format, type);
 		}
 
 		template<typename S, unsigned C>
@@ -1480,6 +3177,55 @@ namespace pastry
 			set_image_impl(internalformat, w, h, detail::texture_format<C>::result, detail::texture_type<S>::result, data);
 		}
 
+		/** Specifies mipmap level 'level' of size w x h */
+		template<typename S, unsigned C>
+		void set_image_level(unsigned level, GLint internalformat, unsigned w, unsigned h, const S* data=0)
+		{ set_image_impl(level, internalformat, w, h, detail::texture_format<C>::result, detail::texture_type<S>::result, data); }
+
+		/** Allocates immutable storage for 'levels' mipmap levels (0: full mipmap chain)
+		 * Image data is then uploaded per level with set_level or set_compressed_level.
+		 */
+		void storage(GLint internalformat, unsigned w, unsigned h, unsigned levels=0)
+		{
+			levels = (levels == 0 ? mipmap_levels(w, h) : levels);
+			if(detail::dsa()) {
+				glTextureStorage2D(id(), levels, internalformat, w, h);
+			}
+			else {
+				bind();
+				glTexStorage2D(target, levels, internalformat, w, h);
+			}
+			set_desc_storage(internalformat, w, h, 1, levels);
+		}
+
+		void set_level_impl(unsigned level, unsigned w, unsigned h, GLenum format, GLenum type, const void* data)
+		{ set_sub_image_impl(level, 0, 0, w, h, format, type, data); }
+
+		/** Uploads a whole mipmap level of size w x h into allocated storage */
+		template<typename S, unsigned C>
+		void set_level(unsigned level, unsigned w, unsigned h, const S* data)
+		{ set_level_impl(level, w, h, detail::texture_format<C>::result, detail::texture_type<S>::result, data); }
+
+		/** Specifies a mipmap level with compressed data, i.e. GL_COMPRESSED_RGBA_BPTC_UNORM */
+		void set_compressed_image(unsigned level, GLint internalformat, unsigned w, unsigned h, std::size_t num_bytes, const void* data)
+		{
+			bind();
+			glCompressedTexImage2D(target, level, internalformat, w, h, 0, num_bytes, data);
+			set_desc(internalformat, w, h, 1, level, 0, 0);
+		}
+
+		/** Uploads a whole compressed mipmap level into allocated storage */
+		void set_compressed_level(unsigned level, GLint internalformat, unsigned w, unsigned h, std::size_t num_bytes, const void* data)
+		{
+			if(detail::dsa()) {
+				glCompressedTextureSubImage2D(id(), level, 0, 0, w, h, internalformat, num_bytes, data);
+			}
+			else {
+				bind();
+				glCompressedTexSubImage2D(target, level, 0, 0, w, h, internalformat, num_bytes, data);
+			}
+		}
+
 		template<typename S>
 		void set_image_depth(GLint internalformat, unsigned w, unsigned h, const S* data=0)
 		{
@@ -1496,6 +3242,27 @@ namespace pastry
 			set_image_impl(internalformat, w, h, GL_DEPTH_STENCIL, type, 0);
 		}
 
+		void set_sub_image_impl(unsigned level, int x, int y, unsigned w, unsigned h, GLenum format, GLenum type, const void* data)
+		{
+			if(detail::dsa()) {
+				glTextureSubImage2D(id(), level, x, y, w, h, format, type, data);
+			}
+			else {
+				bind();
+				glTexSubImage2D(target, level, x, y, w, h, format, type, data);
+			}
+		}
+
+		/** Updates the rectangle (x,y,w,h) without re-specifying the storage
+		 * row_pitch is the distance of source rows in bytes (0: tightly packed).
+		 */
+		template<typename S, unsigned C>
+		void set_sub_image(int x, int y, unsigned w, unsigned h, const S* data, std::size_t row_pitch=0, unsigned level=0)
+		{
+			detail::unpack_rows unpack(row_pitch, sizeof(S)*C, w);
+			set_sub_image_impl(level, x, y, w, h, detail::texture_format<C>::result, detail::texture_type<S>::result, data);
+		}
+
 		template<typename S>
 		std::vector<S> get_image() const
 		{
@@ -1533,6 +3300,19 @@ namespace pastry
 			return tex;
 		}
 
+		/** Creates a texture with immutable storage and a full mipmap chain generated from data */
+		template<typename S, unsigned C>
+		static texture_2d create_mipmapped(GLint internalformat, unsigned w, unsigned h, const S* data)
+		{
+			texture_2d tex;
+			tex.create();
+			tex.set_min_filter(GL_LINEAR_MIPMAP_LINEAR);
+			tex.storage(internalformat, w, h);
+			tex.set_level<S,C>(0, w, h, data);
+			tex.generate_mipmap();
+			return tex;
+		}
+
 	};
 
 	struct texture_cube_map
@@ -1558,24 +3338,34 @@ namespace pastry
 		: texture_base<GL_TEXTURE_CUBE_MAP>(tex_id)
 		{}
 		
-		template<typename S, unsigned C>
-		void set_image_mm(GLenum target, GLint internalformat, unsigned level, unsigned w, unsigned h, const S* data=0)
+		void set_image_impl(GLenum target, unsigned level, GLint internalformat, unsigned w, unsigned h, GLenum format, GLenum type, const void* data)
 		{
 			bind();
 			glTexImage2D(target,
-				level, // level: use base image level
+				level,
 				internalformat, // i.e. GL_RGBA8, GL_R32F, GL_RG16UI ...
 				w, h,
 				0, // must be 0
-				detail::texture_format<C>::result, // format of source data
-				detail::texture_type<S>::result, // type of source data
+				format, // format of source data
+				type, // type of source data
 				data);
+			set_desc(internalformat, w, h, 1, level, format, type);
 		}
 
+		/** Specifies mipmap level 'level' of size w x h of one face */
+		template<typename S, unsigned C>
+		void set_image_level(GLenum target, GLint internalformat, unsigned level, unsigned w, unsigned h, const S* data=0)
+		{ set_image_impl(target, level, internalformat, w, h, detail::texture_format<C>::result, detail::texture_type<S>::result, data); }
+
+		/** Deprecated: use set_image_level */
+		template<typename S, unsigned C>
+		void set_image_mm(GLenum target, GLint internalformat, unsigned level, unsigned w, unsigned h, const S* data=0)
+		{ set_image_level<S,C>(target, internalformat, level, w, h, data); }
+
 		template<typename S, unsigned C>
 		void set_image(GLenum target, GLint internalformat, unsigned level, unsigned w, unsigned h, const S* data=0)
 		{
-			set_image_mm(target, internalformat, 0, w, h, data);
+			set_image_level<S,C>(target, internalformat, 0, w, h, data);
 		}
 
 		template<typename S, unsigned C>
@@ -1592,6 +3382,70 @@ namespace pastry
 					detail::texture_type<S>::result, // type of source data
 					i < data.size() ? data[i] : 0);
 			}
+			set_desc(internalformat, w, h, 1, 0, detail::texture_format<C>::result, detail::texture_type<S>::result);
+		}
+
+		/** Allocates immutable storage for all six faces (levels=0: full mipmap chain) */
+		void storage(GLint internalformat, unsigned w, unsigned h, unsigned levels=0)
+		{
+			levels = (levels == 0 ? mipmap_levels(w, h) : levels);
+			if(detail::dsa()) {
+				glTextureStorage2D(id(), levels, internalformat, w, h);
+			}
+			else {
+				bind();
+				glTexStorage2D(GL_TEXTURE_CUBE_MAP, levels, internalformat, w, h);
+			}
+			set_desc_storage(internalformat, w, h, 1, levels);
+		}
+
+		void set_level_impl(GLenum target, unsigned level, unsigned w, unsigned h, GLenum format, GLenum type, const void* data)
+		{ set_sub_image_impl(target, level, 0, 0, w, h, format, type, data); }
+
+		/** Uploads a whole mipmap level of one face into allocated storage */
+		template<typename S, unsigned C>
+		void set_level(GLenum target, unsigned level, unsigned w, unsigned h, const S* data)
+		{ set_level_impl(target, level, w, h, detail::texture_format<C>::result, detail::texture_type<S>::result, data); }
+
+		void set_compressed_image(GLenum target, unsigned level, GLint internalformat, unsigned w, unsigned h, std::size_t num_bytes, const void* data)
+		{
+			bind();
+			glCompressedTexImage2D(target, level, internalformat, w, h, 0, num_bytes, data);
+			set_desc(internalformat, w, h, 1, level, 0, 0);
+		}
+
+		void set_compressed_level(GLenum target, unsigned level, GLint internalformat, unsigned w, unsigned h, std::size_t num_bytes, const void* data)
+		{
+			if(detail::dsa()) {
+				glCompressedTextureSubImage3D(id(), level, 0, 0, face_index(target), w, h, 1, internalformat, num_bytes, data);
+			}
+			else {
+				bind();
+				glCompressedTexSubImage2D(target, level, 0, 0, w, h, internalformat, num_bytes, data);
+			}
+		}
+
+		/** DSA addresses the faces of a cube map as layers in the order +X, -X, +Y, -Y, +Z, -Z */
+		static int face_index(GLenum target)
+		{ return target - GL_TEXTURE_CUBE_MAP_POSITIVE_X; }
+
+		void set_sub_image_impl(GLenum target, unsigned level, int x, int y, unsigned w, unsigned h, GLenum format, GLenum type, const void* data)
+		{
+			if(detail::dsa()) {
+				glTextureSubImage3D(id(), level, x, y, face_index(target), w, h, 1, format, type, data);
+			}
+			else {
+				bind();
+				glTexSubImage2D(target, level, x, y, w, h, format, type, data);
+			}
+		}
+
+		/** Updates the rectangle (x,y,w,h) of one face without re-specifying the storage */
+		template<typename S, unsigned C>
+		void set_sub_image(GLenum target, int x, int y, unsigned w, unsigned h, const S* data, std::size_t row_pitch=0, unsigned level=0)
+		{
+			detail::unpack_rows unpack(row_pitch, sizeof(S)*C, w);
+			set_sub_image_impl(target, level, x, y, w, h, detail::texture_format<C>::result, detail::texture_type<S>::result, data);
 		}
 
 		template<typename S>
@@ -1611,6 +3465,197 @@ namespace pastry
 
 	};
 
+	/** Array of 2D textures with equal size and format; layers are selected in the shader */
+	struct texture_2d_array
+	: public texture_base<GL_TEXTURE_2D_ARRAY>
+	{
+		texture_2d_array()
+		{}
+
+		texture_2d_array(glid_t tex_id)
+		: texture_base<GL_TEXTURE_2D_ARRAY>(tex_id)
+		{}
+
+		void set_image_impl(unsigned level, GLint internalformat, unsigned w, unsigned h, unsigned layers, GLenum format, GLenum type, const void* data)
+		{
+			bind();
+			glTexImage3D(target, level, internalformat, w, h, layers, 0, format, type, data);
+			set_desc(internalformat, w, h, layers, level, format, type);
+		}
+
+		/** Specifies all layers of level 0; data holds the layers one after another */
+		template<typename S, unsigned C>
+		void set_image(GLint internalformat, unsigned w, unsigned h, unsigned layers, const S* data=0)
+		{ set_image_impl(0, internalformat, w, h, layers, detail::texture_format<C>::result, detail::texture_type<S>::result, data); }
+
+		/** Allocates immutable storage for all layers (levels=0: full mipmap chain) */
+		void storage(GLint internalformat, unsigned w, unsigned h, unsigned layers, unsigned levels=0)
+		{
+			levels = (levels == 0 ? mipmap_levels(w, h) : levels);
+			if(detail::dsa()) {
+				glTextureStorage3D(id(), levels, internalformat, w, h, layers);
+			}
+			else {
+				bind();
+				glTexStorage3D(target, levels, internalformat, w, h, layers);
+			}
+			set_desc_storage(internalformat, w, h, layers, levels);
+		}
+
+		void set_sub_image_impl(unsigned level, int x, int y, int layer, unsigned w, unsigned h, unsigned layers, GLenum format, GLenum type, const void* data)
+		{
+			if(detail::dsa()) {
+				glTextureSubImage3D(id(), level, x, y, layer, w, h, layers, format, type, data);
+			}
+			else {
+				bind();
+				glTexSubImage3D(target, level, x, y, layer, w, h, layers, format, type, data);
+			}
+		}
+
+		/** Updates the rectangle (x,y,w,h) of one layer without re-specifying the storage */
+		template<typename S, unsigned C>
+		void set_sub_image(int x, int y, unsigned layer, unsigned w, unsigned h, const S* data, std::size_t row_pitch=0, unsigned level=0)
+		{
+			detail::unpack_rows unpack(row_pitch, sizeof(S)*C, w);
+			set_sub_image_impl(level, x, y, layer, w, h, 1, detail::texture_format<C>::result, detail::texture_type<S>::result, data);
+		}
+
+		/** Uploads a whole level of one layer */
+		template<typename S, unsigned C>
+		void set_layer(unsigned layer, const S* data, unsigned level=0)
+		{
+			set_sub_image<S,C>(0, 0, layer,
+				detail::mipmap_size(width(), level), detail::mipmap_size(height(), level),
+				data, 0, level);
+		}
+
+		void set_compressed_layer(unsigned layer, unsigned level, std::size_t num_bytes, const void* data)
+		{
+			unsigned w = detail::mipmap_size(width(), level);
+			unsigned h = detail::mipmap_size(height(), level);
+			if(detail::dsa()) {
+				glCompressedTextureSubImage3D(id(), level, 0, 0, layer, w, h, 1, internalformat(), num_bytes, data);
+			}
+			else {
+				bind();
+				glCompressedTexSubImage3D(target, level, 0, 0, layer, w, h, 1, internalformat(), num_bytes, data);
+			}
+		}
+
+		int layers() const
+		{ return depth(); }
+
+		/** Reads level 0 of all layers */
+		template<typename S>
+		std::vector<S> get_image() const
+		{
+			std::vector<S> buff(width()*height()*layers()*channels());
+			bind();
+			glGetTexImage(target, 0, format(), detail::texture_type<S>::result, buff.data());
+			return buff;
+		}
+	};
+
+	struct texture_3d
+	: public texture_base<GL_TEXTURE_3D>
+	{
+		texture_3d()
+		{}
+
+		texture_3d(glid_t tex_id)
+		: texture_base<GL_TEXTURE_3D>(tex_id)
+		{}
+
+		void set_image_impl(unsigned level, GLint internalformat, unsigned w, unsigned h, unsigned d, GLenum format, GLenum type, const void* data)
+		{
+			bind();
+			glTexImage3D(target, level, internalformat, w, h, d, 0, format, type, data);
+			set_desc(internalformat, w, h, d, level, format, type);
+		}
+
+		template<typename S, unsigned C>
+		void set_image(GLint internalformat, unsigned w, unsigned h, unsigned d, const S* data=0)
+		{ set_image_impl(0, internalformat, w, h, d, detail::texture_format<C>::result, detail::texture_type<S>::result, data); }
+
+		/** Allocates immutable storage (levels=0: full mipmap chain) */
+		void storage(GLint internalformat, unsigned w, unsigned h, unsigned d, unsigned levels=0)
+		{
+			levels = (levels == 0 ? mipmap_levels(w, h, d) : levels);
+			if(detail::dsa()) {
+				glTextureStorage3D(id(), levels, internalformat, w, h, d);
+			}
+			else {
+				bind();
+				glTexStorage3D(target, levels, internalformat, w, h, d);
+			}
+			set_desc_storage(internalformat, w, h, d, levels);
+		}
+
+		void set_sub_image_impl(unsigned level, int x, int y, int z, unsigned w, unsigned h, unsigned d, GLenum format, GLenum type, const void* data)
+		{
+			if(detail::dsa()) {
+				glTextureSubImage3D(id(), level, x, y, z, w, h, d, format, type, data);
+			}
+			else {
+				bind();
+				glTexSubImage3D(target, level, x, y, z, w, h, d, format, type, data);
+			}
+		}
+
+		/** Updates the box (x,y,z,w,h,d) without re-specifying the storage
+		 * row_pitch is the distance of source rows in bytes and image_height the
+		 * number of rows between slices (0: tightly packed).
+		 */
+		template<typename S, unsigned C>
+		void set_sub_image(int x, int y, int z, unsigned w, unsigned h, unsigned d, const S* data,
+			std::size_t row_pitch=0, unsigned image_height=0, unsigned level=0)
+		{
+			detail::unpack_rows unpack(row_pitch, sizeof(S)*C, w, image_height);
+			set_sub_image_impl(level, x, y, z, w, h, d, detail::texture_format<C>::result, detail::texture_type<S>::result, data);
+		}
+
+		template<typename S>
+		std::vector<S> get_image() const
+		{
+			std::vector<S> buff(width()*height()*depth()*channels());
+			bind();
+			glGetTexImage(target, 0, format(), detail::texture_type<S>::result, buff.data());
+			return buff;
+		}
+	};
+
+	/** Multisampled 2D texture, e.g. a render target which is resolved or read with texelFetch
+	 * Has no sampler state, i.e. do not call create().
+	 */
+	struct texture_2d_multisample
+	: public texture_base<GL_TEXTURE_2D_MULTISAMPLE>
+	{
+		texture_2d_multisample()
+		{}
+
+		texture_2d_multisample(glid_t tex_id)
+		: texture_base<GL_TEXTURE_2D_MULTISAMPLE>(tex_id)
+		{}
+
+		/** Allocates immutable storage with 'samples' samples per texel */
+		void storage(GLint internalformat, unsigned w, unsigned h, unsigned samples, bool fixed_sample_locations=true)
+		{
+			if(detail::dsa()) {
+				glTextureStorage2DMultisample(id(), samples, internalformat, w, h, fixed_sample_locations);
+			}
+			else {
+				bind();
+				glTexStorage2DMultisample(target, samples, internalformat, w, h, fixed_sample_locations);
+			}
+			set_desc_storage(internalformat, w, h, 1, 1);
+			desc_->num_bytes *= samples;
+		}
+
+		int samples() const
+		{ return get_param_i(GL_TEXTURE_SAMPLES); }
+	};
+
 	namespace TextureModes
 	{
 		enum def {
@@ -1678,10 +3723,434 @@ namespace pastry
 		template<typename S, unsigned C>
 		void set_image(unsigned w, unsigned h, const S* data)
 		{
-			set_image<S,C>(
+			texture_2d::set_image<S,C>(
 				internal_format(),
 				w, h, data);
 		}
+
+		void storage(unsigned w, unsigned h, unsigned levels=0)
+		{ texture_2d::storage(internal_format(), w, h, levels); }
+	};
+
+	/** Ring of equally sized textures for imagery which changes every frame
+	 * Each update writes into the texture after the current one with glTexSubImage2D,
+	 * so the storage is never re-specified and the GPU can still read the previous
+	 * frames while the new one is uploaded.
+	 * Usage example:
+	 *   pastry::streaming_texture video(GL_RGB8, 1920, 1080);
+	 *   // every frame
+	 *   video.update<unsigned char,3>(frame.data(), frame.row_pitch());
+	 *   video.current().bind();
+	 */
+	struct streaming_texture
+	{
+	private:
+		std::vector<texture_2d> textures_;
+		unsigned width_, height_;
+		std::size_t current_;
+
+	public:
+		streaming_texture(GLint internalformat, unsigned w, unsigned h, unsigned num_buffers=3)
+		: width_(w), height_(h), current_(0)
+		{
+			for(unsigned i=0; i<num_buffers; i++) {
+				texture_2d tex;
+				tex.create(GL_LINEAR, GL_CLAMP_TO_EDGE);
+				tex.storage(internalformat, w, h, 1);
+				textures_.push_back(tex);
+			}
+		}
+
+		unsigned width() const
+		{ return width_; }
+
+		unsigned height() const
+		{ return height_; }
+
+		/** The texture which holds the most recent image */
+		const texture_2d& current() const
+		{ return textures_[current_]; }
+
+		/** Uploads a full image into the next texture and makes it current */
+		template<typename S, unsigned C>
+		void update(const S* data, std::size_t row_pitch=0)
+		{
+			std::size_t next = (current_ + 1) % textures_.size();
+			textures_[next].set_sub_image<S,C>(0, 0, width_, height_, data, row_pitch);
+			current_ = next;
+		}
+	};
+
+	namespace TextureCompressions
+	{
+		enum def {
+			BC1=0, // RGB, DXT1
+			BC1_ALPHA=1, // RGBA with 1-bit alpha, DXT1
+			BC2=2, // RGBA, DXT3
+			BC3=3, // RGBA, DXT5
+			BC4=4, // R, RGTC1
+			BC4_SNORM=5,
+			BC5=6, // RG, RGTC2
+			BC5_SNORM=7,
+			BC6H=8, // RGB unsigned float
+			BC6H_SFLOAT=9,
+			BC7=10, // RGBA
+			BC7_SRGB=11,
+			ETC2_RGB=12,
+			ETC2_RGB_ALPHA1=13,
+			ETC2_RGBA=14,
+			EAC_R=15,
+			EAC_RG=16
+		};
+	}
+	typedef TextureCompressions::def TextureCompression;
+
+	namespace detail
+	{
+		template<int COMPRESSION> struct compressed_internal_format;
+		#define PASTRY_DETAIL_TEX_COMPRESSED(C,V) \
+			template<> struct compressed_internal_format<TextureCompressions::C> { \
+				static constexpr GLint result = V; \
+			};
+		PASTRY_DETAIL_TEX_COMPRESSED(BC1, GL_COMPRESSED_RGB_S3TC_DXT1_EXT)
+		PASTRY_DETAIL_TEX_COMPRESSED(BC1_ALPHA, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT)
+		PASTRY_DETAIL_TEX_COMPRESSED(BC2, GL_COMPRESSED_RGBA_S3TC_DXT3_EXT)
+		PASTRY_DETAIL_TEX_COMPRESSED(BC3, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+		PASTRY_DETAIL_TEX_COMPRESSED(BC4, GL_COMPRESSED_RED_RGTC1)
+		PASTRY_DETAIL_TEX_COMPRESSED(BC4_SNORM, GL_COMPRESSED_SIGNED_RED_RGTC1)
+		PASTRY_DETAIL_TEX_COMPRESSED(BC5, GL_COMPRESSED_RG_RGTC2)
+		PASTRY_DETAIL_TEX_COMPRESSED(BC5_SNORM, GL_COMPRESSED_SIGNED_RG_RGTC2)
+		PASTRY_DETAIL_TEX_COMPRESSED(BC6H, GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT)
+		PASTRY_DETAIL_TEX_COMPRESSED(BC6H_SFLOAT, GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT)
+		PASTRY_DETAIL_TEX_COMPRESSED(BC7, GL_COMPRESSED_RGBA_BPTC_UNORM)
+		PASTRY_DETAIL_TEX_COMPRESSED(BC7_SRGB, GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM)
+		PASTRY_DETAIL_TEX_COMPRESSED(ETC2_RGB, GL_COMPRESSED_RGB8_ETC2)
+		PASTRY_DETAIL_TEX_COMPRESSED(ETC2_RGB_ALPHA1, GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2)
+		PASTRY_DETAIL_TEX_COMPRESSED(ETC2_RGBA, GL_COMPRESSED_RGBA8_ETC2_EAC)
+		PASTRY_DETAIL_TEX_COMPRESSED(EAC_R, GL_COMPRESSED_R11_EAC)
+		PASTRY_DETAIL_TEX_COMPRESSED(EAC_RG, GL_COMPRESSED_RG11_EAC)
+		#undef PASTRY_DETAIL_TEX_COMPRESSED
+	}
+
+	/** 2D texture with a compressed internal format
+	 * Usage example:
+	 *   pastry::compressed_texture<pastry::TextureCompressions::BC7> tex;
+	 *   tex.create(GL_LINEAR_MIPMAP_LINEAR, GL_REPEAT);
+	 *   tex.storage(w, h); // full mipmap chain
+	 *   for(unsigned i=0; i<tex.mipmap_levels(w, h); i++)
+	 *       tex.set_level_from_base(i, w, h, blocks[i]);
+	 */
+	template<int COMPRESSION>
+	struct compressed_texture
+	: public texture_2d
+	{
+		static constexpr GLint internal_format()
+		{ return detail::compressed_internal_format<COMPRESSION>::result; }
+
+		/** Number of bytes of mipmap level 'level' for a base level of size w x h */
+		static std::size_t level_size(unsigned level, unsigned w, unsigned h)
+		{ return detail::compressed_image_size(internal_format(), detail::mipmap_size(w, level), detail::mipmap_size(h, level)); }
+
+		void storage(unsigned w, unsigned h, unsigned levels=0)
+		{ texture_2d::storage(internal_format(), w, h, levels); }
+
+		/** Uploads level 'level' for a base level of size w x h into allocated storage */
+		void set_level_from_base(unsigned level, unsigned w, unsigned h, const void* data)
+		{
+			texture_2d::set_compressed_level(level, internal_format(),
+				detail::mipmap_size(w, level), detail::mipmap_size(h, level),
+				level_size(level, w, h), data);
+		}
+
+		/** Specifies level 'level' for a base level of size w x h with mutable storage */
+		void set_image_from_base(unsigned level, unsigned w, unsigned h, const void* data)
+		{
+			texture_2d::set_compressed_image(level, internal_format(),
+				detail::mipmap_size(w, level), detail::mipmap_size(h, level),
+				level_size(level, w, h), data);
+		}
+	};
+
+	/** Filtering, wrapping and comparison state of a sampler object */
+	struct sampler_desc
+	{
+		GLint min_filter = GL_LINEAR;
+		GLint mag_filter = GL_LINEAR;
+		GLint wrap_s = GL_REPEAT;
+		GLint wrap_t = GL_REPEAT;
+		GLint wrap_r = GL_REPEAT;
+		std::array<float,4> border_color = {{0.0f, 0.0f, 0.0f, 0.0f}};
+		float min_lod = -1000.0f;
+		float max_lod = 1000.0f;
+		float lod_bias = 0.0f;
+		GLint compare_mode = GL_NONE; // GL_COMPARE_REF_TO_TEXTURE for shadow samplers
+		GLint compare_func = GL_LEQUAL;
+		float max_anisotropy = 1.0f;
+
+		static sampler_desc create(GLint filter, GLint wrap)
+		{
+			sampler_desc d;
+			d.min_filter = filter;
+			d.mag_filter = filter;
+			d.wrap_s = wrap;
+			d.wrap_t = wrap;
+			d.wrap_r = wrap;
+			return d;
+		}
+
+		/** Linear filtering between mipmap levels */
+		static sampler_desc create_trilinear(GLint wrap)
+		{
+			sampler_desc d = create(GL_LINEAR, wrap);
+			d.min_filter = GL_LINEAR_MIPMAP_LINEAR;
+			return d;
+		}
+
+		/** Depth comparison for shadow maps */
+		static sampler_desc create_shadow()
+		{
+			sampler_desc d = create(GL_LINEAR, GL_CLAMP_TO_EDGE);
+			d.compare_mode = GL_COMPARE_REF_TO_TEXTURE;
+			return d;
+		}
+
+		bool operator==(const sampler_desc& o) const
+		{
+			return min_filter == o.min_filter && mag_filter == o.mag_filter
+				&& wrap_s == o.wrap_s && wrap_t == o.wrap_t && wrap_r == o.wrap_r
+				&& border_color == o.border_color
+				&& min_lod == o.min_lod && max_lod == o.max_lod && lod_bias == o.lod_bias
+				&& compare_mode == o.compare_mode && compare_func == o.compare_func
+				&& max_anisotropy == o.max_anisotropy;
+		}
+
+		bool operator!=(const sampler_desc& o) const
+		{ return !(*this == o); }
+	};
+
+	namespace detail
+	{
+		inline void hash_combine(std::size_t& seed, std::size_t v)
+		{ seed ^= v + 0x9e3779b9 + (seed << 6) + (seed >> 2); }
+
+		struct sampler_desc_hash
+		{
+			std::size_t operator()(const sampler_desc& d) const
+			{
+				std::hash<GLint> hi;
+				std::hash<float> hf;
+				std::size_t h = hi(d.min_filter);
+				hash_combine(h, hi(d.mag_filter));
+				hash_combine(h, hi(d.wrap_s));
+				hash_combine(h, hi(d.wrap_t));
+				hash_combine(h, hi(d.wrap_r));
+				for(float c : d.border_color) {
+					hash_combine(h, hf(c));
+				}
+				hash_combine(h, hf(d.min_lod));
+				hash_combine(h, hf(d.max_lod));
+				hash_combine(h, hf(d.lod_bias));
+				hash_combine(h, hi(d.compare_mode));
+				hash_combine(h, hi(d.compare_func));
+				hash_combine(h, hf(d.max_anisotropy));
+				return h;
+			}
+		};
+	}
+
+	/** Sampler object which overrides the sampling state of the texture bound to the same unit
+	 * Usage example:
+	 *   pastry::sampler smp{pastry::sampler_desc::create(GL_NEAREST, GL_CLAMP_TO_EDGE)};
+	 *   tex.bind_unit(0);
+	 *   smp.bind(0);
+	 */
+	struct sampler
+	: public detail::resource<rid::sampler>
+	{
+		sampler()
+		{}
+
+		sampler(const sampler_desc& desc)
+		{ set(desc); }
+
+		void set(const sampler_desc& d)
+		{
+			glSamplerParameteri(id(), GL_TEXTURE_MIN_FILTER, d.min_filter);
+			glSamplerParameteri(id(), GL_TEXTURE_MAG_FILTER, d.mag_filter);
+			glSamplerParameteri(id(), GL_TEXTURE_WRAP_S, d.wrap_s);
+			glSamplerParameteri(id(), GL_TEXTURE_WRAP_T, d.wrap_t);
+			glSamplerParameteri(id(), GL_TEXTURE_WRAP_R, d.wrap_r);
+			glSamplerParameterfv(id(), GL_TEXTURE_BORDER_COLOR, d.border_color.data());
+			glSamplerParameterf(id(), GL_TEXTURE_MIN_LOD, d.min_lod);
+			glSamplerParameterf(id(), GL_TEXTURE_MAX_LOD, d.max_lod);
+			glSamplerParameterf(id(), GL_TEXTURE_LOD_BIAS, d.lod_bias);
+			glSamplerParameteri(id(), GL_TEXTURE_COMPARE_MODE, d.compare_mode);
+			glSamplerParameteri(id(), GL_TEXTURE_COMPARE_FUNC, d.compare_func);
+			if(d.max_anisotropy > 1.0f) {
+				glSamplerParameterf(id(), GL_TEXTURE_MAX_ANISOTROPY_EXT, d.max_anisotropy);
+			}
+		}
+
+		void bind(unsigned int unit) const
+		{
+			glBindSampler(unit, id());
+			detail::texture_units().get(unit).sampler = id();
+		}
+
+		static void unbind(unsigned int unit)
+		{
+			glBindSampler(unit, detail::INVALID_ID);
+			detail::texture_units().get(unit).sampler = detail::INVALID_ID;
+		}
+	};
+
+	/** Shares one sampler object between all users of equal sampler state
+	 * Usage example:
+	 *   pastry::sampler_cache samplers;
+	 *   samplers.get(pastry::sampler_desc::create_trilinear(GL_REPEAT)).bind(0);
+	 */
+	struct sampler_cache
+	{
+	private:
+		std::unordered_map<sampler_desc, sampler, detail::sampler_desc_hash> samplers_;
+
+	public:
+		const sampler& get(const sampler_desc& desc)
+		{
+			auto it = samplers_.find(desc);
+			if(it == samplers_.end()) {
+				it = samplers_.insert(std::make_pair(desc, sampler{desc})).first;
+			}
+			return it->second;
+		}
+
+		std::size_t size() const
+		{ return samplers_.size(); }
+
+		void clear()
+		{ samplers_.clear(); }
+	};
+
+	/** Says which texture and sampler go to which sampler uniform of a program
+	 * Units are assigned by the program at link time. bind() only touches units
+	 * whose bound texture or sampler changed and uses multi-bind if available.
+	 * Usage example:
+	 *   pastry::texture_bindings bindings(prog);
+	 *   bindings.set("diffuse", diffuse_tex, samplers.get(desc));
+	 *   bindings.set("normals", normal_tex);
+	 *   // per draw
+	 *   prog.use();
+	 *   bindings.bind();
+	 */
+	struct texture_bindings
+	{
+	private:
+		struct entry
+		{
+			unsigned unit;
+			GLenum target;
+			glid_t texture;
+			glid_t sampler;
+		};
+
+		program program_;
+		std::vector<entry> entries_; // sorted by unit
+
+	public:
+		texture_bindings(const program& p)
+		: program_(p) {}
+
+		/** Assigns a texture to a sampler uniform (or element 'index' of a sampler array) */
+		template<GLenum TARGET>
+		bool set(const std::string& name, const texture_base<TARGET>& tex, unsigned index=0)
+		{ return set_impl(name, index, TARGET, tex.id(), detail::INVALID_ID); }
+
+		template<GLenum TARGET>
+		bool set(const std::string& name, const texture_base<TARGET>& tex, const sampler& smp, unsigned index=0)
+		{ return set_impl(name, index, TARGET, tex.id(), smp.id()); }
+
+		void bind() const
+		{
+			detail::texture_unit_shadow& shadow = detail::texture_units();
+			std::vector<glid_t> textures, samplers;
+			std::size_t i = 0;
+			while(i < entries_.size()) {
+				// find a run of consecutive units which need to change
+				if(is_bound(shadow, entries_[i])) {
+					i++;
+					continue;
+				}
+				std::size_t j = i + 1;
+				while(j < entries_.size()
+					&& entries_[j].unit == entries_[j-1].unit + 1
+					&& !is_bound(shadow, entries_[j])) {
+					j++;
+				}
+				bind_run(shadow, i, j, textures, samplers);
+				i = j;
+			}
+		}
+
+	private:
+		bool set_impl(const std::string& name, unsigned index, GLenum target, glid_t tex, glid_t smp)
+		{
+			int unit = program_.sampler_unit(name, index);
+			if(unit < 0) {
+				std::cerr << "ERROR: Inactive or invalid sampler uniform '" << name << "'" << std::endl;
+				return false;
+			}
+			entry e{static_cast<unsigned>(unit), target, tex, smp};
+			auto it = std::lower_bound(entries_.begin(), entries_.end(), e,
+				[](const entry& a, const entry& b) { return a.unit < b.unit; });
+			if(it != entries_.end() && it->unit == e.unit) {
+				*it = e;
+			}
+			else {
+				entries_.insert(it, e);
+			}
+			return true;
+		}
+
+		static bool is_bound(detail::texture_unit_shadow& shadow, const entry& e)
+		{
+			const detail::texture_unit_shadow::unit& u = shadow.get(e.unit);
+			return u.target == e.target && u.texture == e.texture && u.sampler == e.sampler;
+		}
+
+		void bind_run(detail::texture_unit_shadow& shadow, std::size_t i, std::size_t j,
+			std::vector<glid_t>& textures, std::vector<glid_t>& samplers) const
+		{
+			if(j - i > 1 && GLEW_ARB_multi_bind) {
+				textures.clear();
+				samplers.clear();
+				for(std::size_t k=i; k<j; k++) {
+					textures.push_back(entries_[k].texture);
+					samplers.push_back(entries_[k].sampler);
+				}
+				glBindTextures(entries_[i].unit, j - i, textures.data());
+				glBindSamplers(entries_[i].unit, j - i, samplers.data());
+			}
+			else {
+				for(std::size_t k=i; k<j; k++) {
+					const entry& e = entries_[k];
+					const detail::texture_unit_shadow::unit& u = shadow.get(e.unit);
+					if(u.target != e.target || u.texture != e.texture) {
+						glActiveTexture(GL_TEXTURE0 + e.unit);
+						shadow.active = e.unit;
+						glBindTexture(e.target, e.texture);
+					}
+					if(u.sampler != e.sampler) {
+						glBindSampler(e.unit, e.sampler);
+					}
+				}
+			}
+			for(std::size_t k=i; k<j; k++) {
+				detail::texture_unit_shadow::unit& u = shadow.get(entries_[k].unit);
+				u.target = entries_[k].target;
+				u.texture = entries_[k].texture;
+				u.sampler = entries_[k].sampler;
+			}
+		}
 	};
 
 	struct renderbuffer
@@ -1690,8 +4159,18 @@ namespace pastry
 		void bind()
 		{ glBindRenderbuffer(GL_RENDERBUFFER, id()); }
 		
-		void storage(GLenum internalformat, unsigned width, unsigned height)
-		{ glRenderbufferStorage(GL_RENDERBUFFER, internalformat, width, height); }
+		/** Allocates storage with 'samples' samples per pixel (0: not multisampled)
+		 * Without DSA the renderbuffer must be bound.
+		 */
+		void storage(GLenum internalformat, unsigned width, unsigned height, unsigned samples=0)
+		{
+			if(detail::dsa()) {
+				glNamedRenderbufferStorageMultisample(id(), samples, internalformat, width, height);
+			}
+			else {
+				glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, internalformat, width, height);
+			}
+		}
 	};
 
 	struct framebuffer
@@ -1711,66 +4190,398 @@ namespace pastry
 		void bind(target t=target::BOTH)
 		{ glBindFramebuffer(GetTarget(t), id()); }
 		
-		void attach(GLenum attachment, const texture_2d& tex)
-		{ glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, attachment, GL_TEXTURE_2D, tex.id(), 0); }
+		/** Attaches mipmap level 'level' of a texture
+		 * Cube maps, arrays and 3D textures are attached layered: a geometry shader selects
+		 * the face or layer with gl_Layer, e.g. to render all six faces of a cube map in a
+		 * single pass. All attachments must then be layered.
+		 * Without DSA the framebuffer must be bound.
+		 */
+		template<GLenum TARGET>
+		void attach(GLenum attachment, const texture_base<TARGET>& tex, unsigned level=0)
+		{
+			if(detail::dsa()) {
+				glNamedFramebufferTexture(id(), attachment, tex.id(), level);
+			}
+			else {
+				glFramebufferTexture(GL_DRAW_FRAMEBUFFER, attachment, tex.id(), level);
+			}
+		}
+
+		/** Attaches a single layer of an array or 3D texture or a single face (0..5 in the
+		 * order +X, -X, +Y, -Y, +Z, -Z) of a cube map
+		 */
+		template<GLenum TARGET>
+		void attach_layer(GLenum attachment, const texture_base<TARGET>& tex, unsigned layer, unsigned level=0)
+		{
+			if(detail::dsa()) {
+				glNamedFramebufferTextureLayer(id(), attachment, tex.id(), level, layer);
+			}
+			else if(TARGET == GL_TEXTURE_CUBE_MAP) {
+				glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, attachment, GL_TEXTURE_CUBE_MAP_POSITIVE_X + layer, tex.id(), level);
+			}
+			else {
+				glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, attachment, tex.id(), level, layer);
+			}
+		}
 		
 		void attach(GLenum attachment, const renderbuffer& rbo)
-		{ glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, attachment, GL_RENDERBUFFER, rbo.id()); }
+		{
+			if(detail::dsa()) {
+				glNamedFramebufferRenderbuffer(id(), attachment, GL_RENDERBUFFER, rbo.id());
+			}
+			else {
+				glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, attachment, GL_RENDERBUFFER, rbo.id());
+			}
+		}
+
+		/** Completeness status, i.e. GL_FRAMEBUFFER_COMPLETE; without DSA the framebuffer must be bound */
+		GLenum status() const
+		{
+			if(detail::dsa()) {
+				return glCheckNamedFramebufferStatus(id(), GL_DRAW_FRAMEBUFFER);
+			}
+			else {
+				return glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER);
+			}
+		}
+
+		bool is_complete() const
+		{ return status() == GL_FRAMEBUFFER_COMPLETE; }
+
+		/** Draws into color attachments 0 to num-1; without DSA the framebuffer must be bound */
+		void set_draw_buffers(unsigned num)
+		{
+			std::vector<GLenum> buffers(num);
+			for(unsigned i=0; i<num; i++) {
+				buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+			}
+			if(detail::dsa()) {
+				glNamedFramebufferDrawBuffers(id(), num, buffers.data());
+			}
+			else {
+				glDrawBuffers(num, buffers.data());
+			}
+		}
+
+		/** Copies a rectangle of the buffers in 'mask' into framebuffer 'dst' (0: default framebuffer)
+		 * Resolves multisampled attachments; the rectangles must then have the same size.
+		 * The bound read and draw framebuffers are kept.
+		 */
+		void blit(glid_t dst, unsigned src_w, unsigned src_h, unsigned dst_w, unsigned dst_h,
+			GLbitfield mask=GL_COLOR_BUFFER_BIT, GLenum filter=GL_NEAREST) const
+		{
+			if(detail::dsa()) {
+				glBlitNamedFramebuffer(id(), dst, 0, 0, src_w, src_h, 0, 0, dst_w, dst_h, mask, filter);
+			}
+			else {
+				GLint previous_read, previous_draw;
+				glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &previous_read);
+				glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous_draw);
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, id());
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dst);
+				glBlitFramebuffer(0, 0, src_w, src_h, 0, 0, dst_w, dst_h, mask, filter);
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, previous_read);
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previous_draw);
+			}
+		}
+
+		/** Resolves a multisampled framebuffer into 'dst' (0: default framebuffer) of the same size */
+		void resolve(glid_t dst, unsigned w, unsigned h, GLbitfield mask=GL_COLOR_BUFFER_BIT) const
+		{ blit(dst, w, h, w, h, mask, GL_NEAREST); }
 		
 		static void unbind(target t=target::BOTH)
 		{ glBindFramebuffer(GetTarget(t), detail::INVALID_ID); }
 	};
 
-	/** Enables/disables an OpenGL capability like GL_BLEND and automatically restores the state
+	/** Immutable set of blend, depth, stencil, cull, scissor and color mask settings
+	 * Settings are changed by methods which return a modified copy. apply() compares with
+	 * the state applied last on this thread and only issues the GL calls which differ.
+	 * The shadowed state assumes a new context; call invalidate_pipeline_state() after
+	 * changing any of these settings with raw GL calls.
+	 * Usage example:
+	 *		static const pastry::pipeline_state transparent = pastry::pipeline_state()
+	 *			.blend(true).blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA).depth_write(false);
+	 *		transparent.apply();
+	 */
+	struct pipeline_state
+	{
+	private:
+		struct enables
+		{
+			bool blend = false;
+			bool depth_test = false;
+			bool stencil_test = false;
+			bool cull_face = false;
+			bool scissor_test = false;
+			bool polygon_offset = false;
+			bool alpha_to_coverage = false;
+		};
+
+		enables enabled_;
+		GLenum blend_src_rgb_ = GL_ONE, blend_dst_rgb_ = GL_ZERO;
+		GLenum blend_src_alpha_ = GL_ONE, blend_dst_alpha_ = GL_ZERO;
+		GLenum blend_equation_rgb_ = GL_FUNC_ADD, blend_equation_alpha_ = GL_FUNC_ADD;
+		GLenum depth_func_ = GL_LESS;
+		bool depth_write_ = true;
+		GLenum stencil_func_ = GL_ALWAYS;
+		GLint stencil_ref_ = 0;
+		GLuint stencil_read_mask_ = ~GLuint(0), stencil_write_mask_ = ~GLuint(0);
+		GLenum stencil_fail_ = GL_KEEP, stencil_depth_fail_ = GL_KEEP, stencil_pass_ = GL_KEEP;
+		GLenum cull_mode_ = GL_BACK, front_face_ = GL_CCW;
+		bool color_mask_[4] = {true, true, true, true};
+		float polygon_offset_factor_ = 0.0f, polygon_offset_units_ = 0.0f;
+
+	public:
+		/** Depth test with writes, back face culling and no blending */
+		static pipeline_state opaque()
+		{ return pipeline_state().depth_test(true).cull_face(true); }
+
+		/** Premultiplied alpha blending with depth test but no depth writes */
+		static pipeline_state alpha_blended()
+		{ return pipeline_state().blend(true).blend_func(GL_ONE, GL_ONE_MINUS_SRC_ALPHA).depth_test(true).depth_write(false); }
+
+		pipeline_state blend(bool on) const
+		{ pipeline_state r = *this; r.enabled_.blend = on; return r; }
+
+		pipeline_state blend_func(GLenum src, GLenum dst) const
+		{ return blend_func_separate(src, dst, src, dst); }
+
+		pipeline_state blend_func_separate(GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha) const
+		{
+			pipeline_state r = *this;
+			r.blend_src_rgb_ = src_rgb;
+			r.blend_dst_rgb_ = dst_rgb;
+			r.blend_src_alpha_ = src_alpha;
+			r.blend_dst_alpha_ = dst_alpha;
+			return r;
+		}
+
+		pipeline_state blend_equation(GLenum rgb, GLenum alpha) const
+		{ pipeline_state r = *this; r.blend_equation_rgb_ = rgb; r.blend_equation_alpha_ = alpha; return r; }
+
+		pipeline_state depth_test(bool on) const
+		{ pipeline_state r = *this; r.enabled_.depth_test = on; return r; }
+
+		pipeline_state depth_func(GLenum func) const
+		{ pipeline_state r = *this; r.depth_func_ = func; return r; }
+
+		pipeline_state depth_write(bool on) const
+		{ pipeline_state r = *this; r.depth_write_ = on; return r; }
+
+		pipeline_state stencil_test(bool on) const
+		{ pipeline_state r = *this; r.enabled_.stencil_test = on; return r; }
+
+		pipeline_state stencil_func(GLenum func, GLint ref, GLuint read_mask=~GLuint(0)) const
+		{ pipeline_state r = *this; r.stencil_func_ = func; r.stencil_ref_ = ref; r.stencil_read_mask_ = read_mask; return r; }
+
+		pipeline_state stencil_op(GLenum fail, GLenum depth_fail, GLenum pass) const
+		{ pipeline_state r = *this; r.stencil_fail_ = fail; r.stencil_depth_fail_ = depth_fail; r.stencil_pass_ = pass; return r; }
+
+		pipeline_state stencil_write_mask(GLuint mask) const
+		{ pipeline_state r = *this; r.stencil_write_mask_ = mask; return r; }
+
+		pipeline_state cull_face(bool on) const
+		{ pipeline_state r = *this; r.enabled_.cull_face = on; return r; }
+
+		pipeline_state cull_mode(GLenum mode) const
+		{ pipeline_state r = *this; r.cull_mode_ = mode; return r; }
+
+		pipeline_state front_face(GLenum mode) const
+		{ pipeline_state r = *this; r.front_face_ = mode; return r; }
+
+		pipeline_state scissor_test(bool on) const
+		{ pipeline_state r = *this; r.enabled_.scissor_test = on; return r; }
+
+		pipeline_state color_mask(bool red, bool green, bool blue, bool alpha) const
+		{
+			pipeline_state r = *this;
+			r.color_mask_[0] = red;
+			r.color_mask_[1] = green;
+			r.color_mask_[2] = blue;
+			r.color_mask_[3] = alpha;
+			return r;
+		}
+
+		/** Enables GL_POLYGON_OFFSET_FILL if factor or units are not zero */
+		pipeline_state polygon_offset(float factor, float units) const
+		{
+			pipeline_state r = *this;
+			r.enabled_.polygon_offset = (factor != 0.0f || units != 0.0f);
+			r.polygon_offset_factor_ = factor;
+			r.polygon_offset_units_ = units;
+			return r;
+		}
+
+		pipeline_state alpha_to_coverage(bool on) const
+		{ pipeline_state r = *this; r.enabled_.alpha_to_coverage = on; return r; }
+
+		/** Makes this the current state, skipping all settings which are already set */
+		void apply() const;
+	};
+
+	namespace detail
+	{
+		/** The pipeline state applied last on this thread; invalid after invalidate_pipeline_state() */
+		struct pipeline_state_shadow
+		{
+			pipeline_state current;
+			bool valid = true;
+		};
+
+		inline pipeline_state_shadow& pipeline_states()
+		{
+			static thread_local pipeline_state_shadow shadow;
+			return shadow;
+		}
+	}
+
+	/** Forgets the shadowed pipeline state and capabilities; the next apply() sets everything */
+	inline void invalidate_pipeline_state()
+	{
+		detail::capabilities().invalidate();
+		detail::pipeline_states().valid = false;
+	}
+
+	inline void pipeline_state::apply() const
+	{
+		detail::capability_shadow& caps = detail::capabilities();
+		caps.set(GL_BLEND, enabled_.blend);
+		caps.set(GL_DEPTH_TEST, enabled_.depth_test);
+		caps.set(GL_STENCIL_TEST, enabled_.stencil_test);
+		caps.set(GL_CULL_FACE, enabled_.cull_face);
+		caps.set(GL_SCISSOR_TEST, enabled_.scissor_test);
+		caps.set(GL_POLYGON_OFFSET_FILL, enabled_.polygon_offset);
+		caps.set(GL_SAMPLE_ALPHA_TO_COVERAGE, enabled_.alpha_to_coverage);
+		detail::pipeline_state_shadow& shadow = detail::pipeline_states();
+		const pipeline_state& c = shadow.current;
+		bool all = !shadow.valid;
+		if(all || blend_src_rgb_ != c.blend_src_rgb_ || blend_dst_rgb_ != c.blend_dst_rgb_
+			|| blend_src_alpha_ != c.blend_src_alpha_ || blend_dst_alpha_ != c.blend_dst_alpha_) {
+			glBlendFuncSeparate(blend_src_rgb_, blend_dst_rgb_, blend_src_alpha_, blend_dst_alpha_);
+		}
+		if(all || blend_equation_rgb_ != c.blend_equation_rgb_ || blend_equation_alpha_ != c.blend_equation_alpha_) {
+			glBlendEquationSeparate(blend_equation_rgb_, blend_equation_alpha_);
+		}
+		if(all || depth_func_ != c.depth_func_) {
+			glDepthFunc(depth_func_);
+		}
+		if(all || depth_write_ != c.depth_write_) {
+			glDepthMask(depth_write_ ? GL_TRUE : GL_FALSE);
+		}
+		if(all || stencil_func_ != c.stencil_func_ || stencil_ref_ != c.stencil_ref_ || stencil_read_mask_ != c.stencil_read_mask_) {
+			glStencilFunc(stencil_func_, stencil_ref_, stencil_read_mask_);
+		}
+		if(all || stencil_fail_ != c.stencil_fail_ || stencil_depth_fail_ != c.stencil_depth_fail_ || stencil_pass_ != c.stencil_pass_) {
+			glStencilOp(stencil_fail_, stencil_depth_fail_, stencil_pass_);
+		}
+		if(all || stencil_write_mask_ != c.stencil_write_mask_) {
+			glStencilMask(stencil_write_mask_);
+		}
+		if(all || cull_mode_ != c.cull_mode_) {
+			glCullFace(cull_mode_);
+		}
+		if(all || front_face_ != c.front_face_) {
+			glFrontFace(front_face_);
+		}
+		if(all || !std::equal(color_mask_, color_mask_ + 4, c.color_mask_)) {
+			glColorMask(color_mask_[0], color_mask_[1], color_mask_[2], color_mask_[3]);
+		}
+		if(all || polygon_offset_factor_ != c.polygon_offset_factor_ || polygon_offset_units_ != c.polygon_offset_units_) {
+			glPolygonOffset(polygon_offset_factor_, polygon_offset_units_);
+		}
+		shadow.current = *this;
+		shadow.valid = true;
+	}
+
+	/** Enables/disables OpenGL capabilities like GL_BLEND and restores them when destroyed
+	 * Uses the shadowed capabilities instead of glIsEnabled, so nested scopes which set
+	 * a capability to the state it already has do not issue any GL calls.
 	 * Usage example:
-	 *		{ capability{{GL_BLEND, true}};
+	 *		{ capability blend{{GL_BLEND, true}, {GL_DEPTH_TEST, false}};
 	 *			// ... code to execute with blending enabled
 	 * 		}
 	 */
 	struct capability {
 	private:
-		struct capability_impl {
-			capability_impl(GLenum cap, bool set_to) {
-				cap_ = cap;
-				was_enabled_ = glIsEnabled(cap_);
-				set_to_ = set_to;
-				if(was_enabled_ != set_to_) {
-					if(set_to_) {
-						glEnable(cap_);
-					}
-					else {
-						glDisable(cap_);
-					}
-				}
-			}
+		struct previous
+		{
+			GLenum cap;
+			bool enabled;
+		};
 
-			~capability_impl() {
-				if(was_enabled_ != set_to_) {
-					if(was_enabled_) {
-						glEnable(cap_);
-					}
-					else {
-						glDisable(cap_);
-					}
-				}
-			}
+		std::vector<previous> previous_;
 
-		private:
-			GLenum cap_;
-			bool was_enabled_;
-			bool set_to_;
-		};
 	public:
 		capability(GLenum cap, bool set_to)
-		: capabilities_{{cap, set_to}} {}
-		capability(std::initializer_list<capability_impl> caps_list)
-		: capabilities_(caps_list) {}
+		: capability({{cap, set_to}}) {}
+
+		capability(std::initializer_list<std::pair<GLenum, bool>> caps_list)
+		{
+			detail::capability_shadow& shadow = detail::capabilities();
+			for(const std::pair<GLenum, bool>& c : caps_list) {
+				previous_.push_back(previous{c.first, shadow.get(c.first)});
+				shadow.set(c.first, c.second);
+			}
+		}
+
+		capability(const capability&) = delete;
+		capability& operator=(const capability&) = delete;
+
+		~capability()
+		{
+			detail::capability_shadow& shadow = detail::capabilities();
+			for(auto it=previous_.rbegin(); it!=previous_.rend(); ++it) {
+				shadow.set(it->cap, it->enabled);
+			}
+		}
+	};
+
+	/** Calls f with the given capabilities and restores them afterwards */
+	template<typename F>
+	void with_capabilities(std::initializer_list<std::pair<GLenum, bool>> caps, F f) {
+		capability scope(caps);
+		f();
+	}
+
+	/** Calls f while the temporary capability is alive, e.g. with_capabilities(capability(GL_BLEND, true), f)
+	 * The temporary sets the capabilities when constructed and restores them when it is
+	 * destroyed at the end of the call, so the parameter itself is not used.
+	 */
+	template<typename F>
+	void with_capabilities(const capability&, F f) {
+		f();
+	}
+
+	/** Applies a pipeline state and restores the previous one when destroyed
+	 * Nothing is restored if the shadowed state was invalid when the scope was
+	 * entered, because the previous state is unknown then.
+	 */
+	struct pipeline_state_scope {
 	private:
-		std::vector<capability_impl> capabilities_;
+		pipeline_state previous_;
+		bool restore_;
+
+	public:
+		pipeline_state_scope(const pipeline_state& state)
+		: previous_(detail::pipeline_states().current),
+		  restore_(detail::pipeline_states().valid)
+		{ state.apply(); }
+
+		pipeline_state_scope(const pipeline_state_scope&) = delete;
+		pipeline_state_scope& operator=(const pipeline_state_scope&) = delete;
+
+		~pipeline_state_scope()
+		{
+			if(restore_) {
+				previous_.apply();
+			}
+		}
 	};
 
+	/** Calls f with the given pipeline state and restores the previous state afterwards */
 	template<typename F>
-	void with_capabilities(const capability& caps, F f) {
+	void with_pipeline_state(const pipeline_state& state, F f) {
+		pipeline_state_scope scope(state);
 		f();
 	}
 
@@ -0,0 +1,350 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_ATLAS_HPP
+#define INCLUDED_PASTRY_PASTRYGL_ATLAS_HPP
+
+#include "gl.hpp"
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	/** Packs rectangles into a fixed size bin with the skyline bottom-left heuristic */
+	struct skyline_packer
+	{
+	private:
+		struct segment
+		{
+			unsigned x, y, w;
+		};
+
+		unsigned width_, height_;
+		std::vector<segment> skyline_;
+
+	public:
+		skyline_packer(unsigned w, unsigned h)
+		: width_(w), height_(h), skyline_{{0, 0, w}}
+		{}
+
+		unsigned width() const
+		{ return width_; }
+
+		unsigned height() const
+		{ return height_; }
+
+		/** Finds a place for a w x h rectangle; returns false if the bin is full */
+		bool insert(unsigned w, unsigned h, unsigned& x, unsigned& y)
+		{
+			std::size_t best = skyline_.size();
+			unsigned best_top = std::numeric_limits<unsigned>::max();
+			unsigned best_width = std::numeric_limits<unsigned>::max();
+			for(std::size_t i=0; i<skyline_.size(); i++) {
+				unsigned top;
+				if(!fits(i, w, h, top)) {
+					continue;
+				}
+				if(top + h < best_top || (top + h == best_top && skyline_[i].w < best_width)) {
+					best = i;
+					best_top = top + h;
+					best_width = skyline_[i].w;
+					y = top;
+				}
+			}
+			if(best == skyline_.size()) {
+				return false;
+			}
+			x = skyline_[best].x;
+			add_segment(best, x, y + h, w);
+			return true;
+		}
+
+	private:
+		/** Checks if a rectangle fits with its left edge at segment i */
+		bool fits(std::size_t i, unsigned w, unsigned h, unsigned& top) const
+		{
+			unsigned x = skyline_[i].x;
+			if(x + w > width_) {
+				return false;
+			}
+			top = 0;
+			unsigned remaining = w;
+			for(std::size_t j=i; remaining > 0; j++) {
+				top = std::max(top, skyline_[j].y);
+				if(top + h > height_) {
+					return false;
+				}
+				remaining -= std::min(remaining, skyline_[j].w);
+			}
+			return true;
+		}
+
+		void add_segment(std::size_t i, unsigned x, unsigned y, unsigned w)
+		{
+			skyline_.insert(skyline_.begin() + i, segment{x, y, w});
+			// shrink or remove segments covered by the new one
+			std::size_t j = i + 1;
+			while(j < skyline_.size()) {
+				segment& s = skyline_[j];
+				const segment& p = skyline_[j - 1];
+				if(s.x >= p.x + p.w) {
+					break;
+				}
+				unsigned shrink = p.x + p.w - s.x;
+				if(shrink >= s.w) {
+					skyline_.erase(skyline_.begin() + j);
+					continue;
+				}
+				s.x += shrink;
+				s.w -= shrink;
+				break;
+			}
+			// merge neighbours of equal height
+			for(std::size_t k=0; k+1<skyline_.size();) {
+				if(skyline_[k].y == skyline_[k+1].y) {
+					skyline_[k].w += skyline_[k+1].w;
+					skyline_.erase(skyline_.begin() + k + 1);
+				}
+				else {
+					k++;
+				}
+			}
+		}
+	};
+
+	/** Placement of an image in an atlas */
+	struct atlas_rect
+	{
+		unsigned layer;
+		unsigned x, y, w, h; // in texels
+		float u0, v0, u1, v1; // texture coordinates of the image corners
+	};
+
+	/** Packs many small images into the layers of a texture_2d_array or into one texture_2d
+	 * Images are referenced, not copied, and must stay alive until the texture is built.
+	 * Usage example:
+	 *   pastry::atlas_builder<unsigned char,4> atlas(1024, 1024);
+	 *   for(const icon& i : icons) i.index = atlas.add(i.width, i.height, i.pixels.data());
+	 *   pastry::texture_2d_array tex = atlas.build_array(GL_RGBA8);
+	 *   const pastry::atlas_rect& r = atlas.rect(icons[0].index); // r.layer, r.u0, ...
+	 */
+	template<typename S, unsigned C>
+	struct atlas_builder
+	{
+	private:
+		struct image
+		{
+			unsigned w, h;
+			const S* data;
+			std::size_t row_pitch;
+		};
+
+		unsigned width_, height_, padding_;
+		std::vector<image> images_;
+		std::vector<atlas_rect> rects_;
+		unsigned num_layers_;
+
+	public:
+		/** padding: texels around each image which repeat its edge texels, so that linear
+		 * filtering does not blend in neighbouring images. Mipmap levels above
+		 * log2(padding) have less than one texel of padding and still bleed.
+		 */
+		atlas_builder(unsigned w, unsigned h, unsigned padding=1)
+		: width_(w), height_(h), padding_(padding), num_layers_(0)
+		{}
+
+		/** Adds an image and returns its index; row_pitch in bytes (0: tightly packed) */
+		std::size_t add(unsigned w, unsigned h, const S* data, std::size_t row_pitch=0)
+		{
+			if(w + 2*padding_ > width_ || h + 2*padding_ > height_) {
+				throw exception("pastry: image is larger than the atlas");
+			}
+			images_.push_back({w, h, data, row_pitch});
+			num_layers_ = 0;
+			return images_.size() - 1;
+		}
+
+		std::size_t size() const
+		{ return images_.size(); }
+
+		/** Places all images, highest first, opening a new layer when one is full */
+		void pack()
+		{
+			std::vector<std::size_t> order(images_.size());
+			for(std::size_t i=0; i<order.size(); i++) {
+				order[i] = i;
+			}
+			std::stable_sort(order.begin(), order.end(), [this](std::size_t a, std::size_t b) {
+				return images_[a].h > images_[b].h;
+			});
+			rects_.assign(images_.size(), atlas_rect());
+			std::vector<skyline_packer> layers;
+			for(std::size_t i : order) {
+				const image& img = images_[i];
+				unsigned pw = img.w + 2*padding_;
+				unsigned ph = img.h + 2*padding_;
+				unsigned x, y;
+				std::size_t layer = 0;
+				while(layer < layers.size() && !layers[layer].insert(pw, ph, x, y)) {
+					layer++;
+				}
+				if(layer == layers.size()) {
+					layers.push_back(skyline_packer(width_, height_));
+					layers.back().insert(pw, ph, x, y);
+				}
+				atlas_rect& r = rects_[i];
+				r.layer = layer;
+				r.x = x + padding_;
+				r.y = y + padding_;
+				r.w = img.w;
+				r.h = img.h;
+				r.u0 = float(r.x) / float(width_);
+				r.v0 = float(r.y) / float(height_);
+				r.u1 = float(r.x + r.w) / float(width_);
+				r.v1 = float(r.y + r.h) / float(height_);
+			}
+			num_layers_ = layers.size();
+		}
+
+		unsigned num_layers()
+		{
+			if(num_layers_ == 0 && !images_.empty()) {
+				pack();
+			}
+			return num_layers_;
+		}
+
+		const atlas_rect& rect(std::size_t i)
+		{
+			num_layers();
+			return rects_[i];
+		}
+
+		const std::vector<atlas_rect>& rects()
+		{
+			num_layers();
+			return rects_;
+		}
+
+		/** Uploads all images into the layers of a new array texture */
+		texture_2d_array build_array(GLint internalformat, unsigned levels=1)
+		{
+			texture_2d_array tex;
+			tex.create(GL_LINEAR, GL_CLAMP_TO_EDGE);
+			tex.storage(internalformat, width_, height_, std::max(1u, num_layers()), levels);
+			clear(tex, levels);
+			for(std::size_t i=0; i<images_.size(); i++) {
+				const atlas_rect& r = rects_[i];
+				if(padding_ == 0) {
+					tex.set_sub_image<S,C>(r.x, r.y, r.layer, r.w, r.h, images_[i].data, images_[i].row_pitch);
+				}
+				else {
+					std::vector<S> padded = extrude(images_[i]);
+					tex.set_sub_image<S,C>(r.x - padding_, r.y - padding_, r.layer, r.w + 2*padding_, r.h + 2*padding_, padded.data());
+				}
+			}
+			if(levels != 1) {
+				tex.set_min_filter(GL_LINEAR_MIPMAP_LINEAR);
+				tex.generate_mipmap();
+			}
+			return tex;
+		}
+
+		/** Uploads all images into a new 2D texture; all images must fit into one layer */
+		texture_2d build_texture(GLint internalformat, unsigned levels=1)
+		{
+			if(num_layers() > 1) {
+				throw exception("pastry: images do not fit into a single atlas texture");
+			}
+			texture_2d tex;
+			tex.create(GL_LINEAR, GL_CLAMP_TO_EDGE);
+			tex.storage(internalformat, width_, height_, levels);
+			clear(tex, levels);
+			for(std::size_t i=0; i<images_.size(); i++) {
+				const atlas_rect& r = rects_[i];
+				if(padding_ == 0) {
+					tex.set_sub_image<S,C>(r.x, r.y, r.w, r.h, images_[i].data, images_[i].row_pitch);
+				}
+				else {
+					std::vector<S> padded = extrude(images_[i]);
+					tex.set_sub_image<S,C>(r.x - padding_, r.y - padding_, r.w + 2*padding_, r.h + 2*padding_, padded.data());
+				}
+			}
+			if(levels != 1) {
+				tex.set_min_filter(GL_LINEAR_MIPMAP_LINEAR);
+				tex.generate_mipmap();
+			}
+			return tex;
+		}
+
+	private:
+		/** Copies an image into the middle of its padded rectangle and repeats the edge texels into the padding */
+		std::vector<S> extrude(const image& img) const
+		{
+			unsigned pw = img.w + 2*padding_;
+			unsigned ph = img.h + 2*padding_;
+			std::size_t pitch = img.row_pitch ? img.row_pitch : sizeof(S)*C*img.w;
+			const unsigned char* src = reinterpret_cast<const unsigned char*>(img.data);
+			std::vector<S> dst(std::size_t(pw)*ph*C);
+			for(unsigned y=0; y<ph; y++) {
+				unsigned sy = std::min(img.h - 1, y < padding_ ? 0u : y - padding_);
+				const S* row = reinterpret_cast<const S*>(src + sy*pitch);
+				for(unsigned x=0; x<pw; x++) {
+					unsigned sx = std::min(img.w - 1, x < padding_ ? 0u : x - padding_);
+					std::copy(row + sx*C, row + (sx + 1)*C, &dst[(std::size_t(y)*pw + x)*C]);
+				}
+			}
+			return dst;
+		}
+
+		/** Texels which are not covered by any image must not contain undefined memory
+		 * Gaps are sampled by filtering across the image edge without padding and are
+		 * blended into every image by mipmap generation.
+		 */
+		template<GLenum TARGET>
+		void clear(const texture_base<TARGET>& tex, unsigned levels) const
+		{
+			std::size_t covered = 0;
+			for(const image& img : images_) {
+				covered += std::size_t(img.w + 2*padding_)*(img.h + 2*padding_);
+			}
+			if(levels == 1 && covered == std::size_t(width_)*height_*std::max(1u, num_layers_)) {
+				return;
+			}
+			std::vector<S> zero(width_*height_*C, S(0));
+			detail::unpack_rows unpack(0, sizeof(S)*C, width_);
+			tex.bind();
+			for(int layer=0; layer<tex.depth(); layer++) {
+				if(TARGET == GL_TEXTURE_2D_ARRAY) {
+					glTexSubImage3D(TARGET, 0, 0, 0, layer, width_, height_, 1,
+						detail::texture_format<C>::result, detail::texture_type<S>::result, zero.data());
+				}
+				else {
+					glTexSubImage2D(TARGET, 0, 0, 0, width_, height_,
+						detail::texture_format<C>::result, detail::texture_type<S>::result, zero.data());
+				}
+			}
+		}
+	};
+
+}}
+#endif
@@ -0,0 +1,556 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_CAPTURE_HPP
+#define INCLUDED_PASTRY_PASTRYGL_CAPTURE_HPP
+
+#include "gl.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	/** Pixel layout of captured frames */
+	enum class capture_format
+	{
+		rgba,  // 4 bytes per pixel
+		rgb,   // 3 bytes per pixel
+		yuv420 // planar Y, U and V with half resolution chroma (full range BT.601)
+	};
+
+	/** A frame handed to the sink of a frame_capture; rows are stored top row first */
+	struct captured_frame
+	{
+		uint64_t number;
+		unsigned width, height;
+		capture_format format;
+		std::vector<unsigned char> data;
+	};
+
+	namespace detail
+	{
+		/** Converts a bottom-up RGBA image to 'format' with the top row first (flip) or last */
+		inline void convert_capture(const unsigned char* rgba, unsigned w, unsigned h, bool flip, capture_format format, std::vector<unsigned char>& dst)
+		{
+			auto row = [=](unsigned y) {
+				return rgba + std::size_t(flip ? h - 1 - y : y)*w*4;
+			};
+			if(format == capture_format::rgba) {
+				dst.resize(std::size_t(w)*h*4);
+				for(unsigned y=0; y<h; y++) {
+					std::memcpy(&dst[std::size_t(y)*w*4], row(y), w*4);
+				}
+			}
+			else if(format == capture_format::rgb) {
+				dst.resize(std::size_t(w)*h*3);
+				for(unsigned y=0; y<h; y++) {
+					const unsigned char* s = row(y);
+					unsigned char* d = &dst[std::size_t(y)*w*3];
+					for(unsigned x=0; x<w; x++) {
+						d[3*x] = s[4*x];
+						d[3*x+1] = s[4*x+1];
+						d[3*x+2] = s[4*x+2];
+					}
+				}
+			}
+			else {
+				unsigned cw = (w + 1)/2, ch = (h + 1)/2;
+				dst.resize(std::size_t(w)*h + 2*std::size_t(cw)*ch);
+				unsigned char* py = dst.data();
+				unsigned char* pu = py + std::size_t(w)*h;
+				unsigned char* pv = pu + std::size_t(cw)*ch;
+				// fixed point BT.601 full range as expected by C420jpeg
+				for(unsigned y=0; y<h; y++) {
+					const unsigned char* s = row(y);
+					unsigned char* d = py + std::size_t(y)*w;
+					for(unsigned x=0; x<w; x++) {
+						d[x] = (77*s[4*x] + 150*s[4*x+1] + 29*s[4*x+2] + 128) >> 8;
+					}
+				}
+				for(unsigned y=0; y<ch; y++) {
+					const unsigned char* s0 = row(2*y);
+					const unsigned char* s1 = row(std::min(2*y + 1, h - 1));
+					for(unsigned x=0; x<cw; x++) {
+						unsigned x0 = 4*(2*x), x1 = 4*std::min(2*x + 1, w - 1);
+						int r = (s0[x0] + s0[x1] + s1[x0] + s1[x1] + 2) >> 2;
+						int g = (s0[x0+1] + s0[x1+1] + s1[x0+1] + s1[x1+1] + 2) >> 2;
+						int b = (s0[x0+2] + s0[x1+2] + s1[x0+2] + s1[x1+2] + 2) >> 2;
+						pu[std::size_t(y)*cw + x] = std::min(255, (-43*r - 85*g + 128*b + 32896) >> 8);
+						pv[std::size_t(y)*cw + x] = std::min(255, (128*r - 107*g - 21*b + 32896) >> 8);
+					}
+				}
+			}
+		}
+
+		inline uint32_t png_crc(const unsigned char* p, std::size_t n, uint32_t crc=0xffffffffu)
+		{
+			static const std::vector<uint32_t> table = []() {
+				std::vector<uint32_t> t(256);
+				for(uint32_t i=0; i<256; i++) {
+					uint32_t c = i;
+					for(int k=0; k<8; k++) {
+						c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+					}
+					t[i] = c;
+				}
+				return t;
+			}();
+			for(std::size_t i=0; i<n; i++) {
+				crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+			}
+			return crc;
+		}
+
+		inline void png_u32(std::vector<unsigned char>& v, uint32_t x)
+		{
+			v.push_back(x >> 24);
+			v.push_back(x >> 16);
+			v.push_back(x >> 8);
+			v.push_back(x);
+		}
+
+		inline void png_chunk(std::ostream& os, const char* type, const std::vector<unsigned char>& data)
+		{
+			std::vector<unsigned char> c;
+			png_u32(c, data.size());
+			c.insert(c.end(), type, type + 4);
+			c.insert(c.end(), data.begin(), data.end());
+			png_u32(c, png_crc(c.data() + 4, c.size() - 4) ^ 0xffffffffu);
+			os.write(reinterpret_cast<const char*>(c.data()), c.size());
+		}
+
+		/** Writes an RGB or RGBA PNG with stored (uncompressed) deflate blocks */
+		inline void write_png(std::ostream& os, unsigned w, unsigned h, unsigned channels, const unsigned char* pixels)
+		{
+			static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+			os.write(reinterpret_cast<const char*>(signature), 8);
+			std::vector<unsigned char> ihdr;
+			png_u32(ihdr, w);
+			png_u32(ihdr, h);
+			ihdr.insert(ihdr.end(), { 8, static_cast<unsigned char>(channels == 4 ? 6 : 2), 0, 0, 0 });
+			png_chunk(os, "IHDR", ihdr);
+			// scanlines with filter type 0
+			std::size_t pitch = std::size_t(w)*channels;
+			std::vector<unsigned char> raw;
+			raw.reserve((pitch + 1)*h);
+			for(unsigned y=0; y<h; y++) {
+				raw.push_back(0);
+				raw.insert(raw.end(), pixels + y*pitch, pixels + (y + 1)*pitch);
+			}
+			std::vector<unsigned char> z = { 0x78, 0x01 };
+			std::size_t pos = 0;
+			do {
+				std::size_t n = std::min<std::size_t>(65535, raw.size() - pos);
+				z.push_back(pos + n == raw.size() ? 1 : 0);
+				z.push_back(n & 0xff);
+				z.push_back(n >> 8);
+				z.push_back(~n & 0xff);
+				z.push_back((~n >> 8) & 0xff);
+				z.insert(z.end(), raw.begin() + pos, raw.begin() + pos + n);
+				pos += n;
+			} while(pos < raw.size());
+			uint32_t a = 1, b = 0;
+			for(unsigned char c : raw) {
+				a = (a + c) % 65521;
+				b = (b + a) % 65521;
+			}
+			png_u32(z, (b << 16) | a);
+			png_chunk(os, "IDAT", z);
+			png_chunk(os, "IEND", {});
+		}
+	}
+
+	/** Appends the pixels of all frames to one file */
+	struct raw_writer
+	{
+	private:
+		std::shared_ptr<std::ofstream> os_;
+
+	public:
+		raw_writer(const std::string& fn)
+		: os_(std::make_shared<std::ofstream>(fn, std::ios::binary))
+		{
+			if(!*os_) {
+				throw exception("pastry: could not open '" + fn + "' for writing");
+			}
+		}
+
+		void operator()(const captured_frame& f) const
+		{ os_->write(reinterpret_cast<const char*>(f.data.data()), f.data.size()); }
+	};
+
+	/** Writes a YUV4MPEG2 video from frames in capture_format::yuv420 */
+	struct y4m_writer
+	{
+	private:
+		std::shared_ptr<std::ofstream> os_;
+		unsigned fps_;
+
+	public:
+		y4m_writer(const std::string& fn, unsigned fps=30)
+		: os_(std::make_shared<std::ofstream>(fn, std::ios::binary)), fps_(fps)
+		{
+			if(!*os_) {
+				throw exception("pastry: could not open '" + fn + "' for writing");
+			}
+		}
+
+		void operator()(const captured_frame& f) const
+		{
+			if(f.format != capture_format::yuv420) {
+				throw exception("pastry: y4m_writer requires frames in capture_format::yuv420");
+			}
+			if(os_->tellp() == 0) {
+				*os_ << "YUV4MPEG2 W" << f.width << " H" << f.height << " F" << fps_ << ":1 Ip A1:1 C420jpeg\n";
+			}
+			*os_ << "FRAME\n";
+			os_->write(reinterpret_cast<const char*>(f.data.data()), f.data.size());
+		}
+	};
+
+	/** Writes every frame in capture_format::rgb or rgba to its own uncompressed PNG file
+	 * pattern: printf format for the frame number, e.g. "frames/%05d.png"
+	 */
+	struct png_sequence_writer
+	{
+	private:
+		std::string pattern_;
+
+	public:
+		png_sequence_writer(const std::string& pattern)
+		: pattern_(pattern)
+		{}
+
+		void operator()(const captured_frame& f) const
+		{
+			if(f.format == capture_format::yuv420) {
+				throw exception("pastry: png_sequence_writer requires frames in capture_format::rgb or rgba");
+			}
+			std::vector<char> fn(pattern_.size() + 32);
+			std::snprintf(fn.data(), fn.size(), pattern_.c_str(), static_cast<int>(f.number));
+			std::ofstream os(fn.data(), std::ios::binary);
+			if(!os) {
+				throw exception(std::string("pastry: could not open '") + fn.data() + "' for writing");
+			}
+			detail::write_png(os, f.width, f.height, f.format == capture_format::rgba ? 4 : 3, f.data.data());
+		}
+	};
+
+	/** Captures rendered frames without stalling the render thread
+	 * capture() starts an asynchronous read of the bound read framebuffer into a ring of
+	 * pixel pack buffers. poll() hands finished readbacks to a worker thread, which
+	 * converts them (flipping the rows to top row first) and passes them to the sink,
+	 * e.g. a raw_writer, y4m_writer or png_sequence_writer.
+	 * With GL 4.4 or ARB_buffer_storage the buffers stay persistently mapped: the worker
+	 * reads the pixels straight from the mapping and the buffer is reused once the sink
+	 * returns. Otherwise poll() copies each readback out of its buffer.
+	 * If all buffers are busy the ring grows instead of waiting for the GPU, up to
+	 * max_pending frames which are captured but not yet written. When that limit is
+	 * reached capture() drops the frame; dropped frames still take a frame number, so
+	 * gaps in the numbers show where frames are missing.
+	 * Exceptions thrown by the sink are rethrown by the next poll(). If a readback can not
+	 * be mapped, poll() or finish() throws and the frame is lost.
+	 * Usage example:
+	 *   pastry::frame_capture cap(pastry::capture_format::yuv420, pastry::y4m_writer("out.y4m", 60));
+	 *   // every frame after rendering
+	 *   cap.capture(w, h);
+	 *   cap.poll();
+	 *   // at the end
+	 *   cap.finish();
+	 */
+	struct frame_capture
+	{
+	public:
+		typedef std::function<void(const captured_frame&)> sink_function;
+
+	private:
+		struct slot
+		{
+			pixel_pack_buffer pbo;
+			fence sync;
+			uint64_t number;
+			unsigned width, height;
+			const unsigned char* mapped; // persistent mapping or null
+		};
+
+		/** A readback handed to the worker */
+		struct readback
+		{
+			std::size_t slot;
+			uint64_t number;
+			unsigned width, height;
+			const unsigned char* pixels; // into a persistent mapping or null
+			std::vector<unsigned char> copy;
+		};
+
+		capture_format format_;
+		sink_function sink_;
+		bool flip_;
+		bool persistent_;
+		std::size_t max_pending_;
+		std::vector<slot> slots_;
+		std::vector<std::size_t> free_;
+		std::deque<std::size_t> in_flight_;
+		uint64_t num_captured_;
+		uint64_t num_dropped_;
+
+		std::thread worker_;
+		std::mutex mutex_;
+		std::condition_variable cv_queued_;
+		std::condition_variable cv_done_;
+		std::deque<readback> queued_;
+		std::vector<std::size_t> recycled_;
+		bool busy_;
+		bool stop_;
+		std::exception_ptr error_;
+
+	public:
+		/** ring_size: number of pixel pack buffers allocated up front
+		 * flip: OpenGL returns the bottom row first; flip for files which store the top row first
+		 * max_pending: frames which may wait for the GPU or the sink before frames are dropped
+		 */
+		frame_capture(capture_format format, sink_function sink, unsigned ring_size=3, bool flip=true, unsigned max_pending=8)
+		: format_(format), sink_(sink), flip_(flip),
+		  persistent_(GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage),
+		  max_pending_(std::max(1u, max_pending)), num_captured_(0), num_dropped_(0), busy_(false), stop_(false)
+		{
+			for(unsigned i=0; i<ring_size; i++) {
+				add_slot();
+			}
+			worker_ = std::thread([this]() { run(); });
+		}
+
+		frame_capture(const frame_capture&) = delete;
+		frame_capture& operator=(const frame_capture&) = delete;
+
+		/** Writes the frames which have been handed to the worker; readbacks in flight are dropped */
+		~frame_capture()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stop_ = true;
+			}
+			cv_queued_.notify_all();
+			worker_.join();
+		}
+
+		/** Starts reading the w x h pixels at the origin of the bound read framebuffer
+		 * Returns false if the frame was dropped because max_pending frames are pending.
+		 */
+		bool capture(unsigned w, unsigned h)
+		{
+			poll();
+			if(num_pending() >= max_pending_) {
+				num_captured_++;
+				num_dropped_++;
+				return false;
+			}
+			if(free_.empty()) {
+				add_slot();
+			}
+			std::size_t i = free_.back();
+			free_.pop_back();
+			slot& s = slots_[i];
+			std::size_t num_bytes = std::size_t(w)*h*4;
+			if(s.pbo.num_bytes() != num_bytes) {
+				allocate(s, num_bytes);
+			}
+			s.pbo.bind();
+			glPixelStorei(GL_PACK_ALIGNMENT, 4);
+			glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			s.sync = fence();
+			// the fence must reach the GPU before poll() checks it
+			glFlush();
+			s.number = num_captured_++;
+			s.width = w;
+			s.height = h;
+			in_flight_.push_back(i);
+			return true;
+		}
+
+		/** Hands finished readbacks to the worker in capture order; never blocks on the GPU */
+		void poll()
+		{
+			rethrow();
+			reclaim();
+			while(!in_flight_.empty() && slots_[in_flight_.front()].sync.signaled()) {
+				hand_over();
+			}
+		}
+
+		/** Waits until all captured frames have been written */
+		void finish()
+		{
+			while(!in_flight_.empty()) {
+				slots_[in_flight_.front()].sync.wait();
+				hand_over();
+			}
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cv_done_.wait(lock, [this]() { return queued_.empty() && !busy_; });
+			}
+			reclaim();
+			rethrow();
+		}
+
+		/** Number of frames which have been captured but not yet written */
+		std::size_t num_pending()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return in_flight_.size() + queued_.size() + (busy_ ? 1 : 0);
+		}
+
+		/** Number of frames dropped because too many frames were pending */
+		uint64_t num_dropped() const
+		{ return num_dropped_; }
+
+		/** Number of pixel pack buffers in the ring */
+		std::size_t ring_size() const
+		{ return slots_.size(); }
+
+		/** True if the worker reads from persistently mapped buffers */
+		bool is_persistent() const
+		{ return persistent_; }
+
+	private:
+		void add_slot()
+		{
+			slots_.push_back(slot{pixel_pack_buffer(), fence(nullptr), 0, 0, 0, nullptr});
+			free_.push_back(slots_.size() - 1);
+		}
+
+		void allocate(slot& s, std::size_t num_bytes)
+		{
+			if(!persistent_) {
+				s.pbo.init_data(num_bytes, GL_STREAM_READ);
+				return;
+			}
+			// immutable storage can not be resized
+			const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			s.pbo = pixel_pack_buffer();
+			s.pbo.storage(num_bytes, flags);
+			s.mapped = static_cast<const unsigned char*>(s.pbo.map(0, num_bytes, flags));
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			if(!s.mapped) {
+				throw exception("pastry: could not map pixel pack buffer for frame capture");
+			}
+		}
+
+		/** Returns the buffers whose pixels the worker has written */
+		void reclaim()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			free_.insert(free_.end(), recycled_.begin(), recycled_.end());
+			recycled_.clear();
+		}
+
+		void hand_over()
+		{
+			std::size_t i = in_flight_.front();
+			in_flight_.pop_front();
+			slot& s = slots_[i];
+			s.sync = fence(nullptr);
+			readback r{i, s.number, s.width, s.height, s.mapped, {}};
+			if(!s.mapped) {
+				r.copy.resize(s.pbo.num_bytes());
+				// the slot can be reused even if the frame is lost
+				free_.push_back(i);
+				const void* p = s.pbo.map(0, r.copy.size(), GL_MAP_READ_BIT);
+				if(!p) {
+					glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+					throw exception("pastry: could not map pixel pack buffer of captured frame " + std::to_string(r.number));
+				}
+				std::memcpy(r.copy.data(), p, r.copy.size());
+				bool intact = s.pbo.unmap();
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+				if(!intact) {
+					throw exception("pastry: pixels of captured frame " + std::to_string(r.number) + " were lost while mapped");
+				}
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				queued_.push_back(std::move(r));
+			}
+			cv_queued_.notify_one();
+		}
+
+		void rethrow()
+		{
+			std::exception_ptr e;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				std::swap(e, error_);
+			}
+			if(e) {
+				std::rethrow_exception(e);
+			}
+		}
+
+		void run()
+		{
+			while(true) {
+				readback r;
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					cv_queued_.wait(lock, [this]() { return stop_ || !queued_.empty(); });
+					if(queued_.empty()) {
+						return;
+					}
+					r = std::move(queued_.front());
+					queued_.pop_front();
+					busy_ = true;
+				}
+				try {
+					captured_frame out{r.number, r.width, r.height, format_, {}};
+					detail::convert_capture(r.pixels ? r.pixels : r.copy.data(), r.width, r.height, flip_, format_, out.data);
+					if(sink_) sink_(out);
+				}
+				catch(...) {
+					std::lock_guard<std::mutex> lock(mutex_);
+					error_ = std::current_exception();
+				}
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					if(r.pixels) {
+						recycled_.push_back(r.slot);
+					}
+					busy_ = false;
+				}
+				cv_done_.notify_all();
+			}
+		}
+	};
+
+}}
+#endif
@@ -0,0 +1,290 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_CULLING_HPP
+#define INCLUDED_PASTRY_PASTRYGL_CULLING_HPP
+
+#include "gl.hpp"
+#include <array>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	/** Hierarchical-Z depth pyramid
+	 * Level 0 is a copy of a depth texture; every texel of a coarser level holds the
+	 * farthest depth of the texels it covers. Requires OpenGL 4.3 and the default
+	 * depth convention (depth test GL_LESS, depth range [0,1]).
+	 * Usage example:
+	 *   pastry::hiz_pyramid hiz(w, h);
+	 *   // after rendering the occluders (or at the end of the previous frame)
+	 *   hiz.build(depth_texture);
+	 */
+	struct hiz_pyramid
+	{
+	private:
+		unsigned width_, height_;
+		texture_2d tex_;
+		program copy_;
+		program reduce_;
+
+	public:
+		hiz_pyramid(unsigned w, unsigned h)
+		: width_(w), height_(h)
+		{
+			tex_.create(GL_NEAREST, GL_CLAMP_TO_EDGE);
+			// texelFetch of coarser levels requires a mipmapped min filter
+			tex_.set_min_filter(GL_NEAREST_MIPMAP_NEAREST);
+			tex_.storage(GL_R32F, w, h);
+			copy_ = create_compute_program(
+				"#version 430\n"
+				"layout(local_size_x=8, local_size_y=8) in;\n"
+				"uniform sampler2D depth;\n"
+				"layout(r32f, binding=0) writeonly uniform image2D dst;\n"
+				"void main() {\n"
+				"	ivec2 p = ivec2(gl_GlobalInvocationID.xy);\n"
+				"	if(any(greaterThanEqual(p, imageSize(dst)))) return;\n"
+				"	imageStore(dst, p, vec4(texelFetch(depth, p, 0).r));\n"
+				"}\n");
+			reduce_ = create_compute_program(
+				"#version 430\n"
+				"layout(local_size_x=8, local_size_y=8) in;\n"
+				"layout(r32f, binding=0) readonly uniform image2D src;\n"
+				"layout(r32f, binding=1) writeonly uniform image2D dst;\n"
+				"void main() {\n"
+				"	ivec2 p = ivec2(gl_GlobalInvocationID.xy);\n"
+				"	ivec2 ds = imageSize(dst);\n"
+				"	if(any(greaterThanEqual(p, ds))) return;\n"
+				"	ivec2 ss = imageSize(src);\n"
+				// the last texel of an odd sized level also covers the extra row or column
+				"	ivec2 e = ivec2(p.x == ds.x - 1 && (ss.x & 1) == 1 ? 2 : 1, p.y == ds.y - 1 && (ss.y & 1) == 1 ? 2 : 1);\n"
+				"	float d = 0.0;\n"
+				"	for(int y=0; y<=e.y; y++) for(int x=0; x<=e.x; x++)\n"
+				"		d = max(d, imageLoad(src, min(2*p + ivec2(x, y), ss - 1)).r);\n"
+				"	imageStore(dst, p, vec4(d));\n"
+				"}\n");
+		}
+
+		unsigned width() const
+		{ return width_; }
+
+		unsigned height() const
+		{ return height_; }
+
+		unsigned levels() const
+		{ return tex_.levels(); }
+
+		const texture_2d& texture() const
+		{ return tex_; }
+
+		/** Rebuilds all levels from a depth texture of the same size */
+		void build(const texture_2d& depth)
+		{
+			if(depth.width() != int(width_) || depth.height() != int(height_)) {
+				throw exception("pastry: depth texture does not match the size of the depth pyramid");
+			}
+			depth.bind_unit(copy_.sampler_unit("depth"));
+			tex_.bind_image(0, GL_WRITE_ONLY, 0);
+			copy_.dispatch_invocations(width_, height_);
+			for(unsigned level=1; level<levels(); level++) {
+				memory_barrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+				tex_.bind_image(0, GL_READ_ONLY, level - 1);
+				tex_.bind_image(1, GL_WRITE_ONLY, level);
+				reduce_.dispatch_invocations(detail::mipmap_size(width_, level), detail::mipmap_size(height_, level));
+			}
+			memory_barrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+		}
+	};
+
+	/** Culls instances against the view frustum and a depth pyramid on the GPU
+	 * Every instance has a bounding sphere (xyz: world space center, w: radius) in a
+	 * shader storage buffer. Visible instances are copied into visible_instances() and
+	 * counted into the instance count of command(), so that the result can be drawn
+	 * with multi_mesh::render_indirect without reading anything back.
+	 * The instance buffer must have a layout whose stride is a multiple of 4 bytes.
+	 * visible_instances() gets the instance layout given to the constructor, so vertex
+	 * arrays can be created before the first cull.
+	 * Usage example:
+	 *   pastry::instance_culler culler({{"offset", GL_FLOAT, 3}});
+	 *   culler.set_command(pastry::draw_elements_indirect_command{num_indices, 0, 0, 0, 0});
+	 *   pastry::vertex_array va(prog, {{"position", vertices}, {"offset", culler.visible_instances(), "offset", 1}});
+	 *   // every frame
+	 *   culler.cull(bounds, instances, num_instances, proj*view, &hiz);
+	 *   va.bind();
+	 *   mesh.render_indirect(culler.command());
+	 */
+	struct instance_culler
+	{
+	private:
+		program prog_;
+		array_buffer visible_;
+		draw_indirect_buffer command_;
+		std::vector<GLuint> command_words_;
+
+		uniform<unsigned> num_instances_, instance_words_;
+		uniform<Eigen::Vector4f,6> planes_;
+		uniform<Eigen::Matrix4f> view_proj_;
+		uniform<int> use_hiz_, hiz_levels_;
+		uniform<Eigen::Vector2f> hiz_size_;
+		int hiz_unit_;
+
+	public:
+		/** instance_layout: layout of the instance buffers which are culled */
+		instance_culler(const std::vector<detail::layout_item>& instance_layout=std::vector<detail::layout_item>())
+		: command_words_(5, 0)
+		{
+			set_instance_layout(instance_layout);
+			prog_ = create_compute_program(
+				"#version 430\n"
+				"layout(local_size_x=64) in;\n"
+				"layout(std430, binding=0) readonly buffer Bounds { vec4 bounds[]; };\n"
+				"layout(std430, binding=1) readonly buffer Instances { uint instances_in[]; };\n"
+				"layout(std430, binding=2) writeonly buffer Visible { uint instances_out[]; };\n"
+				"layout(std430, binding=3) buffer Command { uint command[]; };\n"
+				"uniform uint num_instances;\n"
+				"uniform uint instance_words;\n"
+				"uniform vec4 planes[6];\n"
+				"uniform mat4 view_proj;\n"
+				"uniform int use_hiz;\n"
+				"uniform sampler2D hiz;\n"
+				"uniform vec2 hiz_size;\n"
+				"uniform int hiz_levels;\n"
+				"bool occluded(vec3 c, float r) {\n"
+				"	vec3 lo = vec3(1e30);\n"
+				"	vec3 hi = vec3(-1e30);\n"
+				"	for(int i=0; i<8; i++) {\n"
+				"		vec3 corner = c + r*vec3((i&1) == 0 ? -1.0 : 1.0, (i&2) == 0 ? -1.0 : 1.0, (i&4) == 0 ? -1.0 : 1.0);\n"
+				"		vec4 p = view_proj * vec4(corner, 1.0);\n"
+				"		if(p.w <= 0.0) return false;\n"
+				"		vec3 n = p.xyz / p.w * 0.5 + 0.5;\n"
+				"		lo = min(lo, n);\n"
+				"		hi = max(hi, n);\n"
+				"	}\n"
+				"	lo.xy = clamp(lo.xy, 0.0, 1.0);\n"
+				"	hi.xy = clamp(hi.xy, 0.0, 1.0);\n"
+				"	vec2 extent = (hi.xy - lo.xy) * hiz_size;\n"
+				// at this level the screen rectangle covers at most 2x2 texels
+				"	int level = clamp(int(ceil(log2(max(max(extent.x, extent.y), 1.0)))), 0, hiz_levels - 1);\n"
+				"	ivec2 dim = textureSize(hiz, level);\n"
+				"	ivec2 a = min(ivec2(lo.xy * hiz_size) >> level, dim - 1);\n"
+				"	ivec2 b = min(ivec2(hi.xy * hiz_size) >> level, dim - 1);\n"
+				"	float d = max(max(texelFetch(hiz, a, level).r, texelFetch(hiz, ivec2(b.x, a.y), level).r),\n"
+				"		max(texelFetch(hiz, ivec2(a.x, b.y), level).r, texelFetch(hiz, b, level).r));\n"
+				"	return lo.z > d;\n"
+				"}\n"
+				"void main() {\n"
+				"	uint i = gl_GlobalInvocationID.x;\n"
+				"	if(i >= num_instances) return;\n"
+				"	vec4 s = bounds[i];\n"
+				"	for(int k=0; k<6; k++) {\n"
+				"		if(dot(planes[k].xyz, s.xyz) + planes[k].w < -s.w) return;\n"
+				"	}\n"
+				"	if(use_hiz != 0 && occluded(s.xyz, s.w)) return;\n"
+				"	uint slot = atomicAdd(command[1], 1u);\n"
+				"	for(uint k=0u; k<instance_words; k++) {\n"
+				"		instances_out[slot*instance_words + k] = instances_in[i*instance_words + k];\n"
+				"	}\n"
+				"}\n");
+			num_instances_ = prog_.get_uniform<unsigned>("num_instances");
+			instance_words_ = prog_.get_uniform<unsigned>("instance_words");
+			planes_ = prog_.get_uniform<Eigen::Vector4f,6>("planes");
+			view_proj_ = prog_.get_uniform<Eigen::Matrix4f>("view_proj");
+			use_hiz_ = prog_.get_uniform<int>("use_hiz");
+			hiz_size_ = prog_.get_uniform<Eigen::Vector2f>("hiz_size");
+			hiz_levels_ = prog_.get_uniform<int>("hiz_levels");
+			hiz_unit_ = prog_.sampler_unit("hiz");
+		}
+
+		/** Sets the layout of the culled instance buffers and of visible_instances() */
+		void set_instance_layout(const std::vector<detail::layout_item>& instance_layout)
+		{ visible_.set_layout(instance_layout); }
+
+		/** Command which is written for every cull; its instance count is replaced */
+		void set_command(const draw_arrays_indirect_command& cmd)
+		{ command_words_ = {cmd.count, 0, cmd.first, cmd.base_instance}; }
+
+		void set_command(const draw_elements_indirect_command& cmd)
+		{ command_words_ = {cmd.count, 0, cmd.first_index, GLuint(cmd.base_vertex), cmd.base_instance}; }
+
+		/** Visible instances with the layout of the culled instance buffer */
+		const array_buffer& visible_instances() const
+		{ return visible_; }
+
+		const draw_indirect_buffer& command() const
+		{ return command_; }
+
+		/** Normalized planes (xyz: normal pointing inside, w: offset) of the frustum of view_proj */
+		static std::array<Eigen::Vector4f,6> frustum_planes(const Eigen::Matrix4f& view_proj)
+		{
+			Eigen::Vector4f r0 = view_proj.row(0).transpose();
+			Eigen::Vector4f r1 = view_proj.row(1).transpose();
+			Eigen::Vector4f r2 = view_proj.row(2).transpose();
+			Eigen::Vector4f r3 = view_proj.row(3).transpose();
+			std::array<Eigen::Vector4f,6> planes = {{ r3 + r0, r3 - r0, r3 + r1, r3 - r1, r3 + r2, r3 - r2 }};
+			for(Eigen::Vector4f& p : planes) {
+				p /= p.head<3>().norm();
+			}
+			return planes;
+		}
+
+		/** Culls num_instances instances
+		 * bounds: one vec4 bounding sphere per instance
+		 * instances: per instance vertex attributes, i.e. the instance buffer of a multi_mesh
+		 * hiz: optional depth pyramid built with the same view_proj (or the one of the last frame)
+		 */
+		void cull(const shader_storage_buffer& bounds, const array_buffer& instances, std::size_t num_instances,
+			const Eigen::Matrix4f& view_proj, const hiz_pyramid* hiz=nullptr)
+		{
+			if(instances.layout_.empty() || instances.layout_.back().offset_end % 4 != 0) {
+				throw exception("pastry: instance buffer needs a layout with a stride of a multiple of 4 bytes");
+			}
+			std::size_t stride = instances.layout_.back().offset_end;
+			if(visible_.layout_.empty()) {
+				visible_.layout_ = instances.layout_;
+			}
+			else if(visible_.layout_.back().offset_end != stride) {
+				throw exception("pastry: instance buffer does not match the instance layout of the culler");
+			}
+			if(visible_.num_bytes() < num_instances*stride) {
+				visible_.init_data(num_instances*stride, GL_DYNAMIC_COPY);
+			}
+			command_.update_data(command_words_);
+			bounds.bind_base(0);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, instances.id());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, visible_.id());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, command_.id());
+			std::array<Eigen::Vector4f,6> planes = frustum_planes(view_proj);
+			num_instances_.set(num_instances);
+			instance_words_.set(stride / 4);
+			planes_.set({planes[0], planes[1], planes[2], planes[3], planes[4], planes[5]});
+			view_proj_.set(view_proj);
+			use_hiz_.set(hiz ? 1 : 0);
+			if(hiz) {
+				hiz->texture().bind_unit(hiz_unit_);
+				hiz_size_.set(Eigen::Vector2f(hiz->width(), hiz->height()));
+				hiz_levels_.set(hiz->levels());
+			}
+			prog_.dispatch_invocations(num_instances);
+			memory_barrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+		}
+	};
+
+}}
+#endif
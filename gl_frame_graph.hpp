@@ -0,0 +1,528 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_FRAME_GRAPH_HPP
+#define INCLUDED_PASTRY_PASTRYGL_FRAME_GRAPH_HPP
+
+#include "gl.hpp"
+#include "gl_render_targets.hpp"
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	/** Schedules the render passes of one frame
+	 * Passes declare which resources they read and write. Before execution the graph
+	 * culls passes whose results are never read, computes the lifetime of all transient
+	 * textures and acquires them from a render_target_pool only for that lifetime, so
+	 * later passes reuse the memory of textures with the same size and format. Memory
+	 * barriers are issued after image stores which are read by later passes.
+	 * Imported textures and framebuffers and resources marked as output are never culled;
+	 * transient outputs stay acquired until clear().
+	 * Usage example:
+	 *   pastry::frame_graph fg(pool);
+	 *   auto hdr = fg.create_texture("hdr", w, h, GL_RGBA16F);
+	 *   auto depth = fg.create_texture("depth", w, h, GL_DEPTH_COMPONENT24);
+	 *   auto screen = fg.import_framebuffer("screen", 0, w, h);
+	 *   fg.add_pass("scene", [&](const pastry::frame_graph::context&) { draw_scene(); })
+	 *     .write(hdr).write(depth);
+	 *   fg.add_pass("tonemap", [&](const pastry::frame_graph::context& c) {
+	 *       c.texture(hdr).bind(); draw_fullscreen(); })
+	 *     .read(hdr).write(screen);
+	 *   fg.execute();
+	 *   fg.clear();
+	 *   pool.next_frame();
+	 */
+	struct frame_graph
+	{
+	public:
+		typedef std::size_t handle;
+
+		struct context;
+
+		typedef std::function<void(const context&)> execute_function;
+
+		/** How a pass uses a resource */
+		enum class access
+		{
+			sample,      // read with a sampler
+			image_read,  // read with image load
+			image_write, // written with image store
+			attachment   // rendered into as framebuffer attachment
+		};
+
+	private:
+		struct resource
+		{
+			std::string name;
+			unsigned width, height;
+			GLint internalformat;
+			unsigned samples;
+			bool imported;
+			bool output;
+			bool is_framebuffer;
+			glid_t framebuffer_id;
+			texture_2d texture;
+			texture_2d_multisample multisample_texture;
+			// computed by compile()
+			std::vector<std::size_t> writers;
+			unsigned num_readers;
+			int first_use, last_use;
+		};
+
+		struct resource_use
+		{
+			handle h;
+			access a;
+		};
+
+		struct pass
+		{
+			std::string name;
+			execute_function execute;
+			std::vector<resource_use> reads, writes;
+			bool keep;
+			// computed by compile()
+			bool culled;
+			unsigned num_used_writes;
+			GLbitfield barriers;
+		};
+
+		render_target_pool& pool_;
+		std::vector<resource> resources_;
+		std::vector<pass> passes_;
+		bool compiled_;
+
+	public:
+		/** Gives a pass access to the textures of the graph */
+		struct context
+		{
+			const frame_graph* graph;
+			std::size_t pass_index;
+
+			const std::string& name() const
+			{ return graph->passes_[pass_index].name; }
+
+			texture_2d texture(handle h) const
+			{
+				const resource& r = graph->get(h);
+				if(r.texture.id() == 0) {
+					throw exception("pastry: frame graph resource '" + r.name + "' is not a texture available to pass '" + name() + "'");
+				}
+				return r.texture;
+			}
+
+			texture_2d_multisample multisample_texture(handle h) const
+			{
+				const resource& r = graph->get(h);
+				if(r.multisample_texture.id() == 0) {
+					throw exception("pastry: frame graph resource '" + r.name + "' is not a multisample texture available to pass '" + name() + "'");
+				}
+				return r.multisample_texture;
+			}
+		};
+
+		/** Declares the resources of a pass; returned by add_pass */
+		struct pass_builder
+		{
+			frame_graph* graph;
+			std::size_t pass_index;
+
+			pass_builder& read(handle h, access a=access::sample)
+			{
+				graph->get(h);
+				graph->passes_[pass_index].reads.push_back(resource_use{h, a});
+				graph->compiled_ = false;
+				return *this;
+			}
+
+			pass_builder& write(handle h, access a=access::attachment)
+			{
+				graph->get(h);
+				graph->passes_[pass_index].writes.push_back(resource_use{h, a});
+				graph->compiled_ = false;
+				return *this;
+			}
+
+			/** The pass is executed even if no one reads its results */
+			pass_builder& keep()
+			{
+				graph->passes_[pass_index].keep = true;
+				return *this;
+			}
+		};
+
+		frame_graph(render_target_pool& pool)
+		: pool_(pool), compiled_(false)
+		{}
+
+		/** A transient texture which only exists while passes use it (samples=0: not multisampled) */
+		handle create_texture(const std::string& name, unsigned w, unsigned h, GLint internalformat, unsigned samples=0)
+		{
+			resource r = make_resource(name, w, h);
+			r.internalformat = internalformat;
+			r.samples = samples;
+			resources_.push_back(r);
+			compiled_ = false;
+			return resources_.size() - 1;
+		}
+
+		/** A texture which lives outside of the graph, e.g. the result of a previous frame */
+		handle import_texture(const std::string& name, const texture_2d& tex)
+		{
+			resource r = make_resource(name, tex.width(), tex.height());
+			r.internalformat = tex.internalformat();
+			r.imported = true;
+			r.texture = tex;
+			resources_.push_back(r);
+			compiled_ = false;
+			return resources_.size() - 1;
+		}
+
+		/** A framebuffer which lives outside of the graph, e.g. 0 for the default framebuffer */
+		handle import_framebuffer(const std::string& name, glid_t fbo, unsigned w, unsigned h)
+		{
+			resource r = make_resource(name, w, h);
+			r.imported = true;
+			r.is_framebuffer = true;
+			r.framebuffer_id = fbo;
+			resources_.push_back(r);
+			compiled_ = false;
+			return resources_.size() - 1;
+		}
+
+		/** The resource is a result of the frame and is never culled */
+		void mark_output(handle h)
+		{
+			get(h);
+			resources_[h].output = true;
+			compiled_ = false;
+		}
+
+		/** Adds a pass; passes are executed in the order in which they are added */
+		pass_builder add_pass(const std::string& name, execute_function execute)
+		{
+			pass p;
+			p.name = name;
+			p.execute = execute;
+			p.keep = false;
+			p.culled = false;
+			p.num_used_writes = 0;
+			p.barriers = 0;
+			passes_.push_back(p);
+			compiled_ = false;
+			return pass_builder{this, passes_.size() - 1};
+		}
+
+		std::size_t num_passes() const
+		{ return passes_.size(); }
+
+		/** True if the pass is not executed because its results are not used */
+		bool is_culled(std::size_t pass_index)
+		{
+			compile();
+			return passes_[pass_index].culled;
+		}
+
+		/** Memory barrier bits issued before a pass */
+		GLbitfield barriers(std::size_t pass_index)
+		{
+			compile();
+			return passes_[pass_index].barriers;
+		}
+
+		std::size_t num_culled_passes()
+		{
+			compile();
+			std::size_t n = 0;
+			for(const pass& p : passes_) {
+				n += p.culled ? 1 : 0;
+			}
+			return n;
+		}
+
+		/** Culls unused passes and computes resource lifetimes and barriers */
+		void compile()
+		{
+			if(compiled_) {
+				return;
+			}
+			for(resource& r : resources_) {
+				r.writers.clear();
+				r.num_readers = 0;
+				r.first_use = -1;
+				r.last_use = -1;
+			}
+			// reference counts: resources count their readers, passes their used writes
+			for(std::size_t i=0; i<passes_.size(); i++) {
+				pass& p = passes_[i];
+				p.culled = false;
+				p.num_used_writes = p.writes.size();
+				for(const resource_use& u : p.writes) {
+					resources_[u.h].writers.push_back(i);
+				}
+				for(const resource_use& u : p.reads) {
+					if(!writes(p, u.h)) {
+						resources_[u.h].num_readers++;
+					}
+				}
+			}
+			std::vector<handle> unused;
+			for(handle h=0; h<resources_.size(); h++) {
+				const resource& r = resources_[h];
+				if(r.num_readers == 0 && !r.imported && !r.output) {
+					unused.push_back(h);
+				}
+			}
+			for(std::size_t i=0; i<passes_.size(); i++) {
+				if(passes_[i].writes.empty() && !passes_[i].keep) {
+					cull(i, unused);
+				}
+			}
+			while(!unused.empty()) {
+				handle h = unused.back();
+				unused.pop_back();
+				for(std::size_t i : resources_[h].writers) {
+					pass& p = passes_[i];
+					if(p.culled || p.keep) {
+						continue;
+					}
+					p.num_used_writes--;
+					if(p.num_used_writes == 0) {
+						cull(i, unused);
+					}
+				}
+			}
+			// lifetimes and barriers of the remaining passes
+			// barrier bits which image stores into a resource still need before each kind of access
+			const GLbitfield all_bits = GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT;
+			std::vector<GLbitfield> pending(resources_.size(), 0);
+			for(std::size_t i=0; i<passes_.size(); i++) {
+				pass& p = passes_[i];
+				p.barriers = 0;
+				if(p.culled) {
+					continue;
+				}
+				for(const resource_use& u : p.reads) {
+					use(u.h, i);
+					p.barriers |= pending[u.h] & barrier_bits(u.a);
+				}
+				for(const resource_use& u : p.writes) {
+					use(u.h, i);
+					p.barriers |= pending[u.h] & barrier_bits(u.a);
+				}
+				// glMemoryBarrier covers the stores into all resources
+				for(GLbitfield& b : pending) {
+					b &= ~p.barriers;
+				}
+				for(const resource_use& u : p.writes) {
+					pending[u.h] = (u.a == access::image_write) ? all_bits : 0;
+				}
+			}
+			compiled_ = true;
+		}
+
+		/** Executes all passes which are not culled */
+		void execute()
+		{
+			compile();
+			for(std::size_t i=0; i<passes_.size(); i++) {
+				pass& p = passes_[i];
+				if(p.culled) {
+					continue;
+				}
+				for(resource& r : resources_) {
+					if(!r.imported && r.first_use == int(i)) {
+						if(r.samples == 0) {
+							r.texture = pool_.acquire(r.width, r.height, r.internalformat);
+						}
+						else {
+							r.multisample_texture = pool_.acquire_multisample(r.width, r.height, r.internalformat, r.samples);
+						}
+					}
+				}
+				if(p.barriers != 0) {
+					glMemoryBarrier(p.barriers);
+				}
+				bind_attachments(p);
+				p.execute(context{this, i});
+				for(resource& r : resources_) {
+					if(!r.imported && !r.output && r.last_use == int(i)) {
+						pool_.release(r.texture);
+						pool_.release(r.multisample_texture);
+						r.texture = texture_2d(0);
+						r.multisample_texture = texture_2d_multisample(0);
+					}
+				}
+			}
+		}
+
+		/** Transient outputs stay available after execute() until clear() */
+		texture_2d texture(handle h) const
+		{ return get(h).texture; }
+
+		texture_2d_multisample multisample_texture(handle h) const
+		{ return get(h).multisample_texture; }
+
+		/** Removes all passes and resources, e.g. to build the graph of the next frame */
+		void clear()
+		{
+			for(resource& r : resources_) {
+				if(!r.imported) {
+					pool_.release(r.texture);
+					pool_.release(r.multisample_texture);
+				}
+			}
+			resources_.clear();
+			passes_.clear();
+			compiled_ = false;
+		}
+
+	private:
+		static resource make_resource(const std::string& name, unsigned w, unsigned h)
+		{
+			resource r{name, w, h, 0, 0, false, false, false, 0,
+				texture_2d(0), texture_2d_multisample(0), {}, 0, -1, -1};
+			return r;
+		}
+
+		const resource& get(handle h) const
+		{
+			if(h >= resources_.size()) {
+				throw exception("pastry: invalid frame graph resource handle");
+			}
+			return resources_[h];
+		}
+
+		static bool writes(const pass& p, handle h)
+		{
+			for(const resource_use& u : p.writes) {
+				if(u.h == h) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		/** Culls a pass and releases its reads */
+		void cull(std::size_t i, std::vector<handle>& unused)
+		{
+			pass& p = passes_[i];
+			p.culled = true;
+			for(const resource_use& u : p.reads) {
+				if(writes(p, u.h)) {
+					continue;
+				}
+				resource& r = resources_[u.h];
+				r.num_readers--;
+				if(r.num_readers == 0 && !r.imported && !r.output) {
+					unused.push_back(u.h);
+				}
+			}
+		}
+
+		void use(handle h, std::size_t i)
+		{
+			resource& r = resources_[h];
+			if(r.first_use == -1) {
+				r.first_use = i;
+			}
+			r.last_use = i;
+		}
+
+		/** Barrier which makes image stores visible to an access */
+		static GLbitfield barrier_bits(access a)
+		{
+			switch(a) {
+				case access::sample: return GL_TEXTURE_FETCH_BARRIER_BIT;
+				case access::attachment: return GL_FRAMEBUFFER_BARRIER_BIT;
+				default: return GL_SHADER_IMAGE_ACCESS_BARRIER_BIT;
+			}
+		}
+
+		static bool is_depth_format(GLint internalformat)
+		{
+			GLenum format = detail::get_texture_format_info(internalformat).format;
+			return format == GL_DEPTH_COMPONENT || format == GL_DEPTH_STENCIL;
+		}
+
+		/** Binds the framebuffer with all attachments written by a pass */
+		void bind_attachments(const pass& p)
+		{
+			std::vector<const resource*> colors;
+			const resource* depth = nullptr;
+			const resource* imported = nullptr;
+			for(const resource_use& u : p.writes) {
+				if(u.a != access::attachment) {
+					continue;
+				}
+				const resource& r = resources_[u.h];
+				if(r.is_framebuffer) {
+					imported = &r;
+				}
+				else if(is_depth_format(r.internalformat)) {
+					depth = &r;
+				}
+				else {
+					colors.push_back(&r);
+				}
+			}
+			if(imported) {
+				if(depth || !colors.empty()) {
+					throw exception("pastry: pass '" + p.name + "' writes to an imported framebuffer and to textures");
+				}
+				glBindFramebuffer(GL_FRAMEBUFFER, imported->framebuffer_id);
+				glViewport(0, 0, imported->width, imported->height);
+				return;
+			}
+			const resource* first = colors.empty() ? depth : colors.front();
+			if(!first) {
+				return;
+			}
+			framebuffer fbo = (first->samples == 0)
+				? pool_.get_framebuffer(textures(colors), depth ? &depth->texture : nullptr)
+				: pool_.get_framebuffer(multisample_textures(colors), depth ? &depth->multisample_texture : nullptr);
+			fbo.bind();
+			glViewport(0, 0, first->width, first->height);
+		}
+
+		static std::vector<texture_2d> textures(const std::vector<const resource*>& list)
+		{
+			std::vector<texture_2d> v;
+			for(const resource* r : list) {
+				v.push_back(r->texture);
+			}
+			return v;
+		}
+
+		static std::vector<texture_2d_multisample> multisample_textures(const std::vector<const resource*>& list)
+		{
+			std::vector<texture_2d_multisample> v;
+			for(const resource* r : list) {
+				v.push_back(r->multisample_texture);
+			}
+			return v;
+		}
+	};
+
+}}
+#endif
@@ -0,0 +1,380 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_GEOMETRY_HEAP_HPP
+#define INCLUDED_PASTRY_PASTRYGL_GEOMETRY_HEAP_HPP
+
+#include "gl.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	namespace detail
+	{
+		/** Best fit allocator of ranges in [0, capacity) which merges neighbouring free ranges */
+		struct range_allocator
+		{
+		private:
+			std::size_t capacity_;
+			std::size_t num_free_;
+			std::map<std::size_t, std::size_t> free_by_offset_; // offset -> size
+			std::multimap<std::size_t, std::size_t> free_by_size_; // size -> offset
+
+		public:
+			range_allocator(std::size_t capacity=0)
+			: capacity_(0), num_free_(0)
+			{ grow(capacity); }
+
+			std::size_t capacity() const
+			{ return capacity_; }
+
+			std::size_t num_free() const
+			{ return num_free_; }
+
+			std::size_t largest_free() const
+			{ return free_by_size_.empty() ? 0 : free_by_size_.rbegin()->first; }
+
+			/** Returns false if there is no free range of size n */
+			bool allocate(std::size_t n, std::size_t& offset)
+			{
+				if(n == 0) {
+					offset = 0;
+					return true;
+				}
+				auto it = free_by_size_.lower_bound(n);
+				if(it == free_by_size_.end()) {
+					return false;
+				}
+				std::size_t size = it->first;
+				offset = it->second;
+				free_by_size_.erase(it);
+				free_by_offset_.erase(offset);
+				if(size > n) {
+					insert(offset + n, size - n);
+				}
+				num_free_ -= n;
+				return true;
+			}
+
+			void free(std::size_t offset, std::size_t n)
+			{
+				if(n == 0) {
+					return;
+				}
+				num_free_ += n;
+				auto next = free_by_offset_.lower_bound(offset);
+				if(next != free_by_offset_.end() && offset + n == next->first) {
+					n += next->second;
+					erase(next);
+				}
+				auto prev = free_by_offset_.lower_bound(offset);
+				if(prev != free_by_offset_.begin()) {
+					--prev;
+					if(prev->first + prev->second == offset) {
+						offset = prev->first;
+						n += prev->second;
+						erase(prev);
+					}
+				}
+				insert(offset, n);
+			}
+
+			/** Adds [capacity, new_capacity) as free space */
+			void grow(std::size_t new_capacity)
+			{
+				if(new_capacity <= capacity_) {
+					return;
+				}
+				std::size_t old = capacity_;
+				capacity_ = new_capacity;
+				free(old, new_capacity - old);
+			}
+
+			/** Marks [0, used) as allocated and the rest as free, e.g. after compaction */
+			void reset(std::size_t used)
+			{
+				free_by_offset_.clear();
+				free_by_size_.clear();
+				num_free_ = 0;
+				free(used, capacity_ - used);
+			}
+
+		private:
+			void insert(std::size_t offset, std::size_t n)
+			{
+				free_by_offset_[offset] = n;
+				free_by_size_.insert({n, offset});
+			}
+
+			void erase(std::map<std::size_t, std::size_t>::iterator it)
+			{
+				auto range = free_by_size_.equal_range(it->second);
+				for(auto s=range.first; s!=range.second; ++s) {
+					if(s->second == it->first) {
+						free_by_size_.erase(s);
+						break;
+					}
+				}
+				free_by_offset_.erase(it);
+			}
+		};
+	}
+
+	/** Stores the vertices and indices of many meshes in one vertex and one index buffer
+	 * All meshes share the vertex layout and the primitive mode; indices are 32 bit and
+	 * relative to the first vertex of their mesh. Meshes are referenced by ids which stay
+	 * valid when the heap grows or is defragmented. The buffer objects never change, so
+	 * a vertex_array created once for vertex_buffer() stays valid.
+	 * Usage example:
+	 *   pastry::geometry_heap heap({{"position", GL_FLOAT, 3}, {"normal", GL_FLOAT, 3}});
+	 *   auto rock = heap.add(rock_vertices, rock_indices);
+	 *   pastry::vertex_array va(program, {{"position", heap.vertex_buffer()}, {"normal", heap.vertex_buffer()}});
+	 *   va.bind();
+	 *   heap.draw(rock);
+	 *   heap.draw(visible_ids); // one glMultiDrawElementsBaseVertex
+	 */
+	struct geometry_heap
+	{
+	public:
+		typedef std::size_t mesh_id;
+
+		/** Location of a mesh in the buffers, in vertices and indices */
+		struct range
+		{
+			std::size_t vertex_offset, num_vertices;
+			std::size_t index_offset, num_indices;
+			bool used;
+		};
+
+	private:
+		GLenum mode_;
+		std::size_t vertex_size_;
+		array_buffer vertices_;
+		element_array_buffer indices_;
+		detail::range_allocator vertex_alloc_;
+		detail::range_allocator index_alloc_;
+		std::vector<range> meshes_;
+		std::vector<mesh_id> free_ids_;
+
+	public:
+		geometry_heap(const std::vector<detail::layout_item>& layout, GLenum mode=GL_TRIANGLES,
+			std::size_t vertex_capacity=1<<16, std::size_t index_capacity=1<<18)
+		: mode_(mode), vertex_size_(detail::va_bytes_total(layout)),
+		  vertex_alloc_(vertex_capacity), index_alloc_(index_capacity)
+		{
+			vertices_.set_layout(layout);
+			vertices_.init_data(vertex_capacity*vertex_size_, GL_STATIC_DRAW);
+			indices_.init_data(index_capacity*sizeof(uint32_t), GL_STATIC_DRAW);
+		}
+
+		const array_buffer& vertex_buffer() const
+		{ return vertices_; }
+
+		const element_array_buffer& index_buffer() const
+		{ return indices_; }
+
+		/** Adds a mesh; without indices it is drawn with glDrawArrays */
+		mesh_id add(const void* vertices, std::size_t num_vertices, const uint32_t* indices=nullptr, std::size_t num_indices=0)
+		{
+			range r{0, num_vertices, 0, num_indices, true};
+			reserve(vertex_alloc_, vertices_, vertex_size_, num_vertices, r.vertex_offset);
+			reserve(index_alloc_, indices_, sizeof(uint32_t), num_indices, r.index_offset);
+			if(num_vertices > 0) {
+				vertices_.set_sub_data(r.vertex_offset*vertex_size_, vertices, num_vertices*vertex_size_);
+			}
+			if(num_indices > 0) {
+				indices_.set_sub_data(r.index_offset*sizeof(uint32_t), indices, num_indices*sizeof(uint32_t));
+			}
+			if(free_ids_.empty()) {
+				meshes_.push_back(r);
+				return meshes_.size() - 1;
+			}
+			mesh_id id = free_ids_.back();
+			free_ids_.pop_back();
+			meshes_[id] = r;
+			return id;
+		}
+
+		template<typename V>
+		mesh_id add(const std::vector<V>& vertices, const std::vector<uint32_t>& indices=std::vector<uint32_t>())
+		{
+			if(sizeof(V) != vertex_size_) {
+				throw exception("pastry: vertex size does not match the layout of the geometry heap");
+			}
+			return add(vertices.data(), vertices.size(), indices.data(), indices.size());
+		}
+
+		void remove(mesh_id id)
+		{
+			range& r = get(id);
+			vertex_alloc_.free(r.vertex_offset, r.num_vertices);
+			index_alloc_.free(r.index_offset, r.num_indices);
+			r.used = false;
+			free_ids_.push_back(id);
+		}
+
+		const range& get_range(mesh_id id) const
+		{
+			if(id >= meshes_.size() || !meshes_[id].used) {
+				throw exception("pastry: invalid geometry heap mesh id");
+			}
+			return meshes_[id];
+		}
+
+		std::size_t num_meshes() const
+		{ return meshes_.size() - free_ids_.size(); }
+
+		std::size_t vertex_capacity() const
+		{ return vertex_alloc_.capacity(); }
+
+		std::size_t index_capacity() const
+		{ return index_alloc_.capacity(); }
+
+		/** Fraction of free vertex and index space which is not in the largest free range */
+		float fragmentation() const
+		{
+			std::size_t free = vertex_alloc_.num_free() + index_alloc_.num_free();
+			std::size_t largest = vertex_alloc_.largest_free() + index_alloc_.largest_free();
+			return free == 0 ? 0.0f : 1.0f - float(largest)/float(free);
+		}
+
+		/** Moves all meshes to the front of the buffers using a temporary copy on the GPU */
+		void defragment()
+		{
+			std::vector<mesh_id> order;
+			for(mesh_id i=0; i<meshes_.size(); i++) {
+				if(meshes_[i].used) {
+					order.push_back(i);
+				}
+			}
+			std::sort(order.begin(), order.end(), [this](mesh_id a, mesh_id b) {
+				return meshes_[a].vertex_offset < meshes_[b].vertex_offset;
+			});
+			std::size_t num_vertices = vertex_alloc_.capacity() - vertex_alloc_.num_free();
+			std::size_t num_indices = index_alloc_.capacity() - index_alloc_.num_free();
+			array_buffer vtmp;
+			vtmp.init_data(std::max<std::size_t>(1, num_vertices)*vertex_size_, GL_STREAM_COPY);
+			element_array_buffer itmp;
+			itmp.init_data(std::max<std::size_t>(1, num_indices)*sizeof(uint32_t), GL_STREAM_COPY);
+			std::size_t v = 0, i = 0;
+			for(mesh_id id : order) {
+				range& r = meshes_[id];
+				if(r.num_vertices > 0) {
+					vtmp.copy_sub_data(vertices_, r.vertex_offset*vertex_size_, v*vertex_size_, r.num_vertices*vertex_size_);
+				}
+				if(r.num_indices > 0) {
+					itmp.copy_sub_data(indices_, r.index_offset*sizeof(uint32_t), i*sizeof(uint32_t), r.num_indices*sizeof(uint32_t));
+				}
+				r.vertex_offset = v;
+				r.index_offset = i;
+				v += r.num_vertices;
+				i += r.num_indices;
+			}
+			if(v > 0) {
+				vertices_.copy_sub_data(vtmp, 0, 0, v*vertex_size_);
+			}
+			if(i > 0) {
+				indices_.copy_sub_data(itmp, 0, 0, i*sizeof(uint32_t));
+			}
+			vertex_alloc_.reset(v);
+			index_alloc_.reset(i);
+		}
+
+		/** Draws one mesh; a vertex_array for vertex_buffer() must be bound */
+		void draw(mesh_id id) const
+		{
+			const range& r = get_range(id);
+			if(r.num_indices == 0) {
+				glDrawArrays(mode_, r.vertex_offset, r.num_vertices);
+			}
+			else {
+				indices_.bind();
+				detail::set_primitive_restart(GL_UNSIGNED_INT, false);
+				glDrawElementsBaseVertex(mode_, r.num_indices, GL_UNSIGNED_INT,
+					reinterpret_cast<const void*>(r.index_offset*sizeof(uint32_t)), r.vertex_offset);
+			}
+		}
+
+		/** Draws many meshes with one call per kind (indexed or not) */
+		void draw(const std::vector<mesh_id>& ids) const
+		{
+			std::vector<GLsizei> counts, array_counts;
+			std::vector<const void*> offsets;
+			std::vector<GLint> base_vertices, firsts;
+			for(mesh_id id : ids) {
+				const range& r = get_range(id);
+				if(r.num_indices == 0) {
+					firsts.push_back(r.vertex_offset);
+					array_counts.push_back(r.num_vertices);
+				}
+				else {
+					counts.push_back(r.num_indices);
+					offsets.push_back(reinterpret_cast<const void*>(r.index_offset*sizeof(uint32_t)));
+					base_vertices.push_back(r.vertex_offset);
+				}
+			}
+			if(!firsts.empty()) {
+				glMultiDrawArrays(mode_, firsts.data(), array_counts.data(), firsts.size());
+			}
+			if(!counts.empty()) {
+				indices_.bind();
+				detail::set_primitive_restart(GL_UNSIGNED_INT, false);
+				glMultiDrawElementsBaseVertex(mode_, counts.data(), GL_UNSIGNED_INT,
+					const_cast<const void* const*>(offsets.data()), counts.size(), base_vertices.data());
+			}
+		}
+
+	private:
+		range& get(mesh_id id)
+		{
+			get_range(id);
+			return meshes_[id];
+		}
+
+		/** Allocates n elements and grows the buffer if there is no space */
+		template<int TARGET>
+		void reserve(detail::range_allocator& alloc, buffer<TARGET>& bo, std::size_t element_size, std::size_t n, std::size_t& offset)
+		{
+			if(alloc.allocate(n, offset)) {
+				return;
+			}
+			std::size_t old_capacity = alloc.capacity();
+			std::size_t new_capacity = std::max(2*old_capacity, old_capacity + n);
+			// the buffer object stays the same so that vertex arrays remain valid
+			buffer<TARGET> tmp;
+			if(old_capacity > 0) {
+				tmp.init_data(old_capacity*element_size, GL_STREAM_COPY);
+				tmp.copy_sub_data(bo, 0, 0, old_capacity*element_size);
+			}
+			bo.init_data(new_capacity*element_size, GL_STATIC_DRAW);
+			if(old_capacity > 0) {
+				bo.copy_sub_data(tmp, 0, 0, old_capacity*element_size);
+			}
+			alloc.grow(new_capacity);
+			alloc.allocate(n, offset);
+		}
+	};
+
+}}
+#endif
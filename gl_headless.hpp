@@ -0,0 +1,273 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_HEADLESS_HPP
+#define INCLUDED_PASTRY_PASTRYGL_HEADLESS_HPP
+
+#include "gl.hpp"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	namespace detail
+	{
+		inline bool has_egl_extension(const char* list, const char* name)
+		{
+			if(!list) {
+				return false;
+			}
+			std::size_t n = std::strlen(name);
+			for(const char* p = std::strstr(list, name); p; p = std::strstr(p + n, name)) {
+				if((p == list || p[-1] == ' ') && (p[n] == ' ' || p[n] == '\0')) {
+					return true;
+				}
+			}
+			return false;
+		}
+	}
+
+	/** OpenGL core context without a window, e.g. for render servers and tests
+	 * Uses the Mesa surfaceless platform if available and the default EGL display
+	 * otherwise, so it also runs with llvmpipe on machines without a GPU. Without
+	 * EGL_KHR_surfaceless_context the context is made current on a pbuffer.
+	 * Rendering goes to a framebuffer with color and depth/stencil renderbuffers which
+	 * is bound after construction like the default framebuffer of a window.
+	 * GLEW is initialized, so pastry objects can be created right away. The shadowed
+	 * pipeline and texture unit state of pastry is invalidated whenever the context is
+	 * made current, since it may belong to another context used on the same thread.
+	 * Usage example:
+	 *   pastry::headless_context ctx(640, 480);
+	 *   // ... render
+	 *   std::vector<unsigned char> rgba = ctx.read_pixels();
+	 */
+	struct headless_context
+	{
+	private:
+		struct targets
+		{
+			renderbuffer color, depth;
+			framebuffer fbo;
+			renderbuffer resolved_color;
+			framebuffer resolved;
+		};
+
+		EGLDisplay display_;
+		EGLContext context_;
+		EGLSurface surface_;
+		unsigned width_, height_, samples_;
+		std::unique_ptr<targets> targets_;
+
+	public:
+		/** samples: number of samples of the color and depth buffers (0: no multisampling) */
+		headless_context(unsigned w, unsigned h, int major=3, int minor=3, unsigned samples=0)
+		: display_(EGL_NO_DISPLAY), context_(EGL_NO_CONTEXT), surface_(EGL_NO_SURFACE),
+		  width_(w), height_(h), samples_(samples)
+		{
+			// releases the context and surface if a later step throws
+			struct cleanup_guard
+			{
+				headless_context* self;
+				~cleanup_guard() { if(self) self->destroy(); }
+			} cleanup{this};
+			display_ = open_display();
+			if(display_ == EGL_NO_DISPLAY || !eglInitialize(display_, nullptr, nullptr)) {
+				throw exception("pastry: could not initialize an EGL display");
+			}
+			bool surfaceless = detail::has_egl_extension(eglQueryString(display_, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context");
+			EGLConfig config;
+			EGLint num_configs = 0;
+			const EGLint config_attribs[] = {
+				EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+				EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+				EGL_NONE
+			};
+			if(!eglChooseConfig(display_, config_attribs, &config, 1, &num_configs) || num_configs == 0) {
+				throw exception("pastry: no EGL config for desktop OpenGL");
+			}
+			if(!eglBindAPI(EGL_OPENGL_API)) {
+				throw exception("pastry: EGL does not support desktop OpenGL");
+			}
+			const EGLint context_attribs[] = {
+				EGL_CONTEXT_MAJOR_VERSION, major,
+				EGL_CONTEXT_MINOR_VERSION, minor,
+				EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+				EGL_NONE
+			};
+			context_ = eglCreateContext(display_, config, EGL_NO_CONTEXT, context_attribs);
+			if(context_ == EGL_NO_CONTEXT) {
+				throw exception("pastry: could not create an OpenGL " + std::to_string(major) + "." + std::to_string(minor) + " core context");
+			}
+			if(!surfaceless) {
+				const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+				surface_ = eglCreatePbufferSurface(display_, config, pbuffer_attribs);
+			}
+			make_current();
+			glewExperimental = GL_TRUE;
+			GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+			// GLEW built for GLX loads all OpenGL functions but fails to find a GLX display
+			if(err == GLEW_ERROR_NO_GLX_DISPLAY) err = GLEW_OK;
+#endif
+			if(err != GLEW_OK) {
+				throw exception(std::string("pastry: could not initialize GLEW: ") + reinterpret_cast<const char*>(glewGetErrorString(err)));
+			}
+			glGetError(); // glewInit may leave GL_INVALID_ENUM
+			resize(w, h);
+			cleanup.self = nullptr;
+		}
+
+		headless_context(const headless_context&) = delete;
+		headless_context& operator=(const headless_context&) = delete;
+
+		~headless_context()
+		{ destroy(); }
+
+		EGLDisplay display() const
+		{ return display_; }
+
+		EGLContext context() const
+		{ return context_; }
+
+		unsigned width() const
+		{ return width_; }
+
+		unsigned height() const
+		{ return height_; }
+
+		unsigned samples() const
+		{ return samples_; }
+
+		void make_current() const
+		{
+			eglBindAPI(EGL_OPENGL_API);
+			if(!eglMakeCurrent(display_, surface_, surface_, context_)) {
+				throw exception("pastry: could not make the headless context current");
+			}
+			invalidate_pipeline_state();
+			detail::texture_units().invalidate();
+		}
+
+		/** The framebuffer which replaces the default framebuffer */
+		const framebuffer& get_framebuffer() const
+		{ return targets_->fbo; }
+
+		/** Binds the framebuffer and sets the viewport to its size */
+		void bind() const
+		{
+			targets_->fbo.bind();
+			glViewport(0, 0, width_, height_);
+		}
+
+		/** Recreates the render targets with a new size and binds them */
+		void resize(unsigned w, unsigned h)
+		{
+			width_ = w;
+			height_ = h;
+			targets_.reset(new targets());
+			create_target(targets_->fbo, targets_->color, &targets_->depth, samples_);
+			if(samples_ > 0) {
+				create_target(targets_->resolved, targets_->resolved_color, nullptr, 0);
+			}
+			bind();
+		}
+
+		/** Reads the rendered image as RGBA8 with the top row first, resolving multisampling */
+		std::vector<unsigned char> read_pixels() const
+		{
+			const framebuffer& src = (samples_ > 0) ? targets_->resolved : targets_->fbo;
+			if(samples_ > 0) {
+				targets_->fbo.resolve(targets_->resolved, width_, height_);
+			}
+			std::vector<unsigned char> rgba(4*width_*height_);
+			GLint previous;
+			glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &previous);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, src.id());
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glReadPixels(0, 0, width_, height_, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
+			// OpenGL stores the bottom row first
+			std::size_t pitch = 4*width_;
+			for(unsigned y=0; y<height_/2; y++) {
+				std::swap_ranges(rgba.begin() + y*pitch, rgba.begin() + (y + 1)*pitch, rgba.begin() + (height_ - 1 - y)*pitch);
+			}
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, previous);
+			return rgba;
+		}
+
+	private:
+		void destroy()
+		{
+			if(context_ == EGL_NO_CONTEXT) {
+				return;
+			}
+			if(targets_) {
+				eglBindAPI(EGL_OPENGL_API);
+				eglMakeCurrent(display_, surface_, surface_, context_);
+				targets_.reset();
+			}
+			eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			if(surface_ != EGL_NO_SURFACE) {
+				eglDestroySurface(display_, surface_);
+			}
+			eglDestroyContext(display_, context_);
+			context_ = EGL_NO_CONTEXT;
+		}
+
+		static EGLDisplay open_display()
+		{
+#if defined(EGL_EXT_platform_base) && defined(EGL_PLATFORM_SURFACELESS_MESA)
+			const char* client = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+			if(detail::has_egl_extension(client, "EGL_MESA_platform_surfaceless")) {
+				auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+				if(get_platform_display) {
+					EGLDisplay d = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+					if(d != EGL_NO_DISPLAY) {
+						return d;
+					}
+				}
+			}
+#endif
+			return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		}
+
+		void create_target(framebuffer& fbo, renderbuffer& color, renderbuffer* depth, unsigned samples)
+		{
+			fbo.bind();
+			color.bind();
+			color.storage(GL_RGBA8, width_, height_, samples);
+			fbo.attach(GL_COLOR_ATTACHMENT0, color);
+			if(depth) {
+				depth->bind();
+				depth->storage(GL_DEPTH24_STENCIL8, width_, height_, samples);
+				fbo.attach(GL_DEPTH_STENCIL_ATTACHMENT, *depth);
+			}
+			if(!fbo.is_complete()) {
+				throw exception("pastry: incomplete framebuffer for the headless context");
+			}
+		}
+	};
+
+}}
+#endif
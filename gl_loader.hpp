@@ -0,0 +1,454 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_LOADER_HPP
+#define INCLUDED_PASTRY_PASTRYGL_LOADER_HPP
+
+#include "gl.hpp"
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	namespace detail
+	{
+		struct load_job
+		{
+			/** Runs on a worker thread with a shared context current */
+			std::function<void()> create;
+
+			/** Runs on the render thread once the fence has been signaled */
+			std::function<void()> finish;
+
+			/** Runs on the render thread instead of finish if create has thrown */
+			std::function<void(std::exception_ptr)> fail;
+
+			std::exception_ptr error;
+
+			fence sync = nullptr;
+		};
+
+		template<typename T>
+		struct load_state
+		{
+			std::unique_ptr<T> value;
+			std::exception_ptr error;
+			bool ready = false;
+		};
+	}
+
+	/** Handle to a resource which is created by a loader
+	 * The resource may only be used after ready() returns true. If creating it has
+	 * thrown, ready() returns true as well and get() rethrows the exception.
+	 */
+	template<typename T>
+	struct async_resource
+	{
+	private:
+		std::shared_ptr<detail::load_state<T>> state_;
+
+	public:
+		async_resource()
+		{}
+
+		async_resource(const std::shared_ptr<detail::load_state<T>>& state)
+		: state_(state) {}
+
+		bool valid() const
+		{ return static_cast<bool>(state_); }
+
+		bool ready() const
+		{ return state_ && state_->ready; }
+
+		bool failed() const
+		{ return state_ && state_->ready && state_->error; }
+
+		T& get() const
+		{
+			if(state_->error) {
+				std::rethrow_exception(state_->error);
+			}
+			return *state_->value;
+		}
+	};
+
+	/** Creates buffers, textures and programs on worker threads
+	 * Every worker thread owns an OpenGL context which shares its objects with the
+	 * context of the render thread. attach(i) is called on worker i before the first
+	 * job and must make such a context current, detach(i) is called before the thread
+	 * terminates. Finished resources are guarded by a fence and handed to the render
+	 * thread in poll().
+	 * Only objects which are shared between contexts may be created in a job, i.e.
+	 * no vertex_array or framebuffer.
+	 * An exception thrown by a job is rethrown by async_resource::get() for load()
+	 * and by poll() or finish() for run_async(). If attach(i) throws, every job which
+	 * runs on worker i fails with that exception.
+	 * Usage example:
+	 *   pastry::loader ld(2, attach, detach);
+	 *   auto tex = ld.load<pastry::texture_2d>([]() {
+	 *       return pastry::texture_2d::create_normal<unsigned char,4>(GL_RGBA8, w, h, pixels);
+	 *   });
+	 *   // every frame on the render thread
+	 *   ld.poll();
+	 *   if(tex.ready()) { tex.get().bind(); }
+	 */
+	struct loader
+	{
+	private:
+		std::vector<std::thread> workers_;
+
+		std::mutex mutex_;
+		std::condition_variable cv_queued_;
+		std::condition_variable cv_done_;
+		std::deque<detail::load_job> queued_;
+		std::deque<detail::load_job> done_;
+		std::size_t num_running_ = 0;
+		bool stop_ = false;
+
+		std::vector<detail::load_job> pending_;
+
+	public:
+		/** Must be called on the render thread with its context current */
+		loader(unsigned num_threads, std::function<void(unsigned)> attach, std::function<void(unsigned)> detach)
+		{
+			// decide on direct state access before workers create objects
+			detail::dsa();
+			for(unsigned i=0; i<num_threads; i++) {
+				workers_.emplace_back([this,i,attach,detach]() {
+					std::exception_ptr attach_error;
+					try {
+						if(attach) attach(i);
+					}
+					catch(...) {
+						attach_error = std::current_exception();
+					}
+					run(attach_error);
+					if(detach && !attach_error) detach(i);
+				});
+			}
+		}
+
+		loader(const loader&) = delete;
+		loader& operator=(const loader&) = delete;
+
+		/** Stops all workers; queued jobs which have not been started are dropped */
+		~loader()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stop_ = true;
+				queued_.clear();
+			}
+			cv_queued_.notify_all();
+			for(std::thread& t : workers_) {
+				t.join();
+			}
+		}
+
+		/** Queues a job which creates a resource
+		 * f is called on a worker thread and must return the resource.
+		 * on_ready is called on the render thread in poll() after the resource is ready.
+		 */
+		template<typename T, typename F>
+		async_resource<T> load(F f, std::function<void(T&)> on_ready=std::function<void(T&)>())
+		{
+			auto state = std::make_shared<detail::load_state<T>>();
+			detail::load_job job;
+			job.create = [state,f]() {
+				state->value.reset(new T(f()));
+			};
+			job.finish = [state,on_ready]() {
+				state->ready = true;
+				if(on_ready) on_ready(*state->value);
+			};
+			job.fail = [state](std::exception_ptr e) {
+				state->error = e;
+				state->ready = true;
+			};
+			enqueue(std::move(job));
+			return async_resource<T>{state};
+		}
+
+		/** Queues a job without a result, e.g. to update an existing buffer */
+		void run_async(std::function<void()> f, std::function<void()> on_ready=std::function<void()>())
+		{
+			detail::load_job job;
+			job.create = f;
+			job.finish = on_ready;
+			enqueue(std::move(job));
+		}
+
+		/** Hands over all resources whose fence has been signaled
+		 * Must be called on the render thread. Never blocks on the GPU.
+		 * Rethrows the first exception of a run_async() job after all ready jobs are handed over.
+		 */
+		void poll()
+		{
+			collect();
+			std::exception_ptr error;
+			auto it = pending_.begin();
+			while(it != pending_.end()) {
+				if(!it->sync.signaled()) {
+					++it;
+					continue;
+				}
+				hand_over(*it, error);
+				it = pending_.erase(it);
+			}
+			if(error) {
+				std::rethrow_exception(error);
+			}
+		}
+
+		/** Blocks until all queued jobs have been handed over */
+		void finish()
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cv_done_.wait(lock, [this]() { return queued_.empty() && num_running_ == 0; });
+			}
+			collect();
+			std::exception_ptr error;
+			for(detail::load_job& job : pending_) {
+				job.sync.wait();
+				hand_over(job, error);
+			}
+			pending_.clear();
+			if(error) {
+				std::rethrow_exception(error);
+			}
+		}
+
+		/** Number of jobs which have not yet been handed over */
+		std::size_t num_pending()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return queued_.size() + num_running_ + done_.size() + pending_.size();
+		}
+
+	private:
+		static void hand_over(detail::load_job& job, std::exception_ptr& error)
+		{
+			if(!job.error) {
+				if(job.finish) job.finish();
+			}
+			else if(job.fail) {
+				job.fail(job.error);
+			}
+			else if(!error) {
+				error = job.error;
+			}
+		}
+
+		void enqueue(detail::load_job job)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				queued_.push_back(std::move(job));
+			}
+			cv_queued_.notify_one();
+		}
+
+		void collect()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for(detail::load_job& job : done_) {
+				pending_.push_back(std::move(job));
+			}
+			done_.clear();
+		}
+
+		/** attach_error: set if the worker has no context; all jobs fail with it */
+		void run(std::exception_ptr attach_error)
+		{
+			while(true) {
+				detail::load_job job;
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					cv_queued_.wait(lock, [this]() { return stop_ || !queued_.empty(); });
+					if(stop_) {
+						return;
+					}
+					job = std::move(queued_.front());
+					queued_.pop_front();
+					num_running_ ++;
+				}
+				if(attach_error) {
+					job.error = attach_error;
+				}
+				else {
+					try {
+						if(job.create) job.create();
+					}
+					catch(...) {
+						job.error = std::current_exception();
+					}
+					job.sync = fence();
+					// the fence must reach the GPU before the render thread waits on it
+					glFlush();
+				}
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					done_.push_back(std::move(job));
+					num_running_ --;
+				}
+				cv_done_.notify_all();
+			}
+		}
+	};
+
+#ifdef EGL_VERSION_1_4
+	/** Worker contexts for a loader which share objects with an existing EGL context
+	 * Include <EGL/egl.h> before this header to enable. Workers use surfaceless
+	 * contexts if EGL_KHR_surfaceless_context is supported and 1x1 pbuffers otherwise.
+	 * Without context_attribs the workers get the version, profile and debug flag of
+	 * share, which must be current on the calling thread then.
+	 * Usage example:
+	 *   pastry::egl_worker_contexts ctx(display, config, eglGetCurrentContext(), 2);
+	 *   pastry::loader ld(2, ctx.attach(), ctx.detach());
+	 */
+	struct egl_worker_contexts
+	{
+	private:
+		EGLDisplay display_;
+		std::vector<EGLContext> contexts_;
+		std::vector<EGLSurface> surfaces_;
+
+	public:
+		egl_worker_contexts(EGLDisplay display, EGLConfig config, EGLContext share, unsigned num, const EGLint* context_attribs=nullptr)
+		: display_(display)
+		{
+			// releases the contexts and surfaces created so far if a later step throws
+			struct cleanup_guard
+			{
+				egl_worker_contexts* self;
+				~cleanup_guard() { if(self) self->destroy(); }
+			} cleanup{this};
+			std::vector<EGLint> attribs;
+			if(!context_attribs) {
+				attribs = attribs_of_current(share);
+				context_attribs = attribs.data();
+			}
+			const char* ext = eglQueryString(display, EGL_EXTENSIONS);
+			bool surfaceless = ext && std::string(ext).find("EGL_KHR_surfaceless_context") != std::string::npos;
+			eglBindAPI(EGL_OPENGL_API);
+			for(unsigned i=0; i<num; i++) {
+				EGLContext ctx = eglCreateContext(display, config, share, context_attribs);
+				if(ctx == EGL_NO_CONTEXT) {
+					throw exception("pastry: could not create shared EGL context");
+				}
+				contexts_.push_back(ctx);
+				surfaces_.push_back(EGL_NO_SURFACE);
+				if(!surfaceless) {
+					const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+					surfaces_.back() = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+					if(surfaces_.back() == EGL_NO_SURFACE) {
+						throw exception("pastry: could not create EGL pbuffer for a worker context");
+					}
+				}
+			}
+			cleanup.self = nullptr;
+		}
+
+		egl_worker_contexts(const egl_worker_contexts&) = delete;
+		egl_worker_contexts& operator=(const egl_worker_contexts&) = delete;
+
+		/** The loader using these contexts must be destroyed first */
+		~egl_worker_contexts()
+		{
+			destroy();
+		}
+
+		/** Throws if the context can not be made current; the loader then fails all jobs of that worker */
+		std::function<void(unsigned)> attach()
+		{
+			return [this](unsigned i) {
+				eglBindAPI(EGL_OPENGL_API);
+				if(!eglMakeCurrent(display_, surfaces_[i], surfaces_[i], contexts_[i])) {
+					throw exception("pastry: could not make a worker EGL context current");
+				}
+			};
+		}
+
+		std::function<void(unsigned)> detach()
+		{
+			return [this](unsigned) {
+				eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			};
+		}
+
+	private:
+		void destroy()
+		{
+			for(std::size_t i=0; i<contexts_.size(); i++) {
+				if(surfaces_[i] != EGL_NO_SURFACE) {
+					eglDestroySurface(display_, surfaces_[i]);
+				}
+				eglDestroyContext(display_, contexts_[i]);
+			}
+			contexts_.clear();
+			surfaces_.clear();
+		}
+
+		/** Context attributes which recreate the current context */
+		static std::vector<EGLint> attribs_of_current(EGLContext share)
+		{
+			if(share == EGL_NO_CONTEXT || eglGetCurrentContext() != share) {
+				throw exception("pastry: the shared EGL context must be current or context attributes must be given");
+			}
+			std::vector<EGLint> attribs;
+#ifdef EGL_KHR_create_context
+			GLint major = 0, minor = 0, flags = 0, profile = 0;
+			glGetIntegerv(GL_MAJOR_VERSION, &major);
+			glGetIntegerv(GL_MINOR_VERSION, &minor);
+			if(major >= 3) {
+				glGetIntegerv(GL_CONTEXT_FLAGS, &flags);
+			}
+			if(major > 3 || (major == 3 && minor >= 2)) {
+				glGetIntegerv(GL_CONTEXT_PROFILE_MASK, &profile);
+			}
+			attribs.insert(attribs.end(), {
+				EGL_CONTEXT_MAJOR_VERSION_KHR, major,
+				EGL_CONTEXT_MINOR_VERSION_KHR, minor
+			});
+			if(profile & GL_CONTEXT_CORE_PROFILE_BIT) {
+				attribs.insert(attribs.end(), { EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR });
+			}
+			else if(profile & GL_CONTEXT_COMPATIBILITY_PROFILE_BIT) {
+				attribs.insert(attribs.end(), { EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT_KHR });
+			}
+			if(flags & GL_CONTEXT_FLAG_DEBUG_BIT) {
+				attribs.insert(attribs.end(), { EGL_CONTEXT_FLAGS_KHR, EGL_CONTEXT_OPENGL_DEBUG_BIT_KHR });
+			}
+#endif
+			attribs.push_back(EGL_NONE);
+			return attribs;
+		}
+	};
+#endif
+
+}}
+#endif
@@ -0,0 +1,406 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_LOD_HPP
+#define INCLUDED_PASTRY_PASTRYGL_LOD_HPP
+
+#include "gl.hpp"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <string>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	/** Levels of detail of a triangle mesh which all use the same vertices
+	 * The index lists of all levels are stored one after another; level 0 is the
+	 * original mesh. error is an estimate of the largest distance between a level and
+	 * the original surface in object units.
+	 */
+	struct lod_chain
+	{
+		struct level
+		{
+			std::size_t index_offset;
+			std::size_t num_indices;
+			float error;
+		};
+
+		std::vector<uint32_t> indices;
+		std::vector<level> levels;
+
+		/** Coarsest level whose error projects to at most 'max_pixel_error' pixels
+		 * distance: distance from the camera to the object
+		 * pixels_per_unit: scale of a length of one at distance one in pixels, i.e.
+		 *   projection(1,1) * viewport_height / 2 for a perspective projection
+		 */
+		std::size_t select(float distance, float pixels_per_unit, float max_pixel_error=1.0f) const
+		{
+			std::size_t best = 0;
+			for(std::size_t i=0; i<levels.size(); i++) {
+				if(levels[i].error*pixels_per_unit <= max_pixel_error*std::max(distance, 1e-6f)) {
+					best = i;
+				}
+			}
+			return best;
+		}
+	};
+
+	namespace detail
+	{
+		typedef Eigen::Matrix<double,4,4> quadric;
+
+		inline quadric plane_quadric(const Eigen::Vector3d& n, const Eigen::Vector3d& p)
+		{
+			Eigen::Vector4d plane(n.x(), n.y(), n.z(), -n.dot(p));
+			return plane*plane.transpose();
+		}
+
+		inline double quadric_error(const quadric& q, const Eigen::Vector3d& p)
+		{
+			Eigen::Vector4d x(p.x(), p.y(), p.z(), 1.0);
+			return std::max(0.0, x.dot(q*x));
+		}
+
+		/** Quadric error metric simplification by half-edge collapses
+		 * Vertices are only removed, never moved or created, so all levels can share the
+		 * vertex buffer. Border edges are preserved with perpendicular penalty planes and
+		 * collapses which flip a triangle are rejected. A level is emitted each time the
+		 * number of triangles falls to its target.
+		 */
+		struct qem_simplifier
+		{
+		private:
+			struct candidate
+			{
+				double cost;
+				uint32_t from, to;
+				uint32_t version;
+
+				bool operator<(const candidate& c) const
+				{ return cost > c.cost; }
+			};
+
+			std::vector<Eigen::Vector3d> positions_;
+			std::vector<uint32_t> triangles_;
+			std::vector<bool> triangle_alive_;
+			std::vector<std::vector<uint32_t>> vertex_triangles_;
+			std::vector<quadric> quadrics_;
+			std::vector<uint32_t> versions_;
+			std::vector<bool> vertex_alive_;
+			std::priority_queue<candidate> queue_;
+			std::size_t num_triangles_;
+
+		public:
+			qem_simplifier(const std::vector<Eigen::Vector3d>& positions, const std::vector<uint32_t>& triangles)
+			: positions_(positions), triangles_(triangles), triangle_alive_(triangles.size()/3, true),
+			  vertex_triangles_(positions.size()), quadrics_(positions.size(), quadric::Zero()),
+			  versions_(positions.size(), 0), vertex_alive_(positions.size(), true),
+			  num_triangles_(triangles.size()/3)
+			{
+				for(uint32_t i : triangles) {
+					if(i >= positions.size()) {
+						throw exception("pastry: triangle index " + std::to_string(i) + " is out of range for "
+							+ std::to_string(positions.size()) + " vertices");
+					}
+				}
+				for(std::size_t t=0; t<num_triangles_; t++) {
+					const uint32_t* v = &triangles_[3*t];
+					if(v[0] == v[1] || v[1] == v[2] || v[0] == v[2]) {
+						triangle_alive_[t] = false;
+						num_triangles_--;
+						continue;
+					}
+					Eigen::Vector3d n = normal(v[0], v[1], v[2]);
+					quadric q = plane_quadric(n, positions_[v[0]]);
+					for(int k=0; k<3; k++) {
+						quadrics_[v[k]] += q;
+						vertex_triangles_[v[k]].push_back(t);
+					}
+				}
+				add_border_quadrics();
+				for(uint32_t v=0; v<positions_.size(); v++) {
+					push_candidates(v);
+				}
+			}
+
+			std::size_t num_triangles() const
+			{ return num_triangles_; }
+
+			/** Collapses edges until at most 'target' triangles remain or the error would exceed 'max_error'
+			 * Returns the largest error of all collapses so far.
+			 */
+			double simplify(std::size_t target, double max_error, double error_so_far)
+			{
+				while(num_triangles_ > target && !queue_.empty()) {
+					candidate c = queue_.top();
+					queue_.pop();
+					if(!vertex_alive_[c.from] || !vertex_alive_[c.to] || c.version != versions_[c.from] + versions_[c.to]) {
+						continue;
+					}
+					double error = std::sqrt(c.cost);
+					if(error > max_error) {
+						break;
+					}
+					if(!collapse(c.from, c.to)) {
+						continue;
+					}
+					error_so_far = std::max(error_so_far, error);
+				}
+				return error_so_far;
+			}
+
+			/** Index list of all remaining triangles */
+			void append_indices(std::vector<uint32_t>& out) const
+			{
+				for(std::size_t t=0; t<triangle_alive_.size(); t++) {
+					if(triangle_alive_[t]) {
+						out.insert(out.end(), &triangles_[3*t], &triangles_[3*t] + 3);
+					}
+				}
+			}
+
+		private:
+			Eigen::Vector3d normal(uint32_t a, uint32_t b, uint32_t c) const
+			{
+				Eigen::Vector3d n = (positions_[b] - positions_[a]).cross(positions_[c] - positions_[a]);
+				double len = n.norm();
+				return len > 0.0 ? Eigen::Vector3d(n/len) : n;
+			}
+
+			void add_border_quadrics()
+			{
+				for(std::size_t t=0; t<triangle_alive_.size(); t++) {
+					if(!triangle_alive_[t]) {
+						continue;
+					}
+					const uint32_t* v = &triangles_[3*t];
+					for(int k=0; k<3; k++) {
+						uint32_t a = v[k], b = v[(k + 1)%3];
+						if(count_triangles(a, b) != 1) {
+							continue;
+						}
+						Eigen::Vector3d edge = positions_[b] - positions_[a];
+						Eigen::Vector3d n = edge.cross(normal(v[0], v[1], v[2]));
+						double len = n.norm();
+						if(len == 0.0) {
+							continue;
+						}
+						quadric q = plane_quadric(n/len, positions_[a]);
+						quadrics_[a] += q;
+						quadrics_[b] += q;
+					}
+				}
+			}
+
+			std::size_t count_triangles(uint32_t a, uint32_t b) const
+			{
+				std::size_t n = 0;
+				for(uint32_t t : vertex_triangles_[a]) {
+					if(triangle_alive_[t] && has_vertex(t, b)) n++;
+				}
+				return n;
+			}
+
+			bool has_vertex(uint32_t t, uint32_t v) const
+			{ return triangles_[3*t] == v || triangles_[3*t+1] == v || triangles_[3*t+2] == v; }
+
+			void push_candidates(uint32_t v)
+			{
+				std::vector<uint32_t> neighbours;
+				for(uint32_t t : vertex_triangles_[v]) {
+					if(!triangle_alive_[t]) {
+						continue;
+					}
+					for(int k=0; k<3; k++) {
+						uint32_t n = triangles_[3*t+k];
+						if(n != v) neighbours.push_back(n);
+					}
+				}
+				std::sort(neighbours.begin(), neighbours.end());
+				neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+				for(uint32_t n : neighbours) {
+					quadric q = quadrics_[v] + quadrics_[n];
+					queue_.push(candidate{quadric_error(q, positions_[n]), v, n, versions_[v] + versions_[n]});
+					queue_.push(candidate{quadric_error(q, positions_[v]), n, v, versions_[v] + versions_[n]});
+				}
+			}
+
+			/** Moves 'from' onto 'to'; returns false if a triangle would flip */
+			bool collapse(uint32_t from, uint32_t to)
+			{
+				if(count_triangles(from, to) == 0) {
+					return false;
+				}
+				for(uint32_t t : vertex_triangles_[from]) {
+					if(!triangle_alive_[t] || has_vertex(t, to)) {
+						continue;
+					}
+					const uint32_t* v = &triangles_[3*t];
+					Eigen::Vector3d before = normal(v[0], v[1], v[2]);
+					uint32_t w[3] = { v[0] == from ? to : v[0], v[1] == from ? to : v[1], v[2] == from ? to : v[2] };
+					Eigen::Vector3d after = normal(w[0], w[1], w[2]);
+					if(before.dot(after) < 0.2) {
+						return false;
+					}
+				}
+				for(uint32_t t : vertex_triangles_[from]) {
+					if(!triangle_alive_[t]) {
+						continue;
+					}
+					if(has_vertex(t, to)) {
+						triangle_alive_[t] = false;
+						num_triangles_--;
+						continue;
+					}
+					for(int k=0; k<3; k++) {
+						if(triangles_[3*t+k] == from) triangles_[3*t+k] = to;
+					}
+					vertex_triangles_[to].push_back(t);
+				}
+				vertex_alive_[from] = false;
+				vertex_triangles_[from].clear();
+				quadrics_[to] += quadrics_[from];
+				versions_[to]++;
+				push_candidates(to);
+				return true;
+			}
+		};
+
+		/** Reads the first three floats of a vertex as its position */
+		template<typename V>
+		Eigen::Vector3f default_vertex_position(const V& v)
+		{
+			static_assert(sizeof(V) >= 3*sizeof(float), "vertex must start with three floats");
+			Eigen::Vector3f p;
+			std::memcpy(p.data(), &v, 3*sizeof(float));
+			return p;
+		}
+	}
+
+	/** Builds a chain of up to 'max_levels' levels, each with about 'ratio' times the triangles of the previous
+	 * Stops early when no collapse with an error below 'max_error' is possible.
+	 * Throws if an index is not smaller than the number of positions.
+	 */
+	inline lod_chain build_lod_chain(const std::vector<Eigen::Vector3f>& positions, const std::vector<uint32_t>& indices,
+		unsigned max_levels=6, float ratio=0.5f, float max_error=std::numeric_limits<float>::infinity())
+	{
+		lod_chain chain;
+		chain.indices = indices;
+		chain.levels.push_back({0, indices.size(), 0.0f});
+		std::vector<Eigen::Vector3d> p(positions.size());
+		for(std::size_t i=0; i<positions.size(); i++) {
+			p[i] = positions[i].cast<double>();
+		}
+		detail::qem_simplifier simplifier(p, indices);
+		double error = 0.0;
+		std::size_t target = simplifier.num_triangles();
+		while(chain.levels.size() < max_levels) {
+			std::size_t previous = chain.levels.back().num_indices/3;
+			target = static_cast<std::size_t>(float(target)*ratio);
+			error = simplifier.simplify(target, max_error, error);
+			if(simplifier.num_triangles() == 0 || simplifier.num_triangles() >= previous) {
+				break;
+			}
+			std::size_t offset = chain.indices.size();
+			simplifier.append_indices(chain.indices);
+			chain.levels.push_back({offset, chain.indices.size() - offset, static_cast<float>(error)});
+			if(simplifier.num_triangles() > target) {
+				break;
+			}
+		}
+		return chain;
+	}
+
+	/** Builds a chain from a triangle mesh; 'position' returns the position of a vertex */
+	template<typename V, int INDEX_TYPE>
+	lod_chain build_lod_chain(const mesh<V,GL_TRIANGLES,INDEX_TYPE>& m, unsigned max_levels=6, float ratio=0.5f,
+		float max_error=std::numeric_limits<float>::infinity(),
+		std::function<Eigen::Vector3f(const V&)> position=detail::default_vertex_position<V>)
+	{
+		std::vector<Eigen::Vector3f> positions;
+		positions.reserve(m.vertices.size());
+		for(const V& v : m.vertices) {
+			positions.push_back(position(v));
+		}
+		std::vector<uint32_t> indices;
+		indices.reserve(3*m.indices.size());
+		for(const auto& t : m.indices) {
+			indices.insert(indices.end(), t.begin(), t.end());
+		}
+		return build_lod_chain(positions, indices, max_levels, ratio, max_error);
+	}
+
+	/** A mesh with all levels of a lod_chain in one index buffer
+	 * Usage example:
+	 *   pastry::lod_mesh rock(rock_mesh.vertices, pastry::build_lod_chain(rock_mesh));
+	 *   rock.get_vertex_bo().set_layout({{"position", GL_FLOAT, 3}, {"normal", GL_FLOAT, 3}});
+	 *   // bind a vertex array for get_vertex_bo(), then every frame
+	 *   float pixels_per_unit = projection(1,1)*viewport_height/2;
+	 *   rock.render(rock.chain().select(distance, pixels_per_unit));
+	 */
+	struct lod_mesh
+	{
+	private:
+		array_buffer vertex_bo_;
+		element_array_buffer index_bo_;
+		lod_chain chain_;
+
+	public:
+		template<typename V>
+		lod_mesh(const std::vector<V>& vertices, const lod_chain& chain)
+		: chain_(chain)
+		{
+			vertex_bo_.init_data(vertices, GL_STATIC_DRAW);
+			index_bo_.init_data(chain.indices, GL_STATIC_DRAW);
+			chain_.indices.clear();
+		}
+
+		array_buffer& get_vertex_bo()
+		{ return vertex_bo_; }
+
+		const element_array_buffer& get_index_bo() const
+		{ return index_bo_; }
+
+		/** The levels; the indices themselves are only stored in the index buffer */
+		const lod_chain& chain() const
+		{ return chain_; }
+
+		std::size_t num_levels() const
+		{ return chain_.levels.size(); }
+
+		void render(std::size_t level) const
+		{
+			const lod_chain::level& l = chain_.levels[std::min(level, chain_.levels.size() - 1)];
+			index_bo_.bind();
+			detail::set_primitive_restart(GL_UNSIGNED_INT, false);
+			glDrawElements(GL_TRIANGLES, l.num_indices, GL_UNSIGNED_INT, reinterpret_cast<const void*>(l.index_offset*sizeof(uint32_t)));
+		}
+	};
+
+}}
+#endif
@@ -0,0 +1,124 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_MAPPED_FILE_HPP
+#define INCLUDED_PASTRY_PASTRYGL_MAPPED_FILE_HPP
+
+#include "gl.hpp"
+#include <cstdint>
+#include <string>
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+namespace danvil {
+namespace pastry
+{
+	namespace detail
+	{
+		/** Read-only memory mapping of a whole file */
+		struct mapped_file
+		{
+		private:
+			const unsigned char* data_ = nullptr;
+			std::size_t size_ = 0;
+		#ifdef _WIN32
+			HANDLE file_ = INVALID_HANDLE_VALUE;
+			HANDLE mapping_ = NULL;
+		#endif
+
+		public:
+			mapped_file(const std::string& filename)
+			{
+			#ifdef _WIN32
+				file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+					OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+				if(file_ == INVALID_HANDLE_VALUE) {
+					throw file_not_found(filename);
+				}
+				LARGE_INTEGER size;
+				GetFileSizeEx(file_, &size);
+				size_ = static_cast<std::size_t>(size.QuadPart);
+				if(size_ > 0) {
+					mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+					data_ = static_cast<const unsigned char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+				}
+			#else
+				int fd = ::open(filename.c_str(), O_RDONLY);
+				if(fd < 0) {
+					throw file_not_found(filename);
+				}
+				struct stat st;
+				fstat(fd, &st);
+				size_ = static_cast<std::size_t>(st.st_size);
+				if(size_ > 0) {
+					void* p = mmap(0, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+					if(p != MAP_FAILED) {
+						data_ = static_cast<const unsigned char*>(p);
+						madvise(p, size_, MADV_SEQUENTIAL);
+					}
+				}
+				::close(fd);
+			#endif
+				if(size_ > 0 && data_ == nullptr) {
+					throw exception("pastry: could not map file '" + filename + "'");
+				}
+			}
+
+			mapped_file(const mapped_file&) = delete;
+			mapped_file& operator=(const mapped_file&) = delete;
+
+			~mapped_file()
+			{
+			#ifdef _WIN32
+				if(data_) UnmapViewOfFile(data_);
+				if(mapping_) CloseHandle(mapping_);
+				CloseHandle(file_);
+			#else
+				if(data_) munmap(const_cast<unsigned char*>(data_), size_);
+			#endif
+			}
+
+			const unsigned char* data() const
+			{ return data_; }
+
+			std::size_t size() const
+			{ return size_; }
+
+			/** Checks that bytes at offset lie within the file without overflowing */
+			bool contains(uint64_t offset, uint64_t bytes) const
+			{ return offset <= size_ && bytes <= size_ - offset; }
+		};
+
+		/** Reads a little endian value independent of the byte order of the host */
+		inline uint32_t read_u32(const unsigned char* p)
+		{ return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24); }
+
+		inline uint64_t read_u64(const unsigned char* p)
+		{ return uint64_t(read_u32(p)) | (uint64_t(read_u32(p + 4)) << 32); }
+	}
+
+}}
+#endif
@@ -0,0 +1,286 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_MESH_FILE_HPP
+#define INCLUDED_PASTRY_PASTRYGL_MESH_FILE_HPP
+
+#include "gl.hpp"
+#include "gl_mapped_file.hpp"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	/** Binary mesh files
+	 * Little endian layout:
+	 *   char[8]  magic "PSTRYMSH"
+	 *   u32      version (1)
+	 *   u32      primitive mode, e.g. GL_TRIANGLES
+	 *   u32      index type (GL_UNSIGNED_BYTE/SHORT/INT, 0 if there are no indices)
+	 *   u32      number of layout items
+	 *   u64      number of vertices, number of indices
+	 *   u64      byte offsets of the vertex and the index data
+	 *   per layout item: u32 type, u32 size, u32 name length, name padded to 4 bytes
+	 * Vertex and index data are aligned to 16 bytes and stored in the byte order of
+	 * the host which wrote the file, so they can be copied into buffers unchanged.
+	 */
+	struct invalid_mesh_file
+	: public exception
+	{
+		invalid_mesh_file(const std::string& fn, const std::string& reason)
+		: exception("pastry: invalid mesh file '" + fn + "': " + reason)
+		{ }
+	};
+
+	namespace detail
+	{
+		static constexpr std::size_t mesh_file_header_size = 56;
+
+		inline std::size_t mesh_file_align(std::size_t n)
+		{ return (n + 15) & ~std::size_t(15); }
+
+		inline void write_u32(std::ostream& os, uint32_t v)
+		{
+			const char b[4] = { char(v), char(v >> 8), char(v >> 16), char(v >> 24) };
+			os.write(b, 4);
+		}
+
+		inline void write_u64(std::ostream& os, uint64_t v)
+		{
+			write_u32(os, uint32_t(v));
+			write_u32(os, uint32_t(v >> 32));
+		}
+
+		/** Layout items whose size va_bytes_total can compute; type 0 skips bytes */
+		inline bool valid_layout_item(const layout_item& item)
+		{
+			switch(item.type) {
+			case 0: return item.size > 0 && item.size <= 1024;
+			case GL_BYTE: case GL_UNSIGNED_BYTE:
+			case GL_SHORT: case GL_UNSIGNED_SHORT:
+			case GL_INT: case GL_UNSIGNED_INT:
+			case GL_FLOAT: case GL_DOUBLE:
+				return item.size >= 1 && item.size <= 4;
+			default: return false;
+			}
+		}
+
+		inline std::size_t index_type_size(GLenum type)
+		{
+			switch(type) {
+			case 0: return 0;
+			case GL_UNSIGNED_BYTE: return 1;
+			case GL_UNSIGNED_SHORT: return 2;
+			case GL_UNSIGNED_INT: return 4;
+			default: throw exception("pastry: invalid index type");
+			}
+		}
+
+		template<typename I> struct index_type;
+		template<> struct index_type<uint8_t> { static constexpr GLenum result = GL_UNSIGNED_BYTE; };
+		template<> struct index_type<uint16_t> { static constexpr GLenum result = GL_UNSIGNED_SHORT; };
+		template<> struct index_type<uint32_t> { static constexpr GLenum result = GL_UNSIGNED_INT; };
+	}
+
+	/** Writes vertices with the given layout and optional indices (index_type 0: none) */
+	inline void write_mesh_file(const std::string& fn, GLenum mode, const std::vector<detail::layout_item>& layout,
+		const void* vertices, std::size_t num_vertices, const void* indices, std::size_t num_indices, GLenum index_type)
+	{
+		std::ofstream os(fn, std::ios::binary);
+		if(!os) {
+			throw exception("pastry: could not open '" + fn + "' for writing");
+		}
+		std::size_t layout_bytes = 0;
+		for(const detail::layout_item& i : layout) {
+			layout_bytes += 12 + ((i.name.size() + 3) & ~std::size_t(3));
+		}
+		std::size_t vertex_bytes = num_vertices*detail::va_bytes_total(layout);
+		std::size_t index_bytes = (index_type == 0) ? 0 : num_indices*detail::index_type_size(index_type);
+		std::size_t vertex_offset = detail::mesh_file_align(detail::mesh_file_header_size + layout_bytes);
+		std::size_t index_offset = detail::mesh_file_align(vertex_offset + vertex_bytes);
+		os.write("PSTRYMSH", 8);
+		detail::write_u32(os, 1);
+		detail::write_u32(os, mode);
+		detail::write_u32(os, index_bytes == 0 ? 0 : index_type);
+		detail::write_u32(os, layout.size());
+		detail::write_u64(os, num_vertices);
+		detail::write_u64(os, index_bytes == 0 ? 0 : num_indices);
+		detail::write_u64(os, vertex_offset);
+		detail::write_u64(os, index_offset);
+		static const char zeros[16] = {};
+		for(const detail::layout_item& i : layout) {
+			detail::write_u32(os, i.type);
+			detail::write_u32(os, i.size);
+			detail::write_u32(os, i.name.size());
+			os.write(i.name.data(), i.name.size());
+			os.write(zeros, ((i.name.size() + 3) & ~std::size_t(3)) - i.name.size());
+		}
+		os.write(zeros, vertex_offset - detail::mesh_file_header_size - layout_bytes);
+		os.write(reinterpret_cast<const char*>(vertices), vertex_bytes);
+		if(index_bytes > 0) {
+			os.write(zeros, index_offset - vertex_offset - vertex_bytes);
+			os.write(reinterpret_cast<const char*>(indices), index_bytes);
+		}
+		if(!os) {
+			throw exception("pastry: could not write '" + fn + "'");
+		}
+	}
+
+	template<typename V>
+	void write_mesh_file(const std::string& fn, GLenum mode, const std::vector<detail::layout_item>& layout, const std::vector<V>& vertices)
+	{
+		if(sizeof(V) != detail::va_bytes_total(layout)) {
+			throw exception("pastry: vertex size does not match the layout");
+		}
+		write_mesh_file(fn, mode, layout, vertices.data(), vertices.size(), nullptr, 0, 0);
+	}
+
+	template<typename V, typename I>
+	void write_mesh_file(const std::string& fn, GLenum mode, const std::vector<detail::layout_item>& layout, const std::vector<V>& vertices, const std::vector<I>& indices)
+	{
+		if(sizeof(V) != detail::va_bytes_total(layout)) {
+			throw exception("pastry: vertex size does not match the layout");
+		}
+		write_mesh_file(fn, mode, layout, vertices.data(), vertices.size(), indices.data(), indices.size(), detail::index_type<I>::result);
+	}
+
+	/** A memory mapped mesh file
+	 * The vertex and index data are copied from the mapping straight into mapped
+	 * buffer objects, so the file is never read into intermediate vectors.
+	 * Usage example:
+	 *   pastry::single_mesh mesh = pastry::load_mesh_file("scan.mesh");
+	 *   pastry::vertex_array va(program, {{"position", mesh.get_vertex_bo()}});
+	 *   va.bind(); mesh.render();
+	 */
+	struct mesh_file
+	{
+	private:
+		std::shared_ptr<detail::mapped_file> file_;
+
+	public:
+		GLenum mode;
+		GLenum index_type; // 0 if the mesh has no indices
+		std::vector<detail::layout_item> layout;
+		std::size_t num_vertices, num_indices;
+		const unsigned char* vertices;
+		const unsigned char* indices;
+		std::size_t vertex_bytes, index_bytes;
+
+		mesh_file(const std::string& fn)
+		: file_(std::make_shared<detail::mapped_file>(fn))
+		{
+			const unsigned char* p = file_->data();
+			std::size_t size = file_->size();
+			if(size < detail::mesh_file_header_size || std::memcmp(p, "PSTRYMSH", 8) != 0) {
+				throw invalid_mesh_file(fn, "not a pastry mesh file");
+			}
+			if(detail::read_u32(p + 8) != 1) {
+				throw invalid_mesh_file(fn, "unsupported version");
+			}
+			mode = detail::read_u32(p + 12);
+			index_type = detail::read_u32(p + 16);
+			uint32_t num_items = detail::read_u32(p + 20);
+			num_vertices = detail::read_u64(p + 24);
+			num_indices = detail::read_u64(p + 32);
+			uint64_t vertex_offset = detail::read_u64(p + 40);
+			uint64_t index_offset = detail::read_u64(p + 48);
+			uint64_t pos = detail::mesh_file_header_size;
+			for(uint32_t i=0; i<num_items; i++) {
+				if(!file_->contains(pos, 12)) {
+					throw invalid_mesh_file(fn, "truncated layout");
+				}
+				detail::layout_item item;
+				item.type = detail::read_u32(p + pos);
+				item.size = static_cast<int>(std::min<uint32_t>(detail::read_u32(p + pos + 4), 1u << 30));
+				uint64_t len = detail::read_u32(p + pos + 8);
+				if(!file_->contains(pos + 12, len)) {
+					throw invalid_mesh_file(fn, "truncated layout");
+				}
+				if(!detail::valid_layout_item(item)) {
+					throw invalid_mesh_file(fn, "invalid layout item");
+				}
+				item.name.assign(reinterpret_cast<const char*>(p + pos + 12), len);
+				layout.push_back(item);
+				pos += 12 + ((len + 3) & ~uint64_t(3));
+			}
+			std::size_t index_size, stride = detail::va_bytes_total(layout);
+			try {
+				index_size = detail::index_type_size(index_type);
+			}
+			catch(const exception&) {
+				throw invalid_mesh_file(fn, "invalid index type");
+			}
+			// the products may not overflow before they are compared with the file size
+			if((num_vertices > 0 && (stride == 0 || num_vertices > size / stride))
+				|| (index_size > 0 && num_indices > size / index_size)) {
+				throw invalid_mesh_file(fn, "truncated data");
+			}
+			vertex_bytes = num_vertices*stride;
+			index_bytes = num_indices*index_size;
+			if(vertex_offset < pos) {
+				throw invalid_mesh_file(fn, "vertex data overlaps the layout");
+			}
+			if(!file_->contains(vertex_offset, vertex_bytes) || (index_bytes > 0 && !file_->contains(index_offset, index_bytes))) {
+				throw invalid_mesh_file(fn, "truncated data");
+			}
+			vertices = p + vertex_offset;
+			indices = (index_bytes > 0) ? p + index_offset : nullptr;
+		}
+
+		/** Creates a mesh whose buffers are filled directly from the mapping */
+		single_mesh create_mesh(GLenum usage=GL_STATIC_DRAW) const
+		{
+			single_mesh mesh(mode);
+			mesh.get_vertex_bo().set_layout(layout);
+			upload(mesh.get_vertex_bo(), vertices, vertex_bytes, usage);
+			if(index_bytes > 0) {
+				upload(mesh.get_index_bo(), indices, index_bytes, usage);
+			}
+			mesh.set_counts(num_vertices, index_bytes > 0 ? num_indices : 0, index_type);
+			return mesh;
+		}
+
+	private:
+		template<int TARGET>
+		static void upload(buffer<TARGET>& bo, const unsigned char* data, std::size_t num_bytes, GLenum usage)
+		{
+			bo.init_data(num_bytes, usage);
+			if(num_bytes == 0) {
+				return;
+			}
+			void* dst = bo.map(0, num_bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			if(!dst) {
+				throw exception("pastry: could not map buffer for mesh upload");
+			}
+			std::memcpy(dst, data, num_bytes);
+			bo.unmap();
+		}
+	};
+
+	inline single_mesh load_mesh_file(const std::string& fn, GLenum usage=GL_STATIC_DRAW)
+	{ return mesh_file(fn).create_mesh(usage); }
+
+}}
+#endif
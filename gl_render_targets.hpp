@@ -0,0 +1,249 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_RENDER_TARGETS_HPP
+#define INCLUDED_PASTRY_PASTRYGL_RENDER_TARGETS_HPP
+
+#include "gl.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	/** Hands out transient render target textures and framebuffers and recycles them
+	 * Textures are keyed by (width, height, internal format, samples). A texture is
+	 * in use from acquire() until release() or the end of the frame; afterwards the next
+	 * request with the same key gets it again. Textures and framebuffers which have not
+	 * been used for 'max_unused_frames' frames are released in next_frame().
+	 * Usage example:
+	 *   pastry::render_target_pool pool;
+	 *   // every frame
+	 *   pastry::texture_2d bright = pool.acquire(w/2, h/2, GL_RGBA16F);
+	 *   pool.get_framebuffer({bright}).bind();
+	 *   // ... render, then read 'bright' in the next pass
+	 *   pool.release(bright);
+	 *   pool.next_frame();
+	 */
+	struct render_target_pool
+	{
+	private:
+		template<typename T>
+		struct entry
+		{
+			unsigned width, height;
+			GLint internalformat;
+			unsigned samples;
+			T texture;
+			uint64_t last_used;
+			bool in_use;
+		};
+
+		struct framebuffer_entry
+		{
+			std::vector<glid_t> attachments; // colors followed by depth (or 0)
+			// keeps the attachments alive so that their names are not reused while cached
+			std::vector<detail::resource<rid::texture_base>> textures;
+			framebuffer fbo;
+			uint64_t last_used;
+		};
+
+		std::vector<entry<texture_2d>> textures_;
+		std::vector<entry<texture_2d_multisample>> multisample_textures_;
+		std::vector<framebuffer_entry> framebuffers_;
+		uint64_t frame_;
+		unsigned max_unused_frames_;
+
+	public:
+		render_target_pool(unsigned max_unused_frames=3)
+		: frame_(0), max_unused_frames_(max_unused_frames)
+		{}
+
+		/** A single sampled texture with one mipmap level, linear filtering and clamping */
+		texture_2d acquire(unsigned w, unsigned h, GLint internalformat)
+		{
+			entry<texture_2d>* e = find(textures_, w, h, internalformat, 0);
+			if(!e) {
+				texture_2d tex;
+				tex.create(GL_LINEAR, GL_CLAMP_TO_EDGE);
+				tex.storage(internalformat, w, h, 1);
+				textures_.push_back(entry<texture_2d>{w, h, internalformat, 0, tex, frame_, false});
+				e = &textures_.back();
+			}
+			e->in_use = true;
+			e->last_used = frame_;
+			return e->texture;
+		}
+
+		texture_2d_multisample acquire_multisample(unsigned w, unsigned h, GLint internalformat, unsigned samples)
+		{
+			entry<texture_2d_multisample>* e = find(multisample_textures_, w, h, internalformat, samples);
+			if(!e) {
+				texture_2d_multisample tex;
+				tex.storage(internalformat, w, h, samples);
+				multisample_textures_.push_back(entry<texture_2d_multisample>{w, h, internalformat, samples, tex, frame_, false});
+				e = &multisample_textures_.back();
+			}
+			e->in_use = true;
+			e->last_used = frame_;
+			return e->texture;
+		}
+
+		/** Hands a texture back before the end of the frame so that a later pass can reuse it */
+		template<GLenum TARGET>
+		void release(const texture_base<TARGET>& tex)
+		{
+			release(textures_, tex.id());
+			release(multisample_textures_, tex.id());
+		}
+
+		/** A framebuffer with the given color attachments and an optional depth attachment
+		 * Framebuffers are cached by their attachments. A cached framebuffer holds a
+		 * reference to its attachments, so textures which were not acquired from the pool
+		 * are deleted only when the framebuffer has not been used for 'max_unused_frames'.
+		 */
+		template<typename T>
+		framebuffer get_framebuffer(std::initializer_list<T> colors)
+		{ return get_framebuffer(std::vector<T>(colors)); }
+
+		template<typename T>
+		framebuffer get_framebuffer(std::initializer_list<T> colors, const T& depth)
+		{ return get_framebuffer(std::vector<T>(colors), &depth); }
+
+		template<typename T>
+		framebuffer get_framebuffer(const std::vector<T>& colors, const T* depth=nullptr)
+		{
+			std::vector<glid_t> key;
+			std::vector<detail::resource<rid::texture_base>> textures(colors.begin(), colors.end());
+			for(const T& c : colors) {
+				key.push_back(c.id());
+			}
+			key.push_back(depth ? depth->id() : 0);
+			if(depth) {
+				textures.push_back(*depth);
+			}
+			for(framebuffer_entry& e : framebuffers_) {
+				if(e.attachments == key) {
+					e.last_used = frame_;
+					return e.fbo;
+				}
+			}
+			framebuffer fbo;
+			if(!detail::dsa()) {
+				fbo.bind();
+			}
+			for(std::size_t i=0; i<colors.size(); i++) {
+				fbo.attach(GL_COLOR_ATTACHMENT0 + i, colors[i]);
+			}
+			if(depth) {
+				GLenum format = detail::get_texture_format_info(depth->internalformat()).format;
+				fbo.attach(format == GL_DEPTH_STENCIL ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT, *depth);
+			}
+			fbo.set_draw_buffers(colors.size());
+			if(!fbo.is_complete()) {
+				throw exception("pastry: incomplete framebuffer for pooled render targets");
+			}
+			framebuffers_.push_back(framebuffer_entry{key, textures, fbo, frame_});
+			return fbo;
+		}
+
+		/** Ends the frame: all textures become available and unused ones are deleted */
+		void next_frame()
+		{
+			frame_++;
+			std::vector<glid_t> removed;
+			collect(textures_, removed);
+			collect(multisample_textures_, removed);
+			auto it = framebuffers_.begin();
+			while(it != framebuffers_.end()) {
+				bool stale = (it->last_used + max_unused_frames_ < frame_);
+				for(glid_t id : it->attachments) {
+					stale = stale || std::find(removed.begin(), removed.end(), id) != removed.end();
+				}
+				if(stale) {
+					it = framebuffers_.erase(it);
+				}
+				else {
+					++it;
+				}
+			}
+		}
+
+		std::size_t num_textures() const
+		{ return textures_.size() + multisample_textures_.size(); }
+
+		std::size_t num_framebuffers() const
+		{ return framebuffers_.size(); }
+
+		/** Video memory used by all pooled textures */
+		std::size_t num_bytes() const
+		{
+			std::size_t n = 0;
+			for(const entry<texture_2d>& e : textures_) {
+				n += e.texture.num_bytes();
+			}
+			for(const entry<texture_2d_multisample>& e : multisample_textures_) {
+				n += e.texture.num_bytes();
+			}
+			return n;
+		}
+
+	private:
+		template<typename T>
+		entry<T>* find(std::vector<entry<T>>& list, unsigned w, unsigned h, GLint internalformat, unsigned samples)
+		{
+			for(entry<T>& e : list) {
+				if(!e.in_use && e.width == w && e.height == h && e.internalformat == internalformat && e.samples == samples) {
+					return &e;
+				}
+			}
+			return nullptr;
+		}
+
+		template<typename T>
+		static void release(std::vector<entry<T>>& list, glid_t id)
+		{
+			for(entry<T>& e : list) {
+				if(e.texture.id() == id) {
+					e.in_use = false;
+				}
+			}
+		}
+
+		template<typename T>
+		void collect(std::vector<entry<T>>& list, std::vector<glid_t>& removed)
+		{
+			auto it = list.begin();
+			while(it != list.end()) {
+				it->in_use = false;
+				if(it->last_used + max_unused_frames_ < frame_) {
+					removed.push_back(it->texture.id());
+					it = list.erase(it);
+				}
+				else {
+					++it;
+				}
+			}
+		}
+	};
+
+}}
+#endif
@@ -0,0 +1,528 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_TEXTURE_FILE_HPP
+#define INCLUDED_PASTRY_PASTRYGL_TEXTURE_FILE_HPP
+
+#include "gl.hpp"
+#include "gl_mapped_file.hpp"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	struct invalid_texture_file
+	: public exception
+	{
+		invalid_texture_file(const std::string& fn, const std::string& reason)
+		: exception("pastry: invalid texture file '" + fn + "': " + reason)
+		{ }
+	};
+
+	namespace detail
+	{
+		struct texture_file_format
+		{
+			GLint internalformat;
+			GLenum format;
+			GLenum type;
+			std::size_t bytes_per_pixel; // 0 for compressed formats and KTX
+		};
+
+		/** Maps a Vulkan format of a KTX2 file to OpenGL */
+		inline bool ktx2_format(uint32_t vk_format, texture_file_format& f)
+		{
+			#define PASTRY_KTX2_FORMAT(VK,IF,F,T,B) case VK: f = {IF,F,T,B}; return true;
+			switch(vk_format) {
+			PASTRY_KTX2_FORMAT(9, GL_R8, GL_RED, GL_UNSIGNED_BYTE, 1)
+			PASTRY_KTX2_FORMAT(16, GL_RG8, GL_RG, GL_UNSIGNED_BYTE, 2)
+			PASTRY_KTX2_FORMAT(23, GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE, 3)
+			PASTRY_KTX2_FORMAT(29, GL_SRGB8, GL_RGB, GL_UNSIGNED_BYTE, 3)
+			PASTRY_KTX2_FORMAT(37, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, 4)
+			PASTRY_KTX2_FORMAT(43, GL_SRGB8_ALPHA8, GL_RGBA, GL_UNSIGNED_BYTE, 4)
+			PASTRY_KTX2_FORMAT(44, GL_RGBA8, GL_BGRA, GL_UNSIGNED_BYTE, 4)
+			PASTRY_KTX2_FORMAT(50, GL_SRGB8_ALPHA8, GL_BGRA, GL_UNSIGNED_BYTE, 4)
+			PASTRY_KTX2_FORMAT(76, GL_R16F, GL_RED, GL_HALF_FLOAT, 2)
+			PASTRY_KTX2_FORMAT(83, GL_RG16F, GL_RG, GL_HALF_FLOAT, 4)
+			PASTRY_KTX2_FORMAT(97, GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT, 8)
+			PASTRY_KTX2_FORMAT(100, GL_R32F, GL_RED, GL_FLOAT, 4)
+			PASTRY_KTX2_FORMAT(103, GL_RG32F, GL_RG, GL_FLOAT, 8)
+			PASTRY_KTX2_FORMAT(109, GL_RGBA32F, GL_RGBA, GL_FLOAT, 16)
+			PASTRY_KTX2_FORMAT(131, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(132, GL_COMPRESSED_SRGB_S3TC_DXT1_EXT, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(133, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(134, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(135, GL_COMPRESSED_RGBA_S3TC_DXT3_EXT, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(136, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(137, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(138, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(139, GL_COMPRESSED_RED_RGTC1, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(140, GL_COMPRESSED_SIGNED_RED_RGTC1, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(141, GL_COMPRESSED_RG_RGTC2, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(142, GL_COMPRESSED_SIGNED_RG_RGTC2, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(143, GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(144, GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(145, GL_COMPRESSED_RGBA_BPTC_UNORM, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(146, GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(147, GL_COMPRESSED_RGB8_ETC2, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(148, GL_COMPRESSED_SRGB8_ETC2, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(149, GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(150, GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(151, GL_COMPRESSED_RGBA8_ETC2_EAC, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(152, GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(153, GL_COMPRESSED_R11_EAC, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(154, GL_COMPRESSED_SIGNED_R11_EAC, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(155, GL_COMPRESSED_RG11_EAC, 0, 0, 0)
+			PASTRY_KTX2_FORMAT(156, GL_COMPRESSED_SIGNED_RG11_EAC, 0, 0, 0)
+			default: return false;
+			}
+			#undef PASTRY_KTX2_FORMAT
+		}
+
+		/** Maps a DXGI format of a DDS file with DX10 header to OpenGL */
+		inline bool dxgi_format(uint32_t dxgi, texture_file_format& f)
+		{
+			#define PASTRY_DXGI_FORMAT(DX,IF,F,T,B) case DX: f = {IF,F,T,B}; return true;
+			switch(dxgi) {
+			PASTRY_DXGI_FORMAT(2, GL_RGBA32F, GL_RGBA, GL_FLOAT, 16)
+			PASTRY_DXGI_FORMAT(10, GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT, 8)
+			PASTRY_DXGI_FORMAT(28, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, 4)
+			PASTRY_DXGI_FORMAT(29, GL_SRGB8_ALPHA8, GL_RGBA, GL_UNSIGNED_BYTE, 4)
+			PASTRY_DXGI_FORMAT(41, GL_R32F, GL_RED, GL_FLOAT, 4)
+			PASTRY_DXGI_FORMAT(49, GL_RG8, GL_RG, GL_UNSIGNED_BYTE, 2)
+			PASTRY_DXGI_FORMAT(54, GL_R16F, GL_RED, GL_HALF_FLOAT, 2)
+			PASTRY_DXGI_FORMAT(61, GL_R8, GL_RED, GL_UNSIGNED_BYTE, 1)
+			PASTRY_DXGI_FORMAT(71, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(72, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(74, GL_COMPRESSED_RGBA_S3TC_DXT3_EXT, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(75, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(77, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(78, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(80, GL_COMPRESSED_RED_RGTC1, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(81, GL_COMPRESSED_SIGNED_RED_RGTC1, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(83, GL_COMPRESSED_RG_RGTC2, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(84, GL_COMPRESSED_SIGNED_RG_RGTC2, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(87, GL_RGBA8, GL_BGRA, GL_UNSIGNED_BYTE, 4)
+			PASTRY_DXGI_FORMAT(95, GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(96, GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(98, GL_COMPRESSED_RGBA_BPTC_UNORM, 0, 0, 0)
+			PASTRY_DXGI_FORMAT(99, GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM, 0, 0, 0)
+			default: return false;
+			}
+			#undef PASTRY_DXGI_FORMAT
+		}
+
+		/** Bytes per pixel of uncompressed data with a format and type like GL_RGB and GL_FLOAT; 0 if unknown */
+		inline std::size_t pixel_bytes(GLenum format, GLenum type)
+		{
+			switch(type) {
+			case GL_UNSIGNED_SHORT_5_6_5: case GL_UNSIGNED_SHORT_5_6_5_REV:
+			case GL_UNSIGNED_SHORT_4_4_4_4: case GL_UNSIGNED_SHORT_4_4_4_4_REV:
+			case GL_UNSIGNED_SHORT_5_5_5_1: case GL_UNSIGNED_SHORT_1_5_5_5_REV:
+				return 2;
+			case GL_UNSIGNED_INT_8_8_8_8: case GL_UNSIGNED_INT_8_8_8_8_REV:
+			case GL_UNSIGNED_INT_10_10_10_2: case GL_UNSIGNED_INT_2_10_10_10_REV:
+			case GL_UNSIGNED_INT_10F_11F_11F_REV: case GL_UNSIGNED_INT_5_9_9_9_REV:
+			case GL_UNSIGNED_INT_24_8:
+				return 4;
+			case GL_FLOAT_32_UNSIGNED_INT_24_8_REV:
+				return 8;
+			}
+			std::size_t component;
+			switch(type) {
+			case GL_BYTE: case GL_UNSIGNED_BYTE: component = 1; break;
+			case GL_SHORT: case GL_UNSIGNED_SHORT: case GL_HALF_FLOAT: component = 2; break;
+			case GL_INT: case GL_UNSIGNED_INT: case GL_FLOAT: component = 4; break;
+			default: return 0;
+			}
+			switch(format) {
+			case GL_RED: case GL_GREEN: case GL_BLUE: case GL_RED_INTEGER:
+			case GL_DEPTH_COMPONENT: case GL_STENCIL_INDEX:
+				return component;
+			case GL_RG: case GL_RG_INTEGER:
+				return 2*component;
+			case GL_RGB: case GL_BGR: case GL_RGB_INTEGER: case GL_BGR_INTEGER:
+				return 3*component;
+			case GL_RGBA: case GL_BGRA: case GL_RGBA_INTEGER: case GL_BGRA_INTEGER:
+				return 4*component;
+			default: return 0;
+			}
+		}
+
+		inline uint32_t fourcc(const char* s)
+		{ return read_u32(reinterpret_cast<const unsigned char*>(s)); }
+	}
+
+	/** A KTX, KTX2 or DDS texture container which is mapped into memory
+	 * Image data is not copied: every level and face points directly into the
+	 * mapping and is uploaded from there.
+	 * Usage example:
+	 *   pastry::texture_file file("sky.ktx");
+	 *   pastry::texture_cube_map sky = file.create_texture_cube_map();
+	 */
+	struct texture_file
+	{
+		struct image
+		{
+			const unsigned char* data;
+			std::size_t size;
+		};
+
+	private:
+		std::string filename_;
+		std::shared_ptr<detail::mapped_file> file_;
+		detail::texture_file_format format_;
+		unsigned width_, height_;
+		unsigned levels_, faces_;
+		unsigned unpack_alignment_;
+		std::vector<image> images_; // level major, face minor
+
+	public:
+		texture_file(const std::string& filename)
+		: filename_(filename), file_(std::make_shared<detail::mapped_file>(filename)),
+		  width_(0), height_(0), levels_(1), faces_(1), unpack_alignment_(1)
+		{
+			const unsigned char* p = file_->data();
+			std::size_t n = file_->size();
+			static const unsigned char ktx1_id[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+			static const unsigned char ktx2_id[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+			if(n >= 64 && std::memcmp(p, ktx1_id, 12) == 0) {
+				parse_ktx1();
+			}
+			else if(n >= 80 && std::memcmp(p, ktx2_id, 12) == 0) {
+				parse_ktx2();
+			}
+			else if(n >= 128 && detail::read_u32(p) == detail::fourcc("DDS ")) {
+				parse_dds();
+			}
+			else {
+				fail("unknown container format");
+			}
+		}
+
+		GLenum target() const
+		{ return faces_ == 6 ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D; }
+
+		GLint internalformat() const
+		{ return format_.internalformat; }
+
+		bool is_compressed() const
+		{ return detail::compressed_block_bytes(format_.internalformat) != 0; }
+
+		unsigned width() const
+		{ return width_; }
+
+		unsigned height() const
+		{ return height_; }
+
+		unsigned levels() const
+		{ return levels_; }
+
+		unsigned faces() const
+		{ return faces_; }
+
+		const image& get_image(unsigned level, unsigned face=0) const
+		{ return images_[level*faces_ + face]; }
+
+		/** Uploads all levels into a 2D texture
+		 * Allocates immutable storage if ARB_texture_storage is available.
+		 */
+		void upload(texture_2d& tex) const
+		{
+			if(target() != GL_TEXTURE_2D) {
+				fail("not a 2D texture");
+			}
+			bool immutable = GLEW_ARB_texture_storage;
+			if(immutable) {
+				tex.storage(format_.internalformat, width_, height_, levels_);
+			}
+			detail::unpack_rows unpack(unpack_alignment_);
+			for(unsigned level=0; level<levels_; level++) {
+				unsigned w = detail::mipmap_size(width_, level);
+				unsigned h = detail::mipmap_size(height_, level);
+				const image& img = get_image(level);
+				if(is_compressed()) {
+					if(immutable) tex.set_compressed_level(level, format_.internalformat, w, h, img.size, img.data);
+					else tex.set_compressed_image(level, format_.internalformat, w, h, img.size, img.data);
+				}
+				else {
+					if(immutable) tex.set_level_impl(level, w, h, format_.format, format_.type, img.data);
+					else tex.set_image_impl(level, format_.internalformat, w, h, format_.format, format_.type, img.data);
+				}
+			}
+			set_levels(tex);
+		}
+
+		/** Uploads all levels of all faces into a cube map */
+		void upload(texture_cube_map& tex) const
+		{
+			if(target() != GL_TEXTURE_CUBE_MAP) {
+				fail("not a cube map");
+			}
+			bool immutable = GLEW_ARB_texture_storage;
+			if(immutable) {
+				tex.storage(format_.internalformat, width_, height_, levels_);
+			}
+			detail::unpack_rows unpack(unpack_alignment_);
+			for(unsigned level=0; level<levels_; level++) {
+				unsigned w = detail::mipmap_size(width_, level);
+				unsigned h = detail::mipmap_size(height_, level);
+				for(unsigned face=0; face<6; face++) {
+					GLenum t = GL_TEXTURE_CUBE_MAP_POSITIVE_X + face;
+					const image& img = get_image(level, face);
+					if(is_compressed()) {
+						if(immutable) tex.set_compressed_level(t, level, format_.internalformat, w, h, img.size, img.data);
+						else tex.set_compressed_image(t, level, format_.internalformat, w, h, img.size, img.data);
+					}
+					else {
+						if(immutable) tex.set_level_impl(t, level, w, h, format_.format, format_.type, img.data);
+						else tex.set_image_impl(t, level, format_.internalformat, w, h, format_.format, format_.type, img.data);
+					}
+				}
+			}
+			set_levels(tex);
+		}
+
+		texture_2d create_texture_2d() const
+		{
+			texture_2d tex;
+			tex.create();
+			upload(tex);
+			return tex;
+		}
+
+		texture_cube_map create_texture_cube_map() const
+		{
+			texture_cube_map tex;
+			tex.create(GL_LINEAR, GL_CLAMP_TO_EDGE);
+			upload(tex);
+			return tex;
+		}
+
+	private:
+		void fail(const std::string& reason) const
+		{ throw invalid_texture_file(filename_, reason); }
+
+		uint64_t level_size(unsigned level) const
+		{
+			uint64_t w = detail::mipmap_size(width_, level);
+			uint64_t h = detail::mipmap_size(height_, level);
+			if(is_compressed()) {
+				return ((w + 3)/4) * ((h + 3)/4) * detail::compressed_block_bytes(format_.internalformat);
+			}
+			uint64_t row = w * format_.bytes_per_pixel;
+			row = (row + unpack_alignment_ - 1) / unpack_alignment_ * unpack_alignment_;
+			return row * h;
+		}
+
+		void add_image(uint64_t offset, uint64_t size)
+		{
+			if(!file_->contains(offset, size)) {
+				fail("file is truncated");
+			}
+			images_.push_back({file_->data() + offset, static_cast<std::size_t>(size)});
+		}
+
+		/** Larger than any OpenGL implementation supports; keeps level sizes from overflowing */
+		static const unsigned max_size = 1u << 16;
+
+		void check_dimensions(unsigned depth, unsigned layers) const
+		{
+			if(width_ == 0 || height_ == 0 || width_ > max_size || height_ > max_size) {
+				fail("invalid image size");
+			}
+			if(levels_ > texture_2d::mipmap_levels(width_, height_)) {
+				fail("more levels than a full mipmap chain");
+			}
+			if(depth > 1 || layers > 1) {
+				fail("3D and array textures are not supported");
+			}
+			if(faces_ != 1 && faces_ != 6) {
+				fail("invalid number of faces");
+			}
+		}
+
+		void parse_ktx1()
+		{
+			const unsigned char* p = file_->data();
+			if(detail::read_u32(p + 12) != 0x04030201) {
+				fail("big endian KTX files are not supported");
+			}
+			format_.type = detail::read_u32(p + 16);
+			format_.format = detail::read_u32(p + 24);
+			format_.internalformat = detail::read_u32(p + 28);
+			width_ = detail::read_u32(p + 36);
+			height_ = detail::read_u32(p + 40);
+			unsigned depth = detail::read_u32(p + 44);
+			unsigned layers = detail::read_u32(p + 48);
+			faces_ = detail::read_u32(p + 52);
+			levels_ = std::max(1u, detail::read_u32(p + 56));
+			uint64_t offset = 64 + uint64_t(detail::read_u32(p + 60));
+			check_dimensions(depth, layers);
+			format_.bytes_per_pixel = 0;
+			if(!is_compressed()) {
+				if(format_.type == 0) {
+					fail("unsupported compressed format");
+				}
+				format_.bytes_per_pixel = detail::pixel_bytes(format_.format, format_.type);
+				if(format_.bytes_per_pixel == 0) {
+					fail("unsupported format or type");
+				}
+			}
+			// KTX rows are padded to 4 bytes which matches the default unpack alignment
+			unpack_alignment_ = 4;
+			for(unsigned level=0; level<levels_; level++) {
+				if(!file_->contains(offset, 4)) {
+					fail("file is truncated");
+				}
+				uint64_t size = detail::read_u32(p + offset);
+				offset += 4;
+				if(size < level_size(level)) {
+					fail("image is smaller than its level");
+				}
+				for(unsigned face=0; face<faces_; face++) {
+					add_image(offset, size);
+					offset += (size + 3) & ~uint64_t(3);
+				}
+			}
+		}
+
+		void parse_ktx2()
+		{
+			const unsigned char* p = file_->data();
+			uint32_t vk_format = detail::read_u32(p + 12);
+			width_ = detail::read_u32(p + 20);
+			height_ = detail::read_u32(p + 24);
+			unsigned depth = detail::read_u32(p + 28);
+			unsigned layers = detail::read_u32(p + 32);
+			faces_ = detail::read_u32(p + 36);
+			levels_ = std::max(1u, detail::read_u32(p + 40));
+			if(detail::read_u32(p + 44) != 0) {
+				fail("supercompressed KTX2 files are not supported");
+			}
+			if(!detail::ktx2_format(vk_format, format_)) {
+				fail("unsupported format");
+			}
+			check_dimensions(depth, layers);
+			if(!file_->contains(80, 24*uint64_t(levels_))) {
+				fail("file is truncated");
+			}
+			for(unsigned level=0; level<levels_; level++) {
+				const unsigned char* index = p + 80 + 24*level;
+				uint64_t offset = detail::read_u64(index);
+				uint64_t bytes = detail::read_u64(index + 8);
+				if(!file_->contains(offset, bytes)) {
+					fail("file is truncated");
+				}
+				uint64_t size = bytes / faces_;
+				if(size < level_size(level)) {
+					fail("image is smaller than its level");
+				}
+				for(unsigned face=0; face<faces_; face++) {
+					add_image(offset + face*size, size);
+				}
+			}
+		}
+
+		void parse_dds()
+		{
+			const unsigned char* p = file_->data();
+			const unsigned char* pf = p + 76;
+			height_ = detail::read_u32(p + 12);
+			width_ = detail::read_u32(p + 16);
+			unsigned depth = detail::read_u32(p + 24);
+			levels_ = std::max(1u, detail::read_u32(p + 28));
+			uint32_t pf_flags = detail::read_u32(pf + 4);
+			uint32_t cc = detail::read_u32(pf + 8);
+			uint32_t caps2 = detail::read_u32(p + 112);
+			unsigned layers = 1;
+			faces_ = (caps2 & 0x200) ? 6 : 1; // DDSCAPS2_CUBEMAP
+			uint64_t offset = 128;
+			if((pf_flags & 0x4) && cc == detail::fourcc("DX10")) {
+				if(file_->size() < 148) {
+					fail("file is truncated");
+				}
+				if(!detail::dxgi_format(detail::read_u32(p + 128), format_)) {
+					fail("unsupported DXGI format");
+				}
+				faces_ = (detail::read_u32(p + 136) & 0x4) ? 6 : 1; // D3D10_RESOURCE_MISC_TEXTURECUBE
+				layers = detail::read_u32(p + 140);
+				offset = 148;
+			}
+			else if(pf_flags & 0x4) { // DDPF_FOURCC
+				if(cc == detail::fourcc("DXT1")) format_ = {GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, 0, 0, 0};
+				else if(cc == detail::fourcc("DXT3")) format_ = {GL_COMPRESSED_RGBA_S3TC_DXT3_EXT, 0, 0, 0};
+				else if(cc == detail::fourcc("DXT5")) format_ = {GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, 0, 0, 0};
+				else if(cc == detail::fourcc("ATI1") || cc == detail::fourcc("BC4U")) format_ = {GL_COMPRESSED_RED_RGTC1, 0, 0, 0};
+				else if(cc == detail::fourcc("BC4S")) format_ = {GL_COMPRESSED_SIGNED_RED_RGTC1, 0, 0, 0};
+				else if(cc == detail::fourcc("ATI2") || cc == detail::fourcc("BC5U")) format_ = {GL_COMPRESSED_RG_RGTC2, 0, 0, 0};
+				else if(cc == detail::fourcc("BC5S")) format_ = {GL_COMPRESSED_SIGNED_RG_RGTC2, 0, 0, 0};
+				else fail("unsupported FourCC");
+			}
+			else if(pf_flags & 0x40) { // DDPF_RGB
+				uint32_t bits = detail::read_u32(pf + 12);
+				uint32_t rmask = detail::read_u32(pf + 16);
+				if(bits == 32 && rmask == 0x00FF0000) format_ = {GL_RGBA8, GL_BGRA, GL_UNSIGNED_BYTE, 4};
+				else if(bits == 32 && rmask == 0x000000FF) format_ = {GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, 4};
+				else if(bits == 24 && rmask == 0x00FF0000) format_ = {GL_RGB8, GL_BGR, GL_UNSIGNED_BYTE, 3};
+				else fail("unsupported RGB pixel format");
+			}
+			else {
+				fail("unsupported pixel format");
+			}
+			check_dimensions(depth, layers);
+			// DDS stores all levels of a face before the next face
+			std::vector<image> face_major;
+			for(unsigned face=0; face<faces_; face++) {
+				for(unsigned level=0; level<levels_; level++) {
+					uint64_t size = level_size(level);
+					add_image(offset, size);
+					offset += size;
+				}
+			}
+			face_major.swap(images_);
+			for(unsigned level=0; level<levels_; level++) {
+				for(unsigned face=0; face<faces_; face++) {
+					images_.push_back(face_major[face*levels_ + level]);
+				}
+			}
+		}
+
+		template<GLenum TARGET>
+		void set_levels(texture_base<TARGET>& tex) const
+		{
+			tex.set_base_level(0);
+			tex.set_max_level(levels_ - 1);
+			if(levels_ > 1) {
+				tex.set_min_filter(GL_LINEAR_MIPMAP_LINEAR);
+			}
+		}
+	};
+
+	inline texture_2d load_texture_2d(const std::string& filename)
+	{ return texture_file{filename}.create_texture_2d(); }
+
+	inline texture_cube_map load_texture_cube_map(const std::string& filename)
+	{ return texture_file{filename}.create_texture_cube_map(); }
+
+}}
+#endif
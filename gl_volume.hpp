@@ -0,0 +1,328 @@
+// Copyright (c) 2014 David Weikersdorfer
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef INCLUDED_PASTRY_PASTRYGL_VOLUME_HPP
+#define INCLUDED_PASTRY_PASTRYGL_VOLUME_HPP
+
+#include "gl.hpp"
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace danvil {
+namespace pastry
+{
+	/** Integer coordinates of a brick in the brick grid of a volume */
+	struct brick_id
+	{
+		unsigned x, y, z;
+	};
+
+	/** GLSL function which maps a voxel position to a position in the brick atlas
+	 * Needs the uniforms of brick_cache::set_uniforms. Returns false if the brick is
+	 * not resident.
+	 */
+	inline std::string brick_cache_glsl()
+	{
+		return
+			"uniform usampler3D page_table;\n"
+			"uniform float brick_size;\n"
+			"uniform float brick_border;\n"
+			"uniform vec3 atlas_size;\n"
+			"bool brick_lookup(vec3 voxel, out vec3 atlas_coord) {\n"
+			"	uvec4 e = texelFetch(page_table, ivec3(voxel / brick_size), 0);\n"
+			"	if(e.w == 0u) return false;\n"
+			"	vec3 local = mod(voxel, brick_size);\n"
+			"	atlas_coord = (vec3(e.xyz) * (brick_size + 2.0*brick_border) + brick_border + local) / atlas_size;\n"
+			"	return true;\n"
+			"}\n";
+	}
+
+	/** Streams fixed size bricks of a volume which is larger than GPU memory into a 3D atlas
+	 * The atlas holds slots of (brick_size + 2*border)^3 voxels. The border voxels are
+	 * copies of the neighbouring bricks so that trilinear filtering works across bricks.
+	 * A page table texture (GL_RGBA16UI, one texel per brick) holds the atlas slot of
+	 * every resident brick in xyz and 1 in w, or 0 in w if the brick is not resident.
+	 * Every frame the renderer requests the bricks it will sample, e.g. from a
+	 * frustum test of the brick grid or from a GPU feedback buffer, and calls update().
+	 * Missing bricks are filled by a callback and replace the least recently used ones.
+	 * Usage example:
+	 *   pastry::brick_cache<unsigned short,1> cache(GL_R16, {4096,4096,2048}, 32, {16,16,8},
+	 *       [&](const pastry::brick_id& b, unsigned short* out) { read_brick(b, out); });
+	 *   // every frame
+	 *   for(auto b : visible_bricks) cache.request(b);
+	 *   cache.update(64);
+	 *   cache.set_uniforms(prog, "volume");
+	 */
+	template<typename S, unsigned C>
+	struct brick_cache
+	{
+	public:
+		typedef std::function<void(const brick_id&, S*)> fill_function;
+
+	private:
+		struct slot
+		{
+			uint64_t brick; // key of the brick in the slot or ~0 if empty
+			uint64_t last_used;
+			std::list<unsigned>::iterator lru;
+		};
+
+		std::array<unsigned,3> volume_size_;
+		unsigned brick_size_;
+		unsigned border_;
+		std::array<unsigned,3> num_bricks_;
+		std::array<unsigned,3> num_slots_;
+		fill_function fill_;
+
+		texture_3d atlas_;
+		texture_3d page_table_;
+
+		std::vector<slot> slots_;
+		std::list<unsigned> lru_; // least recently used first
+		std::unordered_map<uint64_t,unsigned> resident_;
+		std::vector<brick_id> requests_;
+		std::vector<S> staging_;
+		uint64_t frame_;
+		std::size_t num_uploads_;
+
+		mutable glid_t uniforms_program_;
+		mutable uniform<float> brick_size_uniform_, brick_border_uniform_;
+		mutable uniform<Eigen::Vector3f> atlas_size_uniform_;
+
+	public:
+		/**
+		 * volume_size: size of the volume in voxels
+		 * brick_size: edge length of a brick in voxels (without border)
+		 * atlas_slots: number of brick slots of the atlas along x, y and z
+		 * fill: writes the (brick_size + 2*border)^3 voxels of a brick including its border
+		 */
+		brick_cache(GLint internalformat, std::array<unsigned,3> volume_size, unsigned brick_size,
+			std::array<unsigned,3> atlas_slots, fill_function fill, unsigned border=1)
+		: volume_size_(volume_size), brick_size_(brick_size), border_(border),
+		  num_slots_(atlas_slots), fill_(fill), frame_(1), num_uploads_(0),
+		  uniforms_program_(detail::INVALID_ID)
+		{
+			for(int i=0; i<3; i++) {
+				num_bricks_[i] = (volume_size[i] + brick_size - 1) / brick_size;
+			}
+			unsigned p = padded_size();
+			atlas_.create(GL_LINEAR, GL_CLAMP_TO_EDGE);
+			atlas_.storage(internalformat, num_slots_[0]*p, num_slots_[1]*p, num_slots_[2]*p, 1);
+			page_table_.create(GL_NEAREST, GL_CLAMP_TO_EDGE);
+			page_table_.storage(GL_RGBA16UI, num_bricks_[0], num_bricks_[1], num_bricks_[2], 1);
+			std::vector<uint16_t> empty(4*num_bricks_[0]*num_bricks_[1]*num_bricks_[2], 0);
+			page_table_.set_sub_image_impl(0, 0, 0, 0, num_bricks_[0], num_bricks_[1], num_bricks_[2],
+				GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, empty.data());
+			unsigned n = num_slots_[0]*num_slots_[1]*num_slots_[2];
+			slots_.resize(n);
+			for(unsigned i=0; i<n; i++) {
+				slots_[i].brick = ~uint64_t(0);
+				slots_[i].last_used = 0;
+				slots_[i].lru = lru_.insert(lru_.end(), i);
+			}
+			staging_.resize(p*p*p*C);
+		}
+
+		const texture_3d& atlas() const
+		{ return atlas_; }
+
+		const texture_3d& page_table() const
+		{ return page_table_; }
+
+		unsigned brick_size() const
+		{ return brick_size_; }
+
+		unsigned padded_size() const
+		{ return brick_size_ + 2*border_; }
+
+		const std::array<unsigned,3>& num_bricks() const
+		{ return num_bricks_; }
+
+		/** Number of bricks uploaded in the last update */
+		std::size_t num_uploads() const
+		{ return num_uploads_; }
+
+		std::size_t num_resident() const
+		{ return resident_.size(); }
+
+		bool is_resident(const brick_id& b) const
+		{ return resident_.find(key(b)) != resident_.end(); }
+
+		/** Marks a brick as needed for the current frame */
+		void request(const brick_id& b)
+		{
+			if(b.x >= num_bricks_[0] || b.y >= num_bricks_[1] || b.z >= num_bricks_[2]) {
+				return;
+			}
+			auto it = resident_.find(key(b));
+			if(it != resident_.end()) {
+				touch(it->second);
+			}
+			else {
+				requests_.push_back(b);
+			}
+		}
+
+		/** Requests all bricks which intersect the voxel box [min,max) */
+		void request_box(std::array<unsigned,3> min, std::array<unsigned,3> max)
+		{
+			for(unsigned z=min[2]/brick_size_; z*brick_size_<max[2] && z<num_bricks_[2]; z++) {
+				for(unsigned y=min[1]/brick_size_; y*brick_size_<max[1] && y<num_bricks_[1]; y++) {
+					for(unsigned x=min[0]/brick_size_; x*brick_size_<max[0] && x<num_bricks_[0]; x++) {
+						request(brick_id{x, y, z});
+					}
+				}
+			}
+		}
+
+		/** Uploads up to max_uploads missing bricks requested in this frame and starts a new frame
+		 * Bricks which were requested in this frame are never evicted; requests which
+		 * do not fit are dropped and must be repeated in the next frame.
+		 */
+		void update(std::size_t max_uploads)
+		{
+			num_uploads_ = 0;
+			unsigned p = padded_size();
+			for(const brick_id& b : requests_) {
+				if(num_uploads_ >= max_uploads) {
+					break;
+				}
+				uint64_t k = key(b);
+				if(resident_.find(k) != resident_.end()) {
+					continue; // requested twice in this frame
+				}
+				unsigned s = lru_.front();
+				if(slots_[s].last_used == frame_) {
+					break; // the atlas is full with bricks of this frame
+				}
+				evict(s);
+				fill_(b, staging_.data());
+				std::array<unsigned,3> sc = slot_coord(s);
+				atlas_.set_sub_image<S,C>(sc[0]*p, sc[1]*p, sc[2]*p, p, p, p, staging_.data());
+				slots_[s].brick = k;
+				resident_[k] = s;
+				touch(s);
+				set_page(b, sc, 1);
+				num_uploads_ ++;
+			}
+			requests_.clear();
+			frame_ ++;
+		}
+
+		/** Binds page table and atlas to the units the program assigned to their samplers
+		 * and sets the uniforms of brick_cache_glsl. atlas_sampler: name of the sampler3D
+		 * which reads the atlas. Uniform locations are looked up again only when the
+		 * program changes.
+		 */
+		void set_uniforms(const program& prog, const std::string& atlas_sampler) const
+		{
+			if(prog.id() != uniforms_program_) {
+				uniforms_program_ = prog.id();
+				brick_size_uniform_ = prog.get_uniform<float>("brick_size");
+				brick_border_uniform_ = prog.get_uniform<float>("brick_border");
+				atlas_size_uniform_ = prog.get_uniform<Eigen::Vector3f>("atlas_size");
+			}
+			int page_table_unit = prog.sampler_unit("page_table");
+			if(page_table_unit >= 0) {
+				page_table_.bind_unit(page_table_unit);
+			}
+			int atlas_unit = prog.sampler_unit(atlas_sampler);
+			if(atlas_unit >= 0) {
+				atlas_.bind_unit(atlas_unit);
+			}
+			brick_size_uniform_.set(float(brick_size_));
+			brick_border_uniform_.set(float(border_));
+			atlas_size_uniform_.set(Eigen::Vector3f(
+				float(atlas_.width()), float(atlas_.height()), float(atlas_.depth())));
+		}
+
+		/** Copies a brick with border from a volume in memory, e.g. a memory-mapped raw file
+		 * Voxels outside of the volume are clamped to the nearest voxel.
+		 */
+		static void extract_brick(const S* volume, std::array<unsigned,3> volume_size,
+			unsigned brick_size, unsigned border, const brick_id& b, S* out)
+		{
+			unsigned p = brick_size + 2*border;
+			for(unsigned z=0; z<p; z++) {
+				std::size_t vz = clamp(int(b.z*brick_size + z) - int(border), volume_size[2]);
+				for(unsigned y=0; y<p; y++) {
+					std::size_t vy = clamp(int(b.y*brick_size + y) - int(border), volume_size[1]);
+					for(unsigned x=0; x<p; x++) {
+						std::size_t vx = clamp(int(b.x*brick_size + x) - int(border), volume_size[0]);
+						const S* src = volume + ((vz*volume_size[1] + vy)*volume_size[0] + vx)*C;
+						std::copy(src, src + C, out);
+						out += C;
+					}
+				}
+			}
+		}
+
+	private:
+		static std::size_t clamp(int v, unsigned size)
+		{ return v < 0 ? 0 : (unsigned(v) >= size ? size - 1 : v); }
+
+		uint64_t key(const brick_id& b) const
+		{ return (uint64_t(b.z)*num_bricks_[1] + b.y)*num_bricks_[0] + b.x; }
+
+		brick_id brick_from_key(uint64_t k) const
+		{
+			brick_id b;
+			b.x = k % num_bricks_[0];
+			k /= num_bricks_[0];
+			b.y = k % num_bricks_[1];
+			b.z = k / num_bricks_[1];
+			return b;
+		}
+
+		std::array<unsigned,3> slot_coord(unsigned s) const
+		{
+			return {{ s % num_slots_[0], (s / num_slots_[0]) % num_slots_[1], s / (num_slots_[0]*num_slots_[1]) }};
+		}
+
+		void touch(unsigned s)
+		{
+			slots_[s].last_used = frame_;
+			lru_.splice(lru_.end(), lru_, slots_[s].lru);
+		}
+
+		void evict(unsigned s)
+		{
+			if(slots_[s].brick == ~uint64_t(0)) {
+				return;
+			}
+			resident_.erase(slots_[s].brick);
+			set_page(brick_from_key(slots_[s].brick), {{0, 0, 0}}, 0);
+			slots_[s].brick = ~uint64_t(0);
+		}
+
+		void set_page(const brick_id& b, const std::array<unsigned,3>& sc, uint16_t resident)
+		{
+			uint16_t entry[4] = { uint16_t(sc[0]), uint16_t(sc[1]), uint16_t(sc[2]), resident };
+			page_table_.set_sub_image_impl(0, b.x, b.y, b.z, 1, 1, 1, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, entry);
+		}
+	};
+
+}}
+#endif